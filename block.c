@@ -1378,6 +1378,9 @@ static void bdrv_child_cb_detach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
 
+    /* Cached block status may point into the child that goes away */
+    bdrv_bsc_invalidate_all(bs);
+
     if (child->role & BDRV_CHILD_COW) {
         bdrv_backing_detach(child);
     }
@@ -4476,6 +4479,8 @@ static void bdrv_close(BlockDriverState *bs)
     bdrv_release_named_dirty_bitmaps(bs);
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    bdrv_bsc_free(bs);
+
     QLIST_FOREACH_SAFE(ban, &bs->aio_notifiers, list, ban_next) {
         g_free(ban);
     }
@@ -4762,6 +4767,8 @@ BlockDriverState *bdrv_insert_node(BlockDriverState *bs, QDict *node_options,
 int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -4770,7 +4777,12 @@ int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        /* Repairs change the metadata without going through the I/O path */
+        bdrv_bsc_invalidate_all(bs);
+    }
+    return ret;
 }
 
 /*
@@ -5633,6 +5645,24 @@ BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
     return drv->bdrv_get_specific_stats(bs);
 }
 
+/*
+ * Return a host file descriptor that holds the data of @bs at the same
+ * offsets, so that callers may read it without going through the block
+ * layer.  Filters are deliberately not looked through: they may throttle,
+ * inject errors or otherwise change what a read returns.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -5866,6 +5896,8 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
             return ret;
         }
 
+        /* The image may have been changed by the migration source */
+        bdrv_bsc_invalidate_all(bs);
         if (bs->drv->bdrv_co_invalidate_cache) {
             bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
             if (local_err) {
@@ -6713,6 +6745,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        bool force,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -6722,8 +6756,10 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb,
-                                       cb_opaque, force, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb,
+                                      cb_opaque, force, errp);
+    bdrv_bsc_invalidate_all(bs);
+    return ret;
 }
 
 /*
@@ -7153,6 +7189,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_bsc_invalidate_all(c->bs);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -34,6 +34,9 @@
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
+static void blk_merge_flush(BlockBackend *blk);
+
+typedef struct BlkMergeReq BlkMergeReq;
 
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
@@ -86,6 +89,16 @@ struct BlockBackend {
     CoQueue queued_requests;
     bool disable_request_queuing;
 
+    /*
+     * Request merging, see blk_set_request_merging().  Only accessed from
+     * the BlockBackend's AioContext.
+     */
+    bool merge_requests;
+    int plug_depth;
+    QSIMPLEQ_HEAD(, BlkMergeReq) merge_queue;
+    unsigned int merge_queue_len;
+    uint64_t merge_seq;
+
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
 
@@ -348,6 +361,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
     block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->queued_requests);
+    QSIMPLEQ_INIT(&blk->merge_queue);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
@@ -453,6 +467,7 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->remove_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->insert_bs_notifiers.notifiers));
     assert(QLIST_EMPTY(&blk->aio_notifiers));
+    assert(QSIMPLEQ_EMPTY(&blk->merge_queue));
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
@@ -1138,6 +1153,23 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+/*
+ * Enable or disable merging of adjacent asynchronous requests.
+ *
+ * When enabled, reads and writes submitted with blk_aio_preadv() and
+ * blk_aio_pwritev() between blk_io_plug() and blk_io_unplug() are held back
+ * until the outermost blk_io_unplug().  Requests of the same type and with
+ * the same flags that are adjacent on disk are then submitted as a single
+ * request, and its result is reported to each of the original requests.
+ */
+void blk_set_request_merging(BlockBackend *blk, bool enable)
+{
+    blk->merge_requests = enable;
+    if (!enable) {
+        blk_merge_flush(blk);
+    }
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1284,6 +1316,63 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
     return blk_co_pwritev_part(blk, offset, bytes, qiov, 0, flags);
 }
 
+/*
+ * Compress @bytes of @buf for a later blk_co_pwrite_precompressed() at
+ * @offset.  Returns the compressed size, -ENOSPC if the data should be
+ * written uncompressed, or -ENOTSUP if the driver can only compress as
+ * part of a write with BDRV_REQ_WRITE_COMPRESSED.
+ */
+int coroutine_fn blk_co_compress(BlockBackend *blk, int64_t offset,
+                                 unsigned int bytes, const void *buf,
+                                 void *dest, size_t dest_size)
+{
+    int ret;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret == 0) {
+        ret = bdrv_co_compress(blk->root, offset, bytes, buf, dest, dest_size);
+    }
+
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
+int coroutine_fn blk_co_pwrite_precompressed(BlockBackend *blk, int64_t offset,
+                                             unsigned int bytes,
+                                             const void *buf, size_t buf_size)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    /* Call blk_bs() only after waiting, the graph may have changed */
+    bs = blk_bs(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bdrv_inc_in_flight(bs);
+    if (blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                buf_size, true);
+    }
+
+    ret = bdrv_co_pwrite_precompressed(blk->root, offset, bytes,
+                                       buf, buf_size);
+    bdrv_dec_in_flight(bs);
+
+out:
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 typedef struct BlkRwCo {
     BlockBackend *blk;
     int64_t offset;
@@ -1422,6 +1511,243 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+/* Flush the merge queue once it holds this many requests */
+#define BLK_MERGE_MAX_REQS 32
+
+struct BlkMergeReq {
+    BlkAioEmAIOCB *acb;
+    Coroutine *co;
+    bool is_write;
+    bool merged;        /* completed as part of a merged request */
+    uint64_t seq;       /* keeps the submission order of overlapping requests */
+    QSIMPLEQ_ENTRY(BlkMergeReq) next;
+};
+
+typedef struct {
+    BlockBackend *blk;
+    BlkMergeReq **reqs;
+    int nb_reqs;
+    int niov;
+} BlkMergeGroup;
+
+static int blk_merge_req_cmp(const void *a, const void *b)
+{
+    const BlkMergeReq *r1 = *(BlkMergeReq * const *)a;
+    const BlkMergeReq *r2 = *(BlkMergeReq * const *)b;
+
+    if (r1->acb->rwco.offset != r2->acb->rwco.offset) {
+        return r1->acb->rwco.offset < r2->acb->rwco.offset ? -1 : 1;
+    }
+    return r1->seq < r2->seq ? -1 : 1;
+}
+
+/* Whether the order of @r1 and @r2 matters, i.e. they overlap with a write */
+static bool blk_merge_req_conflict(const BlkMergeReq *r1,
+                                   const BlkMergeReq *r2)
+{
+    int64_t offset1 = r1->acb->rwco.offset;
+    int64_t offset2 = r2->acb->rwco.offset;
+
+    return (r1->is_write || r2->is_write) &&
+           offset1 < offset2 + r2->acb->bytes &&
+           offset2 < offset1 + r1->acb->bytes;
+}
+
+/*
+ * Resume a request waiting in blk_merge_request().  Single and merged
+ * requests are both entered with aio_co_enter(), so they reach the driver in
+ * the order blk_merge_submit() resumes them.
+ */
+static void blk_merge_req_wake(BlockBackend *blk, BlkMergeReq *req)
+{
+    aio_co_enter(blk_get_aio_context(blk), req->co);
+}
+
+static void coroutine_fn blk_merge_co_entry(void *opaque)
+{
+    BlkMergeGroup *group = opaque;
+    BlockBackend *blk = group->blk;
+    BlkRwCo *first = &group->reqs[0]->acb->rwco;
+    QEMUIOVector qiov;
+    int i, ret;
+
+    qemu_iovec_init(&qiov, group->niov);
+    for (i = 0; i < group->nb_reqs; i++) {
+        BlkAioEmAIOCB *acb = group->reqs[i]->acb;
+
+        qemu_iovec_concat(&qiov, acb->rwco.iobuf, 0, acb->bytes);
+    }
+
+    trace_blk_merge_submit(blk, group->reqs[0]->is_write, first->offset,
+                           qiov.size, group->nb_reqs);
+
+    blk_inc_in_flight(blk);
+    if (group->reqs[0]->is_write) {
+        ret = blk_do_pwritev_part(blk, first->offset, qiov.size, &qiov, 0,
+                                  first->flags);
+    } else {
+        ret = blk_do_preadv(blk, first->offset, qiov.size, &qiov,
+                            first->flags);
+    }
+    blk_dec_in_flight(blk);
+
+    /*
+     * On error, let each request retry on its own so that it gets its own,
+     * exact error.
+     */
+    for (i = 0; i < group->nb_reqs; i++) {
+        BlkMergeReq *req = group->reqs[i];
+
+        if (ret == 0) {
+            req->acb->rwco.ret = 0;
+            req->merged = true;
+        }
+        blk_merge_req_wake(blk, req);
+    }
+
+    qemu_iovec_destroy(&qiov);
+    g_free(group->reqs);
+    g_free(group);
+}
+
+/*
+ * Submit @n requests sorted by offset, merging adjacent ones.  While the
+ * BlockBackend is quiesced, requests are only resumed individually: a merged
+ * request would wait in blk_wait_while_drained() while the original requests
+ * still count as in flight.
+ */
+static void blk_merge_submit(BlockBackend *blk, BlkMergeReq **reqs, int n)
+{
+    uint64_t max_bytes = blk_get_max_transfer(blk);
+    int max_iov = blk_bs(blk) ? blk_get_max_iov(blk) : IOV_MAX;
+    int i, j;
+
+    for (i = 0; i < n; i = j) {
+        BlkRwCo *prev = &reqs[i]->acb->rwco;
+        uint64_t bytes = reqs[i]->acb->bytes;
+        int niov = ((QEMUIOVector *)prev->iobuf)->niov;
+        BlkMergeGroup *group;
+        Coroutine *co;
+
+        for (j = i + 1; j < n && !blk->quiesce_counter; j++) {
+            BlkAioEmAIOCB *acb = reqs[j]->acb;
+            int req_niov = ((QEMUIOVector *)acb->rwco.iobuf)->niov;
+
+            if (reqs[j]->is_write != reqs[i]->is_write ||
+                acb->rwco.flags != prev->flags ||
+                acb->rwco.offset != prev->offset + reqs[j - 1]->acb->bytes ||
+                bytes + acb->bytes > max_bytes ||
+                niov + req_niov > max_iov) {
+                break;
+            }
+            bytes += acb->bytes;
+            niov += req_niov;
+            prev = &acb->rwco;
+        }
+
+        if (j - i == 1) {
+            blk_merge_req_wake(blk, reqs[i]);
+            continue;
+        }
+
+        group = g_new(BlkMergeGroup, 1);
+        *group = (BlkMergeGroup) {
+            .blk        = blk,
+            .reqs       = g_memdup(&reqs[i], (j - i) * sizeof(reqs[0])),
+            .nb_reqs    = j - i,
+            .niov       = niov,
+        };
+        co = qemu_coroutine_create(blk_merge_co_entry, group);
+        aio_co_enter(blk_get_aio_context(blk), co);
+    }
+}
+
+/*
+ * Submit all queued requests, merging adjacent ones.
+ *
+ * Requests are sorted by offset, but never across a request that overlaps
+ * with them where at least one of the two is a write: the queue is cut into
+ * segments at such requests, and only each segment is sorted.
+ */
+static void blk_merge_flush(BlockBackend *blk)
+{
+    BlkMergeReq **reqs;
+    BlkMergeReq *req;
+    int n = 0, start, end, i;
+
+    if (QSIMPLEQ_EMPTY(&blk->merge_queue)) {
+        return;
+    }
+
+    reqs = g_new(BlkMergeReq *, blk->merge_queue_len);
+    while ((req = QSIMPLEQ_FIRST(&blk->merge_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&blk->merge_queue, next);
+        reqs[n++] = req;
+    }
+    assert(n == blk->merge_queue_len);
+    blk->merge_queue_len = 0;
+
+    for (start = 0; start < n; start = end) {
+        for (end = start + 1; end < n; end++) {
+            for (i = start; i < end; i++) {
+                if (blk_merge_req_conflict(reqs[i], reqs[end])) {
+                    break;
+                }
+            }
+            if (i < end) {
+                break;
+            }
+        }
+
+        qsort(&reqs[start], end - start, sizeof(reqs[0]), blk_merge_req_cmp);
+        blk_merge_submit(blk, &reqs[start], end - start);
+    }
+
+    g_free(reqs);
+}
+
+static void blk_merge_flush_bh(void *opaque)
+{
+    BlockBackend *blk = opaque;
+
+    blk_merge_flush(blk);
+    blk_dec_in_flight(blk);
+}
+
+/*
+ * Queue an asynchronous read or write for merging if possible.  Returns true
+ * if the request was completed as part of a merged request, and false if the
+ * caller must submit it itself.
+ */
+static bool coroutine_fn blk_merge_request(BlkAioEmAIOCB *acb, bool is_write)
+{
+    BlockBackend *blk = acb->rwco.blk;
+    BlkMergeReq req = {
+        .acb        = acb,
+        .co         = qemu_coroutine_self(),
+        .is_write   = is_write,
+        .seq        = blk->merge_seq++,
+    };
+
+    if (!blk->merge_requests || !blk->plug_depth || !blk_bs(blk) ||
+        blk->quiesce_counter || !acb->rwco.iobuf || !acb->bytes) {
+        return false;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&blk->merge_queue, &req, next);
+    if (++blk->merge_queue_len == BLK_MERGE_MAX_REQS) {
+        /* Not from this coroutine, it must yield before it can be resumed */
+        blk_inc_in_flight(blk);
+        aio_bh_schedule_oneshot(blk_get_aio_context(blk), blk_merge_flush_bh,
+                                blk);
+    }
+
+    /* Woken exactly once by blk_merge_flush() or blk_merge_co_entry() */
+    qemu_coroutine_yield();
+
+    return req.merged;
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1461,8 +1787,10 @@ static void blk_aio_read_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(qiov->size == acb->bytes);
-    rwco->ret = blk_do_preadv(rwco->blk, rwco->offset, acb->bytes,
-                              qiov, rwco->flags);
+    if (!blk_merge_request(acb, false)) {
+        rwco->ret = blk_do_preadv(rwco->blk, rwco->offset, acb->bytes,
+                                  qiov, rwco->flags);
+    }
     blk_aio_complete(acb);
 }
 
@@ -1473,8 +1801,10 @@ static void blk_aio_write_entry(void *opaque)
     QEMUIOVector *qiov = rwco->iobuf;
 
     assert(!qiov || qiov->size == acb->bytes);
-    rwco->ret = blk_do_pwritev_part(rwco->blk, rwco->offset, acb->bytes,
-                                    qiov, 0, rwco->flags);
+    if (!blk_merge_request(acb, true)) {
+        rwco->ret = blk_do_pwritev_part(rwco->blk, rwco->offset, acb->bytes,
+                                        qiov, 0, rwco->flags);
+    }
     blk_aio_complete(acb);
 }
 
@@ -2147,6 +2477,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    blk->plug_depth++;
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -2156,6 +2487,11 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    assert(blk->plug_depth > 0);
+    if (--blk->plug_depth == 0) {
+        /* Submit held back requests while @bs is still plugged */
+        blk_merge_flush(blk);
+    }
     if (bs) {
         bdrv_io_unplug(bs);
     }
@@ -2361,6 +2697,9 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
 
+    /* Requests held back for merging must not block the drain */
+    blk_merge_flush(blk);
+
     if (++blk->quiesce_counter == 1) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
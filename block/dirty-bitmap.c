@@ -715,6 +715,22 @@ void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
     hbitmap_deserialize_part(bitmap->bitmap, buf, offset, bytes, finish);
 }
 
+ssize_t bdrv_dirty_bitmap_serialize_runs(const BdrvDirtyBitmap *bitmap,
+                                         uint8_t *buf, size_t size,
+                                         uint64_t offset, uint64_t bytes)
+{
+    return hbitmap_serialize_runs(bitmap->bitmap, buf, size, offset, bytes);
+}
+
+bool bdrv_dirty_bitmap_deserialize_runs(BdrvDirtyBitmap *bitmap,
+                                        const uint8_t *buf, size_t size,
+                                        uint64_t offset, uint64_t bytes,
+                                        bool finish)
+{
+    return hbitmap_deserialize_runs(bitmap->bitmap, buf, size, offset, bytes,
+                                    finish);
+}
+
 void bdrv_dirty_bitmap_deserialize_zeroes(BdrvDirtyBitmap *bitmap,
                                           uint64_t offset, uint64_t bytes,
                                           bool finish)
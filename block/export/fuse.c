@@ -24,8 +24,11 @@
 #include "block/export.h"
 #include "block/fuse.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/queue.h"
 #include "sysemu/block-backend.h"
 
 #include <fuse.h>
@@ -35,18 +38,40 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/*
+ * Maximum number of requests processed concurrently per export.  Every
+ * request holds a receive buffer of about max_write bytes.
+ */
+#define FUSE_MAX_IN_FLIGHT 64
+
+
+typedef struct FuseExport FuseExport;
+
+/* A request received from the kernel, processed in its own coroutine */
+typedef struct FuseRequest {
+    FuseExport *exp;
+    struct fuse_buf fuse_buf;
+    QSLIST_ENTRY(FuseRequest) next;
+} FuseRequest;
 
-typedef struct FuseExport {
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    /* Unused requests, kept so their receive buffers can be reused */
+    QSLIST_HEAD(, FuseRequest) free_requests;
+    unsigned in_flight;
+
+    /* Serializes changes to the image length */
+    CoMutex resize_lock;
+
     char *mountpoint;
     bool writable;
     bool growable;
-} FuseExport;
+    bool zero_copy;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -59,6 +84,7 @@ static void init_exports_table(void);
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              Error **errp);
 static void read_from_fuse_export(void *opaque);
+static void fuse_export_set_fd_handler(FuseExport *exp, bool enable);
 
 static bool is_regular_file(const char *path, Error **errp);
 
@@ -117,6 +143,9 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    exp->zero_copy = args->zero_copy;
+    QSLIST_INIT(&exp->free_requests);
+    qemu_co_mutex_init(&exp->resize_lock);
 
     ret = setup_fuse_export(exp, args->mountpoint, errp);
     if (ret < 0) {
@@ -181,10 +210,7 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session), true,
-                       read_from_fuse_export, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_export_set_fd_handler(exp, true);
 
     return 0;
 
@@ -193,6 +219,51 @@ fail:
     return ret;
 }
 
+/**
+ * (Un)register the handler for reading requests from the FUSE session FD.
+ */
+static void fuse_export_set_fd_handler(FuseExport *exp, bool enable)
+{
+    if (exp->fd_handler_set_up == enable) {
+        return;
+    }
+
+    aio_set_fd_handler(exp->common.ctx,
+                       fuse_session_fd(exp->fuse_session), true,
+                       enable ? read_from_fuse_export : NULL, NULL, NULL,
+                       enable ? exp : NULL);
+    exp->fd_handler_set_up = enable;
+}
+
+static void fuse_request_free(FuseRequest *fr)
+{
+    free(fr->fuse_buf.mem);
+    g_free(fr);
+}
+
+/**
+ * Process a single request.  The operation callbacks run in this
+ * coroutine, so they can yield in blk_*() while other requests are
+ * received and processed.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *fr = opaque;
+    FuseExport *exp = fr->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &fr->fuse_buf);
+
+    QSLIST_INSERT_HEAD(&exp->free_requests, fr, next);
+    exp->in_flight--;
+
+    /* Resume reading requests if we stopped because of too many in flight */
+    if (!fuse_session_exited(exp->fuse_session)) {
+        fuse_export_set_fd_handler(exp, true);
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
@@ -200,21 +271,36 @@ fail:
 static void read_from_fuse_export(void *opaque)
 {
     FuseExport *exp = opaque;
+    FuseRequest *fr;
+    Coroutine *co;
     int ret;
 
     blk_exp_ref(&exp->common);
 
+    fr = QSLIST_FIRST(&exp->free_requests);
+    if (fr) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+    } else {
+        fr = g_new0(FuseRequest, 1);
+        fr->exp = exp;
+    }
+
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &fr->fuse_buf);
     } while (ret == -EINTR);
     if (ret < 0) {
-        goto out;
+        QSLIST_INSERT_HEAD(&exp->free_requests, fr, next);
+        blk_exp_unref(&exp->common);
+        return;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
+    if (++exp->in_flight >= FUSE_MAX_IN_FLIGHT) {
+        fuse_export_set_fd_handler(exp, false);
+    }
 
-out:
-    blk_exp_unref(&exp->common);
+    /* The coroutine drops the reference */
+    co = qemu_coroutine_create(fuse_co_process_request, fr);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -223,13 +309,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
-
-        if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session), true,
-                               NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
-        }
+        fuse_export_set_fd_handler(exp, false);
     }
 
     if (exp->mountpoint) {
@@ -244,6 +324,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    FuseRequest *fr;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -253,7 +334,11 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    /* All requests hold a reference, so none can be in flight anymore */
+    while ((fr = QSLIST_FIRST(&exp->free_requests))) {
+        QSLIST_REMOVE_HEAD(&exp->free_requests, next);
+        fuse_request_free(fr);
+    }
     g_free(exp->mountpoint);
 }
 
@@ -285,6 +370,8 @@ static bool is_regular_file(const char *path, Error **errp)
  */
 static void fuse_init(void *userdata, struct fuse_conn_info *conn)
 {
+    FuseExport *exp = userdata;
+
     /*
      * MIN_NON_ZERO() would not be wrong here, but what we set here
      * must equal what has been passed to fuse_session_new().
@@ -295,6 +382,16 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /*
+     * Spliced requests are received into a single pipe per thread,
+     * which does not work when processing several requests at once.
+     */
+    conn->want &= ~FUSE_CAP_SPLICE_READ;
+
+    if (exp->zero_copy && (conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
 }
 
 /**
@@ -353,17 +450,34 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/**
+ * Resize the exported image to @size.  With @grow_only, nothing is done
+ * if the image is already at least @size bytes long (e.g. because a
+ * concurrent request has grown it further in the meantime).
+ */
+static int coroutine_fn fuse_do_truncate(FuseExport *exp, int64_t size,
+                                         bool grow_only, bool req_zero_write,
+                                         PreallocMode prealloc)
 {
     uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
+    int64_t length;
     int ret;
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
+    qemu_co_mutex_lock(&exp->resize_lock);
+
+    if (grow_only) {
+        length = blk_getlength(exp->common.blk);
+        if (length < 0 || length >= size) {
+            ret = MIN(length, 0);
+            goto out;
+        }
+    }
+
     /* Growable exports have a permanent RESIZE permission */
     if (!exp->growable) {
         blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
@@ -371,7 +485,7 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
@@ -383,6 +497,8 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         blk_set_perm(exp->common.blk, blk_perm, blk_shared_perm, &error_abort);
     }
 
+out:
+    qemu_co_mutex_unlock(&exp->resize_lock);
     return ret;
 }
 
@@ -405,7 +521,8 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
         return;
     }
 
-    ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+    ret = fuse_do_truncate(exp, statbuf->st_size, false, true,
+                           PREALLOC_MODE_OFF);
     if (ret < 0) {
         fuse_reply_err(req, -ret);
         return;
@@ -423,6 +540,36 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+/**
+ * Return the host file descriptor to splice read data from, or a negative
+ * errno value if reads must go through the block layer.
+ */
+static int fuse_zero_copy_fd(FuseExport *exp)
+{
+    BlockBackend *blk = exp->common.blk;
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (!exp->zero_copy || !bs) {
+        return -ENOTSUP;
+    }
+    if (blk_get_public(blk)->throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+    return bdrv_get_host_fd(bs);
+}
+
+typedef struct FuseZeroCopyRead {
+    fuse_req_t req;
+    struct fuse_bufvec bufv;
+} FuseZeroCopyRead;
+
+static int fuse_zero_copy_read_worker(void *opaque)
+{
+    FuseZeroCopyRead *zc = opaque;
+
+    return fuse_reply_data(zc->req, &zc->bufv, 0);
+}
+
 /**
  * Handle client reads from the exported image.
  */
@@ -432,6 +579,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     void *buf;
+    int fd;
     int ret;
 
     /* Limited by max_read, should not happen */
@@ -454,6 +602,32 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
+    fd = fuse_zero_copy_fd(exp);
+    if (fd >= 0) {
+        FuseZeroCopyRead zc = {
+            .req = req,
+            .bufv = FUSE_BUFVEC_INIT(size),
+        };
+
+        zc.bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        zc.bufv.buf[0].fd = fd;
+        zc.bufv.buf[0].pos = offset;
+
+        /*
+         * Keep the node from being drained, and thus its fd from being
+         * closed or replaced, while we read from it.  libfuse splices the
+         * data into the reply if the kernel supports it, and otherwise
+         * copies it; read errors are returned to the client.  Reading the
+         * image file may block, so like blk_pread() for the normal path,
+         * do it in the thread pool while this coroutine yields.
+         */
+        blk_inc_in_flight(exp->common.blk);
+        thread_pool_submit_co(aio_get_thread_pool(exp->common.ctx),
+                              fuse_zero_copy_read_worker, &zc);
+        blk_dec_in_flight(exp->common.blk);
+        return;
+    }
+
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -503,7 +677,8 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset + size, true, true,
+                                   PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -563,7 +738,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     } else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
+            ret = fuse_do_truncate(exp, offset + length, true, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
@@ -588,14 +763,15 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset, true, true,
+                                   PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
+        ret = fuse_do_truncate(exp, offset + length, true, true,
                                PREALLOC_MODE_FALLOC);
     } else {
         ret = -EOPNOTSUPP;
@@ -16,6 +16,7 @@
 #include "qemu/vhost-user-server.h"
 #include "vhost-user-blk-server.h"
 #include "qapi/error.h"
+#include "qemu/bitmap.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
 #include "util/block-helpers.h"
@@ -54,15 +55,56 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    /* Guest notifications are batched per virtqueue in a BH */
+    uint16_t num_queues;
+    QEMUBH *notify_bh;
+    unsigned long *batch_notify_vqs;
 } VuBlkExport;
 
+static void vu_blk_notify_bh(void *opaque)
+{
+    VuBlkExport *vexp = opaque;
+    VuDev *vu_dev = &vexp->vu_server.vu_dev;
+    unsigned nvqs = vexp->num_queues;
+    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
+    unsigned j;
+
+    memcpy(bitmap, vexp->batch_notify_vqs, sizeof(bitmap));
+    memset(vexp->batch_notify_vqs, 0, sizeof(bitmap));
+
+    /* The client may have disconnected, which frees the virtqueues */
+    if (!vexp->vu_server.sioc) {
+        return;
+    }
+
+    for (j = 0; j < nvqs; j += BITS_PER_LONG) {
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
+
+        while (bits != 0) {
+            unsigned i = j + ctzl(bits);
+
+            vu_queue_notify(vu_dev, vu_get_queue(vu_dev, i));
+
+            bits &= bits - 1; /* clear right-most bit */
+        }
+    }
+}
+
 static void vu_blk_req_complete(VuBlkReq *req)
 {
     VuDev *vu_dev = &req->server->vu_dev;
+    VuBlkExport *vexp = container_of(req->server, VuBlkExport, vu_server);
 
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
-    vu_queue_notify(vu_dev, req->vq);
+
+    /*
+     * Requests submitted by the same kick usually complete together, so
+     * notify the guest once for all of them.
+     */
+    set_bit(req->vq - vu_dev->vq, vexp->batch_notify_vqs);
+    qemu_bh_schedule(vexp->notify_bh);
 
     free(req);
 }
@@ -288,8 +330,12 @@ err:
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
 
+    /* Submit all requests of this kick to the host in one batch */
+    blk_io_plug(vexp->export.blk);
+
     while (1) {
         VuBlkReq *req;
 
@@ -305,6 +351,8 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
         qemu_coroutine_enter(co);
     }
+
+    blk_io_unplug(vexp->export.blk);
 }
 
 static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
@@ -417,6 +465,12 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     VuBlkExport *vexp = opaque;
 
     vexp->export.ctx = ctx;
+
+    /* The BH runs in the export's AioContext, so replace it on every move */
+    if (vexp->notify_bh) {
+        qemu_bh_delete(vexp->notify_bh);
+    }
+    vexp->notify_bh = aio_bh_new(ctx, vu_blk_notify_bh, vexp);
     vhost_user_server_attach_aio_context(&vexp->vu_server, ctx);
 }
 
@@ -425,6 +479,12 @@ static void blk_aio_detach(void *opaque)
     VuBlkExport *vexp = opaque;
 
     vhost_user_server_detach_aio_context(&vexp->vu_server);
+
+    if (vexp->notify_bh) {
+        vu_blk_notify_bh(vexp); /* final chance to notify the guest */
+        qemu_bh_delete(vexp->notify_bh);
+        vexp->notify_bh = NULL;
+    }
     vexp->export.ctx = NULL;
 }
 
@@ -496,6 +556,10 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
+    vexp->num_queues = num_queues;
+    vexp->batch_notify_vqs = bitmap_new(num_queues);
+    vexp->notify_bh = aio_bh_new(exp->ctx, vu_blk_notify_bh, vexp);
+
     blk_add_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                  vexp);
 
@@ -503,6 +567,9 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        qemu_bh_delete(vexp->notify_bh);
+        vexp->notify_bh = NULL;
+        g_free(vexp->batch_notify_vqs);
         return -EADDRNOTAVAIL;
     }
 
@@ -515,6 +582,12 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    /* Already gone if the export was detached from its AioContext */
+    if (vexp->notify_bh) {
+        qemu_bh_delete(vexp->notify_bh);
+        vexp->notify_bh = NULL;
+    }
+    g_free(vexp->batch_notify_vqs);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
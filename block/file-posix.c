@@ -30,6 +30,7 @@
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
+#include "qemu/range.h"
 #include "qemu/units.h"
 #include "trace.h"
 #include "block/thread-pool.h"
@@ -132,6 +133,12 @@
 #define RAW_LOCK_PERM_BASE             100
 #define RAW_LOCK_SHARED_BASE           200
 
+/*
+ * Issue batched discards early once this many are pending; while a batch is
+ * being issued, new discards wait instead of growing the list beyond this
+ */
+#define RAW_DISCARD_BATCH_MAX_RANGES   1024
+
 typedef struct BDRVRawState {
     int fd;
     bool use_lock;
@@ -171,6 +178,23 @@ typedef struct BDRVRawState {
         uint64_t discard_bytes_ok;
     } stats;
 
+    /*
+     * Discard batching (x-discard-batch-ms): discard requests are only
+     * recorded in @discard_pending, a sorted list of merged Ranges, and
+     * issued by @discard_co after at most @discard_batch_ns.  Merges are
+     * not counted, so @discard_nb_pending is an upper bound of the length
+     * of @discard_pending.  Ranges being issued are in @discard_issuing;
+     * writes to them wait in @discard_queue.
+     */
+    int64_t discard_batch_ns;
+    GList *discard_pending;
+    unsigned int discard_nb_pending;
+    GList *discard_issuing;
+    bool discard_blkdev;
+    Coroutine *discard_co;
+    QemuCoSleepState *discard_sleep;
+    CoQueue discard_queue;
+
     PRManager *pr_mgr;
 } BDRVRawState;
 
@@ -541,6 +565,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "check that page cache was dropped on live migration (default: off)"
         },
+        {
+            .name = "x-discard-batch-ms",
+            .type = QEMU_OPT_NUMBER,
+            .help = "delay and merge discard requests for up to this many "
+                    "milliseconds (default: 0, i.e. disabled)"
+        },
         { /* end of list */ }
     },
 };
@@ -557,6 +587,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     const char *filename = NULL;
     const char *str;
     BlockdevAioOptions aio, aio_default;
+    uint64_t discard_batch_ms;
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
@@ -640,6 +671,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->check_cache_dropped = qemu_opt_get_bool(opts, "x-check-cache-dropped",
                                                false);
 
+    discard_batch_ms = qemu_opt_get_number(opts, "x-discard-batch-ms", 0);
+    if (discard_batch_ms > INT64_MAX / SCALE_MS) {
+        error_setg(errp, "x-discard-batch-ms is too large");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->discard_batch_ns = discard_batch_ms * SCALE_MS;
+    qemu_co_queue_init(&s->discard_queue);
+
     s->open_flags = open_flags;
     raw_parse_flags(bdrv_flags, &s->open_flags, false);
 
@@ -1986,6 +2026,101 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+/* Remove [@offset, @offset + @bytes) from the batched discards */
+static void raw_discard_list_remove(BDRVRawState *s, uint64_t offset,
+                                    uint64_t bytes)
+{
+    uint64_t last = range_get_last(offset, bytes);
+    GList *list = s->discard_pending;
+    GList *l, *next;
+
+    for (l = list; l; l = next) {
+        Range *r = l->data;
+        uint64_t lob = range_lob(r), upb = range_upb(r);
+
+        next = l->next;
+        if (lob > last) {
+            break;
+        }
+        if (upb < offset) {
+            continue;
+        }
+
+        if (lob < offset && upb > last) {
+            /* Punch a hole into the middle of @r */
+            Range *tail = g_new(Range, 1);
+
+            range_set_bounds(tail, last + 1, upb);
+            range_set_bounds(r, lob, offset - 1);
+            list = g_list_insert_before(list, next, tail);
+            s->discard_nb_pending++;
+            break;
+        } else if (lob < offset) {
+            range_set_bounds(r, lob, offset - 1);
+        } else if (upb > last) {
+            range_set_bounds(r, last + 1, upb);
+        } else {
+            g_free(r);
+            list = g_list_delete_link(list, l);
+            s->discard_nb_pending--;
+        }
+    }
+
+    s->discard_pending = list;
+}
+
+static bool raw_discard_list_overlaps(GList *list, uint64_t offset,
+                                      uint64_t bytes)
+{
+    Range req;
+    GList *l;
+
+    range_init_nofail(&req, offset, bytes);
+    for (l = list; l; l = l->next) {
+        if (range_overlaps_range(l->data, &req)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Called before writing to [@offset, @offset + @bytes): Drop the range from
+ * the batched discards, so they cannot destroy the new data, and wait for
+ * discards of this range that are already being issued.
+ */
+static void coroutine_fn raw_discard_cancel(BDRVRawState *s, uint64_t offset,
+                                            uint64_t bytes)
+{
+    if (!s->discard_co || !bytes) {
+        return;
+    }
+
+    while (true) {
+        raw_discard_list_remove(s, offset, bytes);
+        if (!raw_discard_list_overlaps(s->discard_issuing, offset, bytes)) {
+            break;
+        }
+        qemu_co_queue_wait(&s->discard_queue, NULL);
+    }
+}
+
+/* Issue all batched discards now and wait for them to complete */
+static void coroutine_fn raw_discard_drain(BDRVRawState *s)
+{
+    while (s->discard_co) {
+        if (s->discard_sleep) {
+            qemu_co_sleep_wake(s->discard_sleep);
+        }
+        qemu_co_queue_wait(&s->discard_queue, NULL);
+    }
+}
+
+static void coroutine_fn raw_co_drain_begin(BlockDriverState *bs)
+{
+    raw_discard_drain(bs->opaque);
+}
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -1995,6 +2130,10 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (fd_open(bs) < 0)
         return -EIO;
 
+    if (type == QEMU_AIO_WRITE) {
+        raw_discard_cancel(s, offset, bytes);
+    }
+
     /*
      * When using O_DIRECT, the request must be aligned to be able to use
      * either libaio or io_uring interface. If not fail back to regular thread
@@ -2138,6 +2277,9 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    /* bdrv_close() drains, which issues all batched discards */
+    assert(!s->discard_co && !s->discard_pending);
+
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2178,6 +2320,9 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
     struct stat st;
     int ret;
 
+    /* Batched discards must not punch holes into the resized file */
+    raw_discard_drain(s);
+
     if (fstat(s->fd, &st)) {
         ret = -errno;
         error_setg_errno(errp, -ret, "Failed to fstat() the file");
@@ -2922,9 +3067,92 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
     return ret;
 }
 
+static void coroutine_fn raw_discard_batch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVRawState *s = bs->opaque;
+
+    while (s->discard_pending) {
+        GList *l;
+
+        qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME, s->discard_batch_ns,
+                                  &s->discard_sleep);
+
+        s->discard_issuing = s->discard_pending;
+        s->discard_pending = NULL;
+        s->discard_nb_pending = 0;
+
+        for (l = s->discard_issuing; l; l = l->next) {
+            uint64_t offset = range_lob(l->data);
+            uint64_t end = range_upb(l->data) + 1;
+
+            trace_file_discard_batch_issue(bs, offset, end - offset);
+
+            while (offset < end) {
+                int bytes = MIN(end - offset, BDRV_REQUEST_MAX_BYTES);
+
+                /* Errors are accounted, but the request has completed */
+                raw_do_pdiscard(bs, offset, bytes, s->discard_blkdev);
+                offset += bytes;
+            }
+        }
+
+        g_list_free_full(s->discard_issuing, g_free);
+        s->discard_issuing = NULL;
+        qemu_co_queue_restart_all(&s->discard_queue);
+    }
+
+    s->discard_co = NULL;
+    qemu_co_queue_restart_all(&s->discard_queue);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Record a discard request to be issued in the background by
+ * raw_discard_batch_entry().  Discarded data is undefined anyway, so
+ * completing the request right away is fine, as long as writes to the
+ * range cancel it (see raw_discard_cancel()).
+ */
+static coroutine_fn int
+raw_discard_batch(BlockDriverState *bs, int64_t offset, int bytes,
+                  bool blkdev)
+{
+    BDRVRawState *s = bs->opaque;
+    Range *range;
+
+    /* Don't let the list grow without bound while a batch is being issued */
+    while (s->discard_issuing &&
+           s->discard_nb_pending >= RAW_DISCARD_BATCH_MAX_RANGES) {
+        qemu_co_queue_wait(&s->discard_queue, NULL);
+    }
+
+    range = g_new(Range, 1);
+    range_init_nofail(range, offset, bytes);
+    s->discard_pending = range_list_insert(s->discard_pending, range);
+    s->discard_nb_pending++;
+    s->discard_blkdev = blkdev;
+
+    if (!s->discard_co) {
+        /* Keep drain from completing while discards are pending */
+        bdrv_inc_in_flight(bs);
+        s->discard_co = qemu_coroutine_create(raw_discard_batch_entry, bs);
+        aio_co_enter(bdrv_get_aio_context(bs), s->discard_co);
+    } else if (s->discard_sleep &&
+               s->discard_nb_pending >= RAW_DISCARD_BATCH_MAX_RANGES) {
+        qemu_co_sleep_wake(s->discard_sleep);
+    }
+
+    return 0;
+}
+
 static coroutine_fn int
 raw_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 {
+    BDRVRawState *s = bs->opaque;
+
+    if (s->discard_batch_ns) {
+        return raw_discard_batch(bs, offset, bytes, false);
+    }
     return raw_do_pdiscard(bs, offset, bytes, false);
 }
 
@@ -2936,6 +3164,8 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
 
+    raw_discard_cancel(s, offset, bytes);
+
 #ifdef CONFIG_FALLOCATE
     if (offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
         BdrvTrackedRequest *req;
@@ -3027,6 +3257,23 @@ static BlockStatsSpecific *raw_get_specific_stats(BlockDriverState *bs)
     return stats;
 }
 
+static int raw_get_host_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /*
+     * Reading through the fd with sendfile() and friends goes through the
+     * page cache, which is what cache.direct=on asked us to avoid.
+     */
+    if (s->open_flags & O_DIRECT) {
+        return -ENOTSUP;
+    }
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+    return s->fd;
+}
+
 static BlockStatsSpecific *hdev_get_specific_stats(BlockDriverState *bs)
 {
     BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
@@ -3198,6 +3445,8 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         return -EIO;
     }
 
+    raw_discard_cancel(s, dst_offset, bytes);
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_type       = QEMU_AIO_COPY_RANGE,
@@ -3237,6 +3486,7 @@ BlockDriver bdrv_file = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
+    .bdrv_co_drain_begin    = raw_co_drain_begin,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
@@ -3250,6 +3500,7 @@ BlockDriver bdrv_file = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
@@ -3573,6 +3824,9 @@ hdev_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
         raw_account_discard(s, bytes, ret);
         return ret;
     }
+    if (s->discard_batch_ns) {
+        return raw_discard_batch(bs, offset, bytes, true);
+    }
     return raw_do_pdiscard(bs, offset, bytes, true);
 }
 
@@ -3611,6 +3865,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
+    .bdrv_co_drain_begin    = raw_co_drain_begin,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
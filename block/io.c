@@ -1433,6 +1433,8 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           &local_qiov, 0,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
+            /* The copied range is allocated in @bs now */
+            bdrv_bsc_invalidate_range(bs, cluster_offset, pnum);
 
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
@@ -2002,6 +2004,12 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_bsc_invalidate_all(bs);
+    } else {
+        bdrv_bsc_invalidate_range(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2279,6 +2287,84 @@ out:
     return ret;
 }
 
+int coroutine_fn bdrv_co_compress(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, const void *buf,
+                                  void *dest, size_t dest_size)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_compress) {
+        return -ENOTSUP;
+    }
+
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+    ret = drv->bdrv_co_compress(bs, offset, bytes, buf, dest, dest_size);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
+/*
+ * Write data that bdrv_co_compress() has compressed for @offset and
+ * @bytes.  The request is tracked like a compressed write of @bytes.
+ */
+int coroutine_fn bdrv_co_pwrite_precompressed(BdrvChild *child,
+                                              int64_t offset, int64_t bytes,
+                                              const void *buf, size_t buf_size)
+{
+    BlockDriverState *bs = child->bs;
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_co_pwrite_precompressed) {
+        return -ENOTSUP;
+    }
+
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Compressed writes are never padded */
+    if (!QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment)) {
+        return -EINVAL;
+    }
+
+    if (bdrv_has_readonly_bitmaps(bs)) {
+        return -EPERM;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+
+    ret = bdrv_co_write_req_prepare(child, offset, bytes, &req,
+                                    BDRV_REQ_WRITE_COMPRESSED);
+    if (ret == 0) {
+        ret = drv->bdrv_co_pwrite_precompressed(bs, offset, bytes,
+                                                buf, buf_size);
+    }
+    bdrv_co_write_req_finish(child, offset, bytes, &req, ret);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int64_t bytes, BdrvRequestFlags flags)
 {
@@ -2325,6 +2411,195 @@ int bdrv_flush_all(void)
     return result;
 }
 
+/*
+ * Per-node cache of the status that the driver's .bdrv_co_block_status()
+ * returned, so that repeated queries (e.g. walks down a long backing chain
+ * by backup, mirror, stream or an NBD client) do not hit the image metadata
+ * every time.
+ *
+ * Only format drivers are cached: the metadata of a format node can only be
+ * changed by requests that go through that node, all of which end in
+ * bdrv_co_write_req_finish(), or by a few operations on the whole node that
+ * drop the cache explicitly.  Protocol drivers may see the underlying
+ * storage change behind QEMU's back.
+ *
+ * The cache is only accessed from the node's AioContext.
+ */
+#define BDRV_BSC_MAX_EXTENTS 16384
+
+typedef struct BdrvBlockStatusExtent {
+    int64_t offset;
+    int64_t bytes;
+    int64_t map;
+    BlockDriverState *file;
+    int status;
+    bool want_zero;
+} BdrvBlockStatusExtent;
+
+struct BdrvBlockStatusCache {
+    /* Non-overlapping extents, used as both key and value */
+    GTree *extents;
+    /* Incremented on every invalidation */
+    uint64_t gen;
+    /* Invalidation granularity, 0 if every write drops everything */
+    int64_t cluster_size;
+};
+
+/* Extents compare equal if they overlap */
+static gint bdrv_bsc_compare(gconstpointer a, gconstpointer b,
+                             gpointer opaque)
+{
+    const BdrvBlockStatusExtent *e1 = a, *e2 = b;
+
+    if (e1->offset >= e2->offset + e2->bytes) {
+        return 1;
+    }
+    if (e1->offset + e1->bytes <= e2->offset) {
+        return -1;
+    }
+    return 0;
+}
+
+static bool bdrv_bsc_enabled(BlockDriverState *bs)
+{
+    return bs->drv->is_format && bs->drv->bdrv_co_block_status;
+}
+
+static BdrvBlockStatusCache *bdrv_bsc_new(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = g_new0(BdrvBlockStatusCache, 1);
+    BlockDriverInfo bdi;
+
+    bsc->extents = g_tree_new_full(bdrv_bsc_compare, NULL, g_free, NULL);
+
+    /*
+     * A write can change the status of the whole cluster it touches, e.g.
+     * when qcow2 or vmdk allocate it, so invalidate whole clusters.
+     */
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+        bsc->cluster_size = bdi.cluster_size;
+    }
+    return bsc;
+}
+
+static BdrvBlockStatusExtent *bdrv_bsc_lookup(BlockDriverState *bs,
+                                              int64_t offset, bool want_zero,
+                                              uint32_t align)
+{
+    BdrvBlockStatusCache *bsc = bs->block_status_cache;
+    BdrvBlockStatusExtent key = { .offset = offset, .bytes = 1 };
+    BdrvBlockStatusExtent *e;
+
+    if (!bsc) {
+        return NULL;
+    }
+
+    e = g_tree_lookup(bsc->extents, &key);
+    /* A result obtained with want_zero is good for everyone, but not vice
+     * versa */
+    if (e && want_zero && !e->want_zero) {
+        return NULL;
+    }
+    /* The request alignment may have changed since */
+    if (e && !(QEMU_IS_ALIGNED(e->offset, align) &&
+               QEMU_IS_ALIGNED(e->bytes, align))) {
+        return NULL;
+    }
+    return e;
+}
+
+static void bdrv_bsc_insert(BlockDriverState *bs, uint64_t gen,
+                            bool want_zero, int64_t offset, int64_t bytes,
+                            int status, int64_t map, BlockDriverState *file)
+{
+    BdrvBlockStatusCache *bsc = bs->block_status_cache;
+    BdrvBlockStatusExtent *e, *old;
+
+    /* Someone wrote to the node while we were asking the driver */
+    if (bsc->gen != gen) {
+        return;
+    }
+
+    if (g_tree_nnodes(bsc->extents) >= BDRV_BSC_MAX_EXTENTS) {
+        g_tree_destroy(bsc->extents);
+        bsc->extents = g_tree_new_full(bdrv_bsc_compare, NULL, g_free, NULL);
+    }
+
+    e = g_new(BdrvBlockStatusExtent, 1);
+    *e = (BdrvBlockStatusExtent) {
+        .offset     = offset,
+        .bytes      = bytes,
+        .map        = map,
+        .file       = file,
+        .status     = status & ~BDRV_BLOCK_EOF,
+        .want_zero  = want_zero,
+    };
+
+    while ((old = g_tree_lookup(bsc->extents, e))) {
+        g_tree_remove(bsc->extents, old);
+    }
+    g_tree_insert(bsc->extents, e, e);
+}
+
+/*
+ * Drop all cached block status of @bs in the clusters that intersect with
+ * [@offset, @offset + @bytes).
+ */
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes)
+{
+    BdrvBlockStatusCache *bsc = bs->block_status_cache;
+    BdrvBlockStatusExtent key;
+    BdrvBlockStatusExtent *e;
+
+    if (!bsc) {
+        return;
+    }
+    if (!bsc->cluster_size) {
+        bdrv_bsc_invalidate_all(bs);
+        return;
+    }
+
+    key.offset = QEMU_ALIGN_DOWN(offset, bsc->cluster_size);
+    key.bytes = QEMU_ALIGN_UP(offset + bytes, bsc->cluster_size) - key.offset;
+
+    bsc->gen++;
+    while ((e = g_tree_lookup(bsc->extents, &key))) {
+        g_tree_remove(bsc->extents, e);
+    }
+}
+
+/*
+ * Drop all cached block status of @bs.
+ */
+void bdrv_bsc_invalidate_all(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = bs->block_status_cache;
+
+    if (!bsc) {
+        return;
+    }
+
+    bsc->gen++;
+    if (g_tree_nnodes(bsc->extents)) {
+        g_tree_destroy(bsc->extents);
+        bsc->extents = g_tree_new_full(bdrv_bsc_compare, NULL, g_free, NULL);
+    }
+}
+
+void bdrv_bsc_free(BlockDriverState *bs)
+{
+    BdrvBlockStatusCache *bsc = bs->block_status_cache;
+
+    if (!bsc) {
+        return;
+    }
+
+    g_tree_destroy(bsc->extents);
+    g_free(bsc);
+    bs->block_status_cache = NULL;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2413,7 +2688,37 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_offset = QEMU_ALIGN_DOWN(offset, align);
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
-    if (bs->drv->bdrv_co_block_status) {
+    if (bs->drv->bdrv_co_block_status && bdrv_bsc_enabled(bs)) {
+        BdrvBlockStatusExtent *e = bdrv_bsc_lookup(bs, aligned_offset,
+                                                   want_zero, align);
+
+        if (e) {
+            int64_t skip = aligned_offset - e->offset;
+
+            *pnum = MIN(e->bytes - skip, aligned_bytes);
+            local_map = e->map + skip;
+            local_file = e->file;
+            ret = e->status;
+            trace_bdrv_co_block_status_cache_hit(bs, aligned_offset, *pnum,
+                                                 ret);
+        } else {
+            uint64_t gen;
+
+            if (!bs->block_status_cache) {
+                bs->block_status_cache = bdrv_bsc_new(bs);
+            }
+            gen = bs->block_status_cache->gen;
+
+            ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
+                                                aligned_bytes, pnum,
+                                                &local_map, &local_file);
+            /* Passing through to the child is cheap, don't bother */
+            if (ret >= 0 && !(ret & BDRV_BLOCK_RAW) && bs->block_status_cache) {
+                bdrv_bsc_insert(bs, gen, want_zero, aligned_offset, *pnum,
+                                ret, local_map, local_file);
+            }
+        }
+    } else if (bs->drv->bdrv_co_block_status) {
         ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
                                             aligned_bytes, pnum, &local_map,
                                             &local_file);
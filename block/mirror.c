@@ -26,7 +26,8 @@
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
-#define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* Upper limit for the buffer size derived from the x-perf parameters */
+#define MAX_DEFAULT_BUF_SIZE (1 << 30)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -63,6 +64,10 @@ typedef struct MirrorBlockJob {
     bool should_complete;
     int64_t granularity;
     size_t buf_size;
+    /* Maximum number of parallel copy operations */
+    int max_in_flight;
+    /* Maximum length of a copy operation, 0 to derive it from buf_size */
+    int64_t max_chunk;
     int64_t bdev_length;
     unsigned long *cow_bitmap;
     BdrvDirtyBitmap *dirty_bitmap;
@@ -464,7 +469,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->max_chunk ?:
+                           MAX(s->buf_size / s->max_in_flight, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -561,7 +567,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -821,7 +827,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1004,7 +1010,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1575,13 +1581,15 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             const MirrorPerf *perf, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
     BlockDriverState *mirror_top_bs;
     bool target_is_backing;
     uint64_t target_perms, target_shared_perms;
+    int64_t max_workers = MAX_IN_FLIGHT;
+    int64_t max_chunk = 0;
     int ret;
 
     if (granularity == 0) {
@@ -1595,8 +1603,37 @@ static BlockJob *mirror_start_job(
         return NULL;
     }
 
+    if (perf && perf->has_max_workers) {
+        max_workers = perf->max_workers;
+    }
+    if (perf && perf->has_max_chunk) {
+        max_chunk = perf->max_chunk;
+    }
+    if (max_workers < 1 || max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return NULL;
+    }
+    if (max_chunk < 0 || max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must be between 0 and %" PRIu64,
+                   (uint64_t)BDRV_REQUEST_MAX_BYTES);
+        return NULL;
+    }
+    if (max_chunk && max_chunk < granularity) {
+        error_setg(errp, "max-chunk %" PRIi64 " is less than the job "
+                   "granularity (%" PRIu32 ")", max_chunk, granularity);
+        return NULL;
+    }
+
     if (buf_size == 0) {
-        buf_size = DEFAULT_MIRROR_BUF_SIZE;
+        /* Give every worker a full-sized buffer */
+        buf_size = max_workers * (max_chunk ?: MAX_IO_BYTES);
+        if (buf_size > MAX_DEFAULT_BUF_SIZE) {
+            error_setg(errp, "max-workers (%" PRIi64 ") times max-chunk "
+                       "(%" PRIi64 ") exceeds the default buffer size limit "
+                       "(%d); set buf-size explicitly", max_workers,
+                       max_chunk ?: MAX_IO_BYTES, MAX_DEFAULT_BUF_SIZE);
+            return NULL;
+        }
     }
 
     if (bdrv_skip_filters(bs) == bdrv_skip_filters(target)) {
@@ -1736,6 +1773,8 @@ static BlockJob *mirror_start_job(
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
+    s->max_in_flight = max_workers;
+    s->max_chunk = max_chunk;
     s->unmap = unmap;
     if (auto_complete) {
         s->should_complete = true;
@@ -1848,7 +1887,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, const MirrorPerf *perf,
+                  Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1865,7 +1905,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, perf, errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1892,7 +1932,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     NULL, errp);
     if (!job) {
         goto error_restore_flags;
     }
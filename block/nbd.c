@@ -36,6 +36,7 @@
 #include "qemu/cutils.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/error-report.h"
 
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/qmp/qstring.h"
@@ -49,6 +50,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -138,6 +140,17 @@ typedef struct BDRVNBDState {
     QCryptoTLSCreds *tlscreds;
     const char *hostname;
     char *x_dirty_bitmap;
+
+    /*
+     * Additional connections for multi-conn.  Each is a separate nbd node
+     * attached as a child, with its own reconnect handling.
+     */
+    uint32_t multi_conn;
+    BdrvChild **conns;
+    int nb_conns;
+    int next_conn;
+    /* This node is one of the additional connections of another nbd node */
+    bool extra_conn;
     bool alloc_depth;
 
     bool wait_connect;
@@ -1545,12 +1558,48 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
+/*
+ * With multi-conn, pick the connection with the fewest requests in flight for
+ * a data request, rotating the starting point so that idle connections are
+ * used in turn.  Returns NULL if the request should use the connection of @bs
+ * itself.
+ */
+static BdrvChild *nbd_pick_conn(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *best = NULL;
+    int best_in_flight = INT_MAX;
+    int i;
+
+    if (!s->nb_conns) {
+        return NULL;
+    }
+
+    for (i = 0; i <= s->nb_conns; i++) {
+        int idx = (s->next_conn + i) % (s->nb_conns + 1);
+        BdrvChild *conn = idx ? s->conns[idx - 1] : NULL;
+        BDRVNBDState *cs = conn ? conn->bs->opaque : s;
+
+        if (cs->state != NBD_CLIENT_CONNECTED) {
+            continue;
+        }
+        if (cs->in_flight < best_in_flight) {
+            best = conn;
+            best_in_flight = cs->in_flight;
+        }
+    }
+    s->next_conn = (s->next_conn + 1) % (s->nb_conns + 1);
+
+    return best;
+}
+
 static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                                 uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn = nbd_pick_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1560,6 +1609,10 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
+    if (conn) {
+        return bdrv_co_preadv(conn, offset, bytes, qiov, flags);
+    }
+
     if (!bytes) {
         return 0;
     }
@@ -1607,6 +1660,7 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn = nbd_pick_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -1621,6 +1675,9 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
+    if (conn) {
+        return bdrv_co_pwritev(conn, offset, bytes, qiov, flags);
+    }
     if (!bytes) {
         return 0;
     }
@@ -1631,6 +1688,7 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *conn;
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -1657,6 +1715,10 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
+    conn = nbd_pick_conn(bs);
+    if (conn) {
+        return bdrv_co_pwrite_zeroes(conn, offset, bytes, flags);
+    }
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -1685,11 +1747,17 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         .len = bytes,
     };
 
+    BdrvChild *conn;
+
     assert(!(s->info.flags & NBD_FLAG_READ_ONLY));
     if (!(s->info.flags & NBD_FLAG_SEND_TRIM) || !bytes) {
         return 0;
     }
 
+    conn = nbd_pick_conn(bs);
+    if (conn) {
+        return bdrv_co_pdiscard(conn, offset, bytes);
+    }
     return nbd_co_request(bs, &request, NULL);
 }
 
@@ -2219,6 +2287,12 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "multi-conn",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server if it "
+                    "supports multiple connections, default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -2275,6 +2349,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->multi_conn = qemu_opt_get_number(opts, "multi-conn", 1);
+    if (s->multi_conn < 1 || s->multi_conn > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "multi-conn must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -2285,6 +2366,93 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
+/*
+ * Open the additional connections for multi-conn as child nodes with the
+ * same options as @bs.  Failing to open them is not fatal, the requests are
+ * then spread over the connections that could be opened.
+ */
+static void nbd_open_extra_conns(BlockDriverState *bs)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    int i;
+
+    if (!(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        warn_report("NBD server does not support multiple connections, "
+                    "using a single connection");
+        return;
+    }
+
+    s->conns = g_new0(BdrvChild *, s->multi_conn - 1);
+    for (i = 1; i < s->multi_conn; i++) {
+        QDict *opts = qdict_clone_shallow(bs->options);
+        BlockDriverState *conn_bs;
+        BdrvChild *conn;
+        Error *local_err = NULL;
+        g_autofree char *name = g_strdup_printf("conn%d", i);
+
+        qdict_del(opts, "node-name");
+        qdict_del(opts, "multi-conn");
+
+        conn_bs = bdrv_open(NULL, NULL, opts, bs->open_flags, &local_err);
+        if (!conn_bs) {
+            warn_reportf_err(local_err, "Failed to open NBD connection %d: ",
+                             i);
+            break;
+        }
+        ((BDRVNBDState *)conn_bs->opaque)->extra_conn = true;
+
+        conn = bdrv_attach_child(bs, conn_bs, name, &child_of_bds,
+                                 BDRV_CHILD_DATA, &local_err);
+        if (!conn) {
+            warn_reportf_err(local_err, "Failed to open NBD connection %d: ",
+                             i);
+            break;
+        }
+        s->conns[s->nb_conns++] = conn;
+    }
+
+    trace_nbd_open_extra_conns(bs, s->nb_conns + 1);
+}
+
+static bool nbd_is_extra_conn(BDRVNBDState *s, BdrvChild *child)
+{
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        if (s->conns[i] == child) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Like the default in bdrv_refresh_filename(), except that the connection
+ * children are left out: they are opened from our own options, and their
+ * names are not valid options of the nbd driver.
+ */
+static void nbd_gather_child_options(BlockDriverState *bs, QDict *target,
+                                     bool backing_overridden)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BdrvChild *child;
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (nbd_is_extra_conn(s, child)) {
+            continue;
+        }
+        if (child == bs->backing && !backing_overridden) {
+            continue;
+        }
+        qdict_put(target, child->name,
+                  qobject_ref(child->bs->full_open_options));
+    }
+
+    if (backing_overridden && !bs->backing) {
+        qdict_put_null(target, "backing");
+    }
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
@@ -2328,11 +2496,26 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     bdrv_inc_in_flight(bs);
     aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
 
+    if (s->multi_conn > 1) {
+        nbd_open_extra_conns(bs);
+    }
+
     return 0;
 }
 
 static int nbd_co_flush(BlockDriverState *bs)
 {
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+
+    /*
+     * bdrv_co_flush() of the primary node recurses into its connection
+     * children.  Multi-conn guarantees that the flush on the primary
+     * connection covers the writes completed on all of them, so keep
+     * flushes there.
+     */
+    if (s->extra_conn) {
+        return 0;
+    }
     return nbd_client_co_flush(bs);
 }
 
@@ -2374,6 +2557,11 @@ static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
+    /* The connection children themselves are detached by bdrv_close() */
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nb_conns = 0;
+
     nbd_client_close(bs);
     yank_unregister_instance(BLOCKDEV_YANK_INSTANCE(bs->node_name));
     nbd_clear_bdrvstate(s);
@@ -2505,6 +2693,8 @@ static BlockDriver bdrv_nbd = {
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
@@ -2534,6 +2724,8 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
@@ -2563,6 +2755,8 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_co_drain_end          = nbd_client_co_drain_end,
     .bdrv_refresh_filename      = nbd_refresh_filename,
     .bdrv_co_block_status       = nbd_client_co_block_status,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_gather_child_options  = nbd_gather_child_options,
     .bdrv_dirname               = nbd_dirname,
     .strong_runtime_opts        = nbd_strong_runtime_opts,
     .bdrv_cancel_in_flight      = nbd_cancel_in_flight,
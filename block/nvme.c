@@ -33,6 +33,9 @@
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
 
+/* Maximum number of DMA-mapped bounce buffers kept for unaligned requests */
+#define NVME_BOUNCE_BUFS 8
+
 /*
  * We have to leave one slot empty as that is the full queue case where
  * head == tail + 1.
@@ -65,6 +68,7 @@ typedef struct {
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
+    uint32_t *result; /* Optional location for CQE dword 0 */
     int free_req_next; /* q->reqs[] index of next free req */
 } NVMeRequest;
 
@@ -106,6 +110,8 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Round-robin cursor over the I/O queues, see nvme_get_io_queue() */
+    unsigned next_io_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -128,6 +134,16 @@ struct BDRVNVMeState {
     /* Total size of mapped qiov, accessed under dma_map_lock */
     int dma_map_count;
 
+    /*
+     * Bounce buffers for unaligned requests, accessed under dma_map_lock.
+     * They have a fixed DMA mapping and are recycled, so that unaligned
+     * requests don't need a temporary IOMMU mapping each time.
+     * bounce_bufs[0..bounce_bufs_free) are the currently unused ones.
+     */
+    void *bounce_bufs[NVME_BOUNCE_BUFS];
+    unsigned bounce_bufs_free;
+    unsigned bounce_bufs_allocated;
+
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
 
@@ -140,6 +156,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -157,6 +174,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs to create (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -305,7 +327,7 @@ static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
     }
 
     req = &q->reqs[q->free_req_head];
-    q->free_req_head = req->free_req_next;
+    qatomic_set(&q->free_req_head, req->free_req_next);
     req->free_req_next = -1;
 
     qemu_mutex_unlock(&q->lock);
@@ -316,7 +338,7 @@ static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
 static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 {
     req->free_req_next = q->free_req_head;
-    q->free_req_head = req - q->reqs;
+    qatomic_set(&q->free_req_head, req - q->reqs);
 }
 
 /* With q->lock */
@@ -412,8 +434,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -490,7 +516,12 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/*
+ * Submit an admin command and wait for its completion. If @result is not
+ * NULL, dword 0 of the completion queue entry is stored there.
+ */
+static int nvme_admin_cmd_sync_result(BlockDriverState *bs, NvmeCmd *cmd,
+                                      uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -501,12 +532,18 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    return nvme_admin_cmd_sync_result(bs, cmd, NULL);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -691,6 +728,64 @@ out_error:
     return false;
 }
 
+/*
+ * Ask the controller for @nr_io_queues I/O submission/completion queue pairs.
+ * Returns the number of queue pairs actually allocated by the controller,
+ * which may be lower than requested, or 0 on failure.
+ */
+static unsigned nvme_set_num_io_queues(BlockDriverState *bs,
+                                       unsigned nr_io_queues, Error **errp)
+{
+    uint32_t result = 0;
+    unsigned nsqa, ncqa;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_io_queues - 1) << 16) | (nr_io_queues - 1)),
+    };
+
+    if (nvme_admin_cmd_sync_result(bs, &cmd, &result)) {
+        error_setg(errp, "Failed to set number of I/O queues");
+        return 0;
+    }
+    nsqa = extract32(result, 0, 16) + 1;
+    ncqa = extract32(result, 16, 16) + 1;
+    trace_nvme_set_num_io_queues(bs->opaque, nr_io_queues, nsqa, ncqa);
+    return MIN(nr_io_queues, MIN(nsqa, ncqa));
+}
+
+/*
+ * Pick the I/O queue pair for a new request.
+ *
+ * Requests are spread round-robin over all I/O queues so that the device can
+ * have up to (queue_count - 1) * NVME_NUM_REQS commands in flight and can
+ * process them on as many hardware queues. Queues that still have a free
+ * request slot are preferred; free_req_head is only used as a hint here, so
+ * it is read without taking q->lock.  Its updates under q->lock use
+ * qatomic_set() to pair with that read.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    unsigned nr_io_queues = s->queue_count - INDEX_IO(0);
+    unsigned start = s->next_io_queue;
+    unsigned i;
+
+    assert(nr_io_queues > 0);
+    for (i = 0; i < nr_io_queues; i++) {
+        unsigned n = (start + i) % nr_io_queues;
+        NVMeQueuePair *q = s->queues[INDEX_IO(n)];
+
+        if (qatomic_read(&q->free_req_head) != -1) {
+            s->next_io_queue = (n + 1) % nr_io_queues;
+            return q;
+        }
+    }
+
+    /* All queues are full, wait on the next one in turn */
+    s->next_io_queue = (start + 1) % nr_io_queues;
+    return s->queues[INDEX_IO(start)];
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -701,7 +796,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned nr_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -840,8 +935,16 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    nr_io_queues = nvme_set_num_io_queues(bs, nr_io_queues, errp);
+    if (!nr_io_queues) {
         ret = -EIO;
+        goto out;
+    }
+    for (unsigned i = 0; i < nr_io_queues; i++) {
+        if (!nvme_add_io_queue(bs, errp)) {
+            ret = -EIO;
+            goto out;
+        }
     }
 out:
     if (regs) {
@@ -907,6 +1010,68 @@ static int nvme_enable_disable_write_cache(BlockDriverState *bs, bool enable,
     return ret;
 }
 
+static size_t nvme_bounce_buf_size(BDRVNVMeState *s)
+{
+    return QEMU_ALIGN_UP(s->max_transfer, qemu_real_host_page_size);
+}
+
+/*
+ * Get a bounce buffer of at least @len bytes. Buffers from the pool are
+ * already DMA-mapped; if the pool is exhausted, a plain buffer is returned
+ * and *@pooled is set to false.
+ */
+static coroutine_fn void *nvme_get_bounce_buf(BDRVNVMeState *s, size_t len,
+                                              bool *pooled)
+{
+    size_t size = nvme_bounce_buf_size(s);
+    void *buf = NULL;
+
+    assert(len <= size);
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    if (s->bounce_bufs_free) {
+        buf = s->bounce_bufs[--s->bounce_bufs_free];
+    } else if (s->bounce_bufs_allocated < NVME_BOUNCE_BUFS) {
+        buf = qemu_try_memalign(qemu_real_host_page_size, size);
+        if (buf && qemu_vfio_dma_map(s->vfio, buf, size, false, NULL)) {
+            qemu_vfree(buf);
+            buf = NULL;
+        }
+        if (buf) {
+            s->bounce_bufs_allocated++;
+        }
+    }
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+
+    *pooled = buf != NULL;
+    if (!buf) {
+        buf = qemu_try_memalign(qemu_real_host_page_size, len);
+    }
+    return buf;
+}
+
+static coroutine_fn void nvme_put_bounce_buf(BDRVNVMeState *s, void *buf,
+                                             bool pooled)
+{
+    if (!pooled) {
+        qemu_vfree(buf);
+        return;
+    }
+    qemu_co_mutex_lock(&s->dma_map_lock);
+    assert(s->bounce_bufs_free < s->bounce_bufs_allocated);
+    s->bounce_bufs[s->bounce_bufs_free++] = buf;
+    qemu_co_mutex_unlock(&s->dma_map_lock);
+}
+
+static void nvme_free_bounce_bufs(BDRVNVMeState *s)
+{
+    assert(s->bounce_bufs_free == s->bounce_bufs_allocated);
+    for (unsigned i = 0; i < s->bounce_bufs_free; i++) {
+        qemu_vfio_dma_unmap(s->vfio, s->bounce_bufs[i]);
+        qemu_vfree(s->bounce_bufs[i]);
+    }
+    s->bounce_bufs_free = s->bounce_bufs_allocated = 0;
+}
+
 static void nvme_close(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -915,6 +1080,7 @@ static void nvme_close(BlockDriverState *bs)
         nvme_free_queue_pair(s->queues[i]);
     }
     g_free(s->queues);
+    nvme_free_bounce_bufs(s);
     aio_set_event_notifier(bdrv_get_aio_context(bs),
                            &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            false, NULL, NULL);
@@ -932,6 +1098,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t nr_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -947,7 +1114,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    nr_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    if (nr_io_queues < 1 || nr_io_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %u",
+                   UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, nr_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1119,7 +1293,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1190,6 +1364,7 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     BDRVNVMeState *s = bs->opaque;
     int r;
     uint8_t *buf = NULL;
+    bool pooled;
     QEMUIOVector local_qiov;
     size_t len = QEMU_ALIGN_UP(bytes, qemu_real_host_page_size);
     assert(QEMU_IS_ALIGNED(offset, s->page_size));
@@ -1201,7 +1376,7 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     }
     s->stats.unaligned_accesses++;
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
-    buf = qemu_try_memalign(qemu_real_host_page_size, len);
+    buf = nvme_get_bounce_buf(s, len, &pooled);
 
     if (!buf) {
         return -ENOMEM;
@@ -1216,7 +1391,7 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     if (!r && !is_write) {
         qemu_iovec_from_buf(qiov, 0, buf, bytes);
     }
-    qemu_vfree(buf);
+    nvme_put_bounce_buf(s, buf, pooled);
     return r;
 }
 
@@ -1237,7 +1412,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1268,7 +1443,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1321,7 +1496,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -1834,6 +1834,9 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->max_compress_threads = MAX(QCOW2_MAX_THREADS,
+                                  MIN(g_get_num_processors(),
+                                      QCOW2_MAX_COMPRESS_THREADS));
 
     return ret;
 
@@ -4522,68 +4525,98 @@ fail:
     return ret;
 }
 
+/*
+ * Compress the cluster at @offset from @buf, padding a short last cluster
+ * with zeroes.  Returns the compressed size, or -ENOSPC if the data does
+ * not compress into less than a cluster.
+ */
 static coroutine_fn int
-qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
-                                 uint64_t offset, uint64_t bytes,
-                                 QEMUIOVector *qiov, size_t qiov_offset)
+qcow2_co_compress_cluster(BlockDriverState *bs, uint64_t offset,
+                          uint64_t bytes, const void *buf,
+                          void *dest, size_t dest_size)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
+    const void *src = buf;
+    uint8_t *pad_buf = NULL;
     ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
-    buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+        pad_buf = qemu_blockalign(bs, s->cluster_size);
+        memcpy(pad_buf, buf, bytes);
+        memset(pad_buf + bytes, 0, s->cluster_size - bytes);
+        src = pad_buf;
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
 
-    out_buf = g_malloc(s->cluster_size);
+    out_len = qcow2_co_compress(bs, dest, MIN(dest_size, s->cluster_size - 1),
+                                src, s->cluster_size);
+    qemu_vfree(pad_buf);
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
-                                buf, s->cluster_size);
     if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
-        if (ret < 0) {
-            goto fail;
-        }
-        goto success;
+        return -ENOSPC;
     } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
     }
+    return out_len;
+}
+
+/* Allocate space for a compressed cluster and write it */
+static coroutine_fn int
+qcow2_co_write_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                                  const void *buf, size_t buf_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
 
     qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
+    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, buf_size,
                                                 &cluster_offset);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
-        goto fail;
+        return ret;
     }
 
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, buf_size, true);
     qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
-        goto fail;
+        return ret;
     }
 
     BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
+    return bdrv_co_pwrite(s->data_file, cluster_offset, buf_size,
+                          (void *)buf, 0);
+}
+
+static coroutine_fn int
+qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
+                                 uint64_t offset, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+    uint8_t *buf, *out_buf;
+
+    buf = qemu_blockalign(bs, bytes);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
+
+    out_buf = g_malloc(s->cluster_size);
+
+    ret = qcow2_co_compress_cluster(bs, offset, bytes, buf,
+                                    out_buf, s->cluster_size);
+    if (ret == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+    } else if (ret >= 0) {
+        ret = qcow2_co_write_compressed_cluster(bs, offset, out_buf, ret);
     }
-success:
-    ret = 0;
-fail:
+
     qemu_vfree(buf);
     g_free(out_buf);
-    return ret;
+    return ret < 0 ? ret : 0;
 }
 
 static coroutine_fn int qcow2_co_pwritev_compressed_task_entry(AioTask *task)
@@ -4663,6 +4696,56 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+static int qcow2_check_compressed_request(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (has_data_file(bs)) {
+        return -ENOTSUP;
+    }
+
+    /* A single cluster, or the short cluster at the end of the image */
+    if (offset_into_cluster(s, offset) || bytes == 0 ||
+        (bytes != s->cluster_size &&
+         (bytes > s->cluster_size ||
+          offset + bytes != (bs->total_sectors << BDRV_SECTOR_BITS)))) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static coroutine_fn int
+qcow2_co_compress_request(BlockDriverState *bs, uint64_t offset,
+                          uint64_t bytes, const void *buf,
+                          void *dest, size_t dest_size)
+{
+    int ret = qcow2_check_compressed_request(bs, offset, bytes);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return qcow2_co_compress_cluster(bs, offset, bytes, buf, dest, dest_size);
+}
+
+static coroutine_fn int
+qcow2_co_pwrite_precompressed(BlockDriverState *bs, uint64_t offset,
+                              uint64_t bytes, const void *buf,
+                              size_t buf_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = qcow2_check_compressed_request(bs, offset, bytes);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (buf_size == 0 || buf_size >= s->cluster_size) {
+        return -EINVAL;
+    }
+    return qcow2_co_write_compressed_cluster(bs, offset, buf, buf_size);
+}
+
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t cluster_descriptor,
@@ -5931,6 +6014,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_copy_range_to  = qcow2_co_copy_range_to,
     .bdrv_co_truncate       = qcow2_co_truncate,
     .bdrv_co_pwritev_compressed_part = qcow2_co_pwritev_compressed_part,
+    .bdrv_co_compress       = qcow2_co_compress_request,
+    .bdrv_co_pwrite_precompressed = qcow2_co_pwrite_precompressed,
     .bdrv_make_empty        = qcow2_make_empty,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -323,6 +323,11 @@ typedef struct Qcow2BitmapHeaderExt {
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
 #define QCOW2_MAX_THREADS 4
+/*
+ * Compression needs no per-thread state, so it may use one thread per host
+ * CPU, up to the default thread pool size.
+ */
+#define QCOW2_MAX_COMPRESS_THREADS 64
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -408,6 +413,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_compress_threads;
 
     BdrvChild *data_file;
 
@@ -0,0 +1,570 @@
+/*
+ * Shared cache filter driver
+ *
+ * The driver is inserted above a read-only node (typically a base image that
+ * many VMs use as their backing file) and keeps a copy of the data read from
+ * it in a shared memory file.  All QEMU processes (and qemu-storage-daemon
+ * instances) that open the same image with the same cache file share the
+ * cached data, so that the base image is read from storage only once.
+ *
+ * Cache file layout:
+ *
+ *   [header, 4k][cluster state array, page aligned][cluster data]
+ *
+ * Each cluster has a one-byte state.  The first process to read a cluster
+ * atomically moves it from EMPTY to FILLING, copies the data and publishes it
+ * by setting VALID.  If a process dies while filling a cluster, the cluster
+ * stays FILLING and is simply never cached.
+ *
+ * Processes create, size and initialize the file while holding a lock on its
+ * first byte, so that they cannot resize it under each other's mappings.
+ *
+ * The header records the device, inode, size and modification time of the
+ * image file, so that a cache file is rejected once the image has been
+ * recreated or modified under the same name.
+ *
+ * The file is sparse.  Memory for a cluster is allocated before its data is
+ * copied, because storing to a hole of a full tmpfs raises SIGBUS.  If
+ * /dev/shm is full, clusters are simply not cached.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC          0x5145534843414348ULL /* "QESHCACH" */
+#define SHARED_CACHE_VERSION        2
+#define SHARED_CACHE_HEADER_SIZE    4096
+#define SHARED_CACHE_IDENTITY_LEN   1024
+
+/* How long to wait for another process to initialize the cache file */
+#define SHARED_CACHE_INIT_TIMEOUT_US    (5 * G_USEC_PER_SEC)
+#define SHARED_CACHE_INIT_POLL_US       1000
+
+enum {
+    SHARED_CACHE_HDR_EMPTY = 0,
+    SHARED_CACHE_HDR_READY,
+};
+
+enum {
+    SHARED_CACHE_CLUSTER_EMPTY = 0,
+    SHARED_CACHE_CLUSTER_FILLING,
+    SHARED_CACHE_CLUSTER_VALID,
+};
+
+/* The image file, all zeroes if it is not a local file */
+typedef struct SharedCacheImageId {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+} SharedCacheImageId;
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t state;         /* SHARED_CACHE_HDR_* */
+    uint64_t cluster_size;
+    uint64_t length;        /* length of the cached image in bytes */
+    char identity[SHARED_CACHE_IDENTITY_LEN];
+    SharedCacheImageId image_id;
+} SharedCacheHeader;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheHeader) > SHARED_CACHE_HEADER_SIZE);
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    void *map;
+    size_t map_size;
+    size_t data_offset;
+    SharedCacheHeader *header;
+    uint8_t *cluster_state;
+    uint8_t *data;
+
+    uint64_t cluster_size;
+    uint64_t nb_clusters;
+    int64_t length;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH "path"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define SHARED_CACHE_OPT_IDENTITY "identity"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "path of the shared cache file, e.g. in /dev/shm",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "cache granularity, default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IDENTITY,
+            .type = QEMU_OPT_STRING,
+            .help = "string identifying the cached image, defaults to the "
+                    "file name of the child node; required if the image is "
+                    "not a local file",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * Creating, sizing and initializing the cache file is serialized between
+ * processes with a lock on its first byte.  Otherwise a process opening a
+ * different image could truncate the file while another one has it mapped
+ * already.  The lock goes away with the process if it dies.
+ */
+static int shared_cache_lock(int fd, const char *path, Error **errp)
+{
+    int64_t waited;
+    int ret;
+
+    for (waited = 0; ; waited += SHARED_CACHE_INIT_POLL_US) {
+        ret = qemu_lock_fd(fd, 0, 1, true);
+        if (ret != -EAGAIN && ret != -EACCES) {
+            break;
+        }
+        if (waited >= SHARED_CACHE_INIT_TIMEOUT_US) {
+            error_setg(errp, "Timed out waiting for shared cache file '%s' "
+                       "to be initialized", path);
+            return -ETIMEDOUT;
+        }
+        g_usleep(SHARED_CACHE_INIT_POLL_US);
+    }
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not lock shared cache file '%s'",
+                         path);
+    }
+    return ret;
+}
+
+/*
+ * Identify the file that stores the image.  Returns -ENOENT if the image
+ * is not stored in a local file.
+ */
+static int shared_cache_get_image_id(BlockDriverState *bs,
+                                     SharedCacheImageId *id)
+{
+    BlockDriverState *file = bs->file->bs;
+    struct stat st;
+
+    while (file->file) {
+        file = file->file->bs;
+    }
+
+    memset(id, 0, sizeof(*id));
+    if (stat(file->filename, &st) < 0) {
+        return -errno;
+    }
+
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    id->size = st.st_size;
+    id->mtime = st.st_mtime;
+#ifdef CONFIG_LINUX
+    id->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+/*
+ * Allocate memory for a range of the cache file, so that storing to the
+ * mapping cannot raise SIGBUS.  Returns a negative errno, e.g. -ENOSPC if
+ * /dev/shm is full.
+ */
+static int shared_cache_reserve(BDRVSharedCacheState *s, uint64_t offset,
+                                uint64_t len)
+{
+#ifdef CONFIG_POSIX_FALLOCATE
+    return -posix_fallocate(s->fd, offset, len);
+#else
+    return 0;
+#endif
+}
+
+static int shared_cache_map(BlockDriverState *bs, const char *path,
+                            const char *identity,
+                            const SharedCacheImageId *image_id, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    size_t state_size = ROUND_UP(s->nb_clusters, qemu_real_host_page_size);
+    size_t size = SHARED_CACHE_HEADER_SIZE + state_size +
+                  s->nb_clusters * s->cluster_size;
+    SharedCacheHeader *h;
+    struct stat st;
+    int fd, ret;
+
+    fd = s->fd = qemu_create(path, O_RDWR, 0600, errp);
+    if (fd < 0) {
+        return -EINVAL;
+    }
+
+    ret = shared_cache_lock(fd, path, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat shared cache file");
+        goto out;
+    }
+    if (st.st_size == 0) {
+        /* The file is sparse, memory is only allocated for cached clusters */
+        if (ftruncate(fd, size) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno,
+                             "Could not resize shared cache file");
+            goto out;
+        }
+    } else if (st.st_size != size) {
+        error_setg(errp, "Shared cache file '%s' belongs to a different image",
+                   path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* The header and cluster states are written to right away */
+    ret = shared_cache_reserve(s, 0, SHARED_CACHE_HEADER_SIZE + state_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not allocate shared cache file");
+        goto out;
+    }
+
+    s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map shared cache file");
+        goto out;
+    }
+    s->map_size = size;
+
+    h = s->header = s->map;
+    s->cluster_state = s->map + SHARED_CACHE_HEADER_SIZE;
+    s->data_offset = SHARED_CACHE_HEADER_SIZE + state_size;
+    s->data = s->map + s->data_offset;
+
+    /* If a process died while initializing the header, start over */
+    if (qatomic_load_acquire(&h->state) != SHARED_CACHE_HDR_READY) {
+        h->magic = SHARED_CACHE_MAGIC;
+        h->version = SHARED_CACHE_VERSION;
+        h->cluster_size = s->cluster_size;
+        h->length = s->length;
+        pstrcpy(h->identity, sizeof(h->identity), identity);
+        h->image_id = *image_id;
+        qatomic_store_release(&h->state, SHARED_CACHE_HDR_READY);
+    }
+
+    if (h->magic != SHARED_CACHE_MAGIC ||
+        h->version != SHARED_CACHE_VERSION) {
+        error_setg(errp, "'%s' is not a shared cache file", path);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (h->cluster_size != s->cluster_size || h->length != s->length ||
+        strncmp(h->identity, identity, sizeof(h->identity) - 1) ||
+        memcmp(&h->image_id, image_id, sizeof(*image_id))) {
+        error_setg(errp, "Shared cache file '%s' belongs to a different image",
+                   path);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = 0;
+out:
+    /* Unlocking keeps the file open for shared_cache_reserve() */
+    qemu_unlock_fd(fd, 0, 1);
+    return ret;
+}
+
+static void shared_cache_unmap(BDRVSharedCacheState *s)
+{
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    const char *path, *identity;
+    SharedCacheImageId image_id;
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    int ret;
+
+    s->fd = -1;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache filter only supports read-only "
+                   "nodes");
+        return -EINVAL;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "Parameter '" SHARED_CACHE_OPT_PATH "' is required");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                        64 * KiB);
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < qemu_real_host_page_size ||
+        s->cluster_size > 2 * MiB) {
+        error_setg(errp, "cluster-size must be a power of two between the "
+                   "host page size and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    identity = qemu_opt_get(opts, SHARED_CACHE_OPT_IDENTITY);
+    ret = shared_cache_get_image_id(bs, &image_id);
+    if (ret < 0 && !identity) {
+        error_setg_errno(errp, -ret, "Could not identify the image file, "
+                         "set '" SHARED_CACHE_OPT_IDENTITY "' for images "
+                         "that are not local files");
+        goto out;
+    }
+    if (!identity) {
+        identity = bs->file->bs->filename;
+    }
+
+    s->length = bdrv_getlength(bs->file->bs);
+    if (s->length < 0) {
+        error_setg_errno(errp, -s->length, "Could not get image length");
+        ret = s->length;
+        goto out;
+    }
+    s->nb_clusters = DIV_ROUND_UP(s->length, s->cluster_size);
+
+    ret = shared_cache_map(bs, path, identity, &image_id, &local_err);
+    if (ret < 0) {
+        shared_cache_unmap(s);
+        if (ret != -ENOSPC) {
+            error_propagate(errp, local_err);
+            goto out;
+        }
+        /* Still usable without the cache, just slower */
+        warn_reportf_err(local_err, "Reading '%s' without shared cache: ",
+                         bs->file->bs->filename);
+    }
+
+    bs->supported_read_flags = BDRV_REQ_PREFETCH;
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    shared_cache_unmap(bs->opaque);
+}
+
+static int64_t shared_cache_getlength(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    return s->length;
+}
+
+static bool shared_cache_is_cached(BDRVSharedCacheState *s,
+                                   uint64_t first, uint64_t last)
+{
+    uint64_t i;
+
+    for (i = first; i <= last; i++) {
+        if (qatomic_load_acquire(&s->cluster_state[i]) !=
+            SHARED_CACHE_CLUSTER_VALID) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Copy the clusters in @buf that nobody else has cached yet into the cache */
+static void shared_cache_fill(BlockDriverState *bs, uint64_t first,
+                              uint64_t last, const uint8_t *buf)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    for (i = first; i <= last; i++) {
+        uint64_t offset = i * s->cluster_size;
+        uint64_t len = MIN(s->cluster_size, s->length - offset);
+
+        if (qatomic_cmpxchg(&s->cluster_state[i], SHARED_CACHE_CLUSTER_EMPTY,
+                            SHARED_CACHE_CLUSTER_FILLING) !=
+            SHARED_CACHE_CLUSTER_EMPTY) {
+            continue;
+        }
+
+        ret = shared_cache_reserve(s, s->data_offset + offset, len);
+        if (ret < 0) {
+            /* Leave it to a later read, there may be room again then */
+            trace_shared_cache_fill_error(bs, offset, ret);
+            qatomic_store_release(&s->cluster_state[i],
+                                  SHARED_CACHE_CLUSTER_EMPTY);
+            return;
+        }
+
+        memcpy(s->data + offset, buf + (i - first) * s->cluster_size, len);
+        qatomic_store_release(&s->cluster_state[i],
+                              SHARED_CACHE_CLUSTER_VALID);
+    }
+}
+
+static int coroutine_fn shared_cache_co_preadv_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint64_t first = offset / s->cluster_size;
+    uint64_t last = (offset + bytes - 1) / s->cluster_size;
+    uint64_t start, len;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->map) {
+        if (flags & BDRV_REQ_PREFETCH) {
+            return 0;
+        }
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    if (shared_cache_is_cached(s, first, last)) {
+        trace_shared_cache_hit(bs, offset, bytes);
+        if (!(flags & BDRV_REQ_PREFETCH)) {
+            qemu_iovec_from_buf(qiov, qiov_offset, s->data + offset, bytes);
+        }
+        return 0;
+    }
+
+    /*
+     * Read whole clusters, so that small guest requests populate the cache
+     * as well.
+     */
+    start = first * s->cluster_size;
+    len = MIN((last + 1) * s->cluster_size, s->length) - start;
+    trace_shared_cache_miss(bs, offset, bytes, start, len);
+
+    buf = qemu_try_blockalign(bs->file->bs, len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, len, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    shared_cache_fill(bs, first, last, buf);
+    if (!(flags & BDRV_REQ_PREFETCH)) {
+        qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), bytes);
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /* Cached data would become stale if the image changed underneath us */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static void shared_cache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    /* A cache miss reads whole clusters from the child */
+    bs->bl.opt_transfer = MAX(bs->bl.opt_transfer, s->cluster_size);
+}
+
+static BlockDriver bdrv_shared_cache = {
+    .format_name                = "shared-cache",
+    .instance_size              = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                  = shared_cache_open,
+    .bdrv_close                 = shared_cache_close,
+    .bdrv_child_perm            = shared_cache_child_perm,
+
+    .bdrv_getlength             = shared_cache_getlength,
+    .bdrv_refresh_limits        = shared_cache_refresh_limits,
+
+    .bdrv_co_preadv_part        = shared_cache_co_preadv_part,
+    .bdrv_co_block_status       = bdrv_co_block_status_from_file,
+
+    .is_filter                  = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache);
+}
+
+block_init(bdrv_shared_cache_init);
@@ -46,6 +46,7 @@ static const int user_feature_bits[] = {
     VIRTIO_F_VERSION_1,
     VIRTIO_RING_F_INDIRECT_DESC,
     VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_IN_ORDER,
     VIRTIO_F_NOTIFY_ON_EMPTY,
     VHOST_INVALID_FEATURE_BIT
 };
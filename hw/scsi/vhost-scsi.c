@@ -37,6 +37,7 @@ static const int kernel_feature_bits[] = {
     VIRTIO_F_NOTIFY_ON_EMPTY,
     VIRTIO_RING_F_INDIRECT_DESC,
     VIRTIO_RING_F_EVENT_IDX,
+    VIRTIO_F_IN_ORDER,
     VIRTIO_SCSI_F_HOTPLUG,
     VHOST_INVALID_FEATURE_BIT
 };
@@ -0,0 +1,738 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * vhost shadow virtqueue
+ *
+ * A shadow virtqueue sits between the guest's virtqueue and a vhost
+ * device.  QEMU pops the guest's buffers, exposes them to the device
+ * through a split vring of its own and returns them to the guest once the
+ * device has used them.  Since every buffer the device writes to goes back
+ * to the guest through virtqueue_fill(), the pages are marked dirty like
+ * for any emulated device, which is what makes a device without dirty
+ * page tracking migratable.
+ *
+ * The descriptors carry guest physical addresses: the device must map
+ * guest memory 1:1, and the shadow vrings somewhere outside of it.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/virtio/vhost-shadow-virtqueue.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/processor.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+struct VhostShadowVirtqueue {
+    /* Shadow vring, read by the device */
+    struct vring vring;
+
+    /* Kicked by the guest, borrowed from the guest's host notifier */
+    EventNotifier guest_kick;
+
+    /* Guest notifier, borrowed from vhost: masked notifier or irqfd */
+    EventNotifier guest_call;
+
+    /* Kicked by us to notify the device */
+    EventNotifier hdev_kick;
+
+    /* Kicked by the device when it uses buffers */
+    EventNotifier hdev_call;
+
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+
+    const VhostShadowVirtqueueOps *ops;
+    void *ops_opaque;
+
+    /* Guest element of each shadow descriptor chain, by head */
+    VirtQueueElement **ring_id_maps;
+
+    /* Guest element that did not fit in the shadow vring */
+    VirtQueueElement *next_guest_avail_elem;
+
+    /* Head of the free descriptors, chained through desc.next */
+    uint16_t free_head;
+    uint16_t num_free;
+
+    uint16_t shadow_avail_idx;
+    uint16_t shadow_used_idx;
+    uint16_t last_used_idx;
+};
+
+/* Transport features the shadow vring does not implement */
+#define VHOST_SVQ_UNSUPPORTED_FEATURES \
+    ((1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+     (1ULL << VIRTIO_RING_F_EVENT_IDX) | \
+     (1ULL << VIRTIO_F_RING_PACKED) | \
+     (1ULL << VIRTIO_F_IN_ORDER))
+
+/* How long vhost_svq_send_sync() waits for the device */
+#define VHOST_SVQ_SEND_TIMEOUT_NS (10 * NANOSECONDS_PER_SECOND)
+
+/* How long vhost_svq_drain() waits for the device */
+#define VHOST_SVQ_DRAIN_TIMEOUT_NS (NANOSECONDS_PER_SECOND / 10)
+
+/**
+ * vhost_svq_device_features: features to negotiate with the device
+ *
+ * @features: the features acked by the guest
+ *
+ * The guest's virtqueue keeps all of its features, but the device only
+ * ever sees the shadow vring, which is a plain split ring.
+ */
+uint64_t vhost_svq_device_features(uint64_t features)
+{
+    return features & ~VHOST_SVQ_UNSUPPORTED_FEATURES;
+}
+
+void vhost_svq_set_guest_kick_fd(VhostShadowVirtqueue *svq, int kick_fd)
+{
+    event_notifier_init_fd(&svq->guest_kick, kick_fd);
+}
+
+void vhost_svq_set_guest_call_fd(VhostShadowVirtqueue *svq, int call_fd)
+{
+    event_notifier_init_fd(&svq->guest_call, call_fd);
+}
+
+int vhost_svq_get_device_kick_fd(const VhostShadowVirtqueue *svq)
+{
+    return event_notifier_get_fd(&svq->hdev_kick);
+}
+
+int vhost_svq_get_device_call_fd(const VhostShadowVirtqueue *svq)
+{
+    return event_notifier_get_fd(&svq->hdev_call);
+}
+
+/* Descriptor table and available ring, read-only for the device */
+size_t vhost_svq_driver_area_size(uint16_t num)
+{
+    size_t desc_size = sizeof(struct vring_desc) * num;
+    size_t avail_size = offsetof(struct vring_avail, ring) +
+                        sizeof(uint16_t) * (num + 1);
+
+    return ROUND_UP(desc_size + avail_size, qemu_real_host_page_size);
+}
+
+/* Used ring, written by the device */
+size_t vhost_svq_device_area_size(uint16_t num)
+{
+    size_t used_size = offsetof(struct vring_used, ring) +
+                       sizeof(struct vring_used_elem) * num +
+                       sizeof(uint16_t);
+
+    return ROUND_UP(used_size, qemu_real_host_page_size);
+}
+
+void *vhost_svq_get_driver_area(const VhostShadowVirtqueue *svq)
+{
+    return svq->vring.desc;
+}
+
+void *vhost_svq_get_device_area(const VhostShadowVirtqueue *svq)
+{
+    return svq->vring.used;
+}
+
+uint16_t vhost_svq_get_num(const VhostShadowVirtqueue *svq)
+{
+    return svq->vring.num;
+}
+
+static void vhost_svq_kick_device(VhostShadowVirtqueue *svq)
+{
+    /* Make the new avail idx visible before checking the device's flags */
+    smp_mb();
+    if (le16_to_cpu(svq->vring.used->flags) & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
+
+    event_notifier_set(&svq->hdev_kick);
+}
+
+static void vhost_svq_notify_guest(VhostShadowVirtqueue *svq)
+{
+    if (event_notifier_get_fd(&svq->guest_call) < 0) {
+        return;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!virtio_should_notify(svq->vdev, svq->vq)) {
+            return;
+        }
+    }
+
+    event_notifier_set(&svq->guest_call);
+}
+
+/*
+ * Make a chain of @out_num device-readable and @in_num device-writable
+ * buffers available to the device.  The addresses are in @out_addr and
+ * @in_addr, the lengths in @out_sg and @in_sg.  Returns the head of the
+ * chain.
+ */
+static uint16_t vhost_svq_add_chain(VhostShadowVirtqueue *svq,
+                                    const hwaddr *out_addr,
+                                    const struct iovec *out_sg,
+                                    unsigned int out_num,
+                                    const hwaddr *in_addr,
+                                    const struct iovec *in_sg,
+                                    unsigned int in_num)
+{
+    unsigned int ndescs = out_num + in_num;
+    uint16_t head = svq->free_head;
+    uint16_t i = head, last = head;
+    unsigned int n;
+
+    for (n = 0; n < ndescs; n++) {
+        bool write = n >= out_num;
+        const struct iovec *iov;
+        hwaddr addr;
+        uint16_t flags = 0;
+
+        if (write) {
+            iov = &in_sg[n - out_num];
+            addr = in_addr[n - out_num];
+            flags |= VRING_DESC_F_WRITE;
+        } else {
+            iov = &out_sg[n];
+            addr = out_addr[n];
+        }
+        if (n + 1 < ndescs) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+
+        svq->vring.desc[i].addr = cpu_to_le64(addr);
+        svq->vring.desc[i].len = cpu_to_le32(iov->iov_len);
+        svq->vring.desc[i].flags = cpu_to_le16(flags);
+        last = i;
+        i = le16_to_cpu(svq->vring.desc[i].next);
+    }
+
+    svq->free_head = le16_to_cpu(svq->vring.desc[last].next);
+    svq->num_free -= ndescs;
+
+    svq->vring.avail->ring[svq->shadow_avail_idx % svq->vring.num] =
+        cpu_to_le16(head);
+    svq->shadow_avail_idx++;
+
+    /* Descriptors must be visible before the device sees the new index */
+    smp_wmb();
+    svq->vring.avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+    return head;
+}
+
+static void vhost_svq_add(VhostShadowVirtqueue *svq, VirtQueueElement *elem)
+{
+    uint16_t head;
+
+    head = vhost_svq_add_chain(svq, elem->out_addr, elem->out_sg,
+                               elem->out_num, elem->in_addr, elem->in_sg,
+                               elem->in_num);
+    svq->ring_id_maps[head] = elem;
+}
+
+/* Forward the guest's available buffers to the device */
+static void vhost_svq_process_guest(VhostShadowVirtqueue *svq)
+{
+    unsigned int added = 0;
+
+    do {
+        virtio_queue_set_notification(svq->vq, false);
+
+        while (true) {
+            VirtQueueElement *elem = svq->next_guest_avail_elem;
+            unsigned int ndescs;
+
+            svq->next_guest_avail_elem = NULL;
+            if (!elem) {
+                elem = virtqueue_pop(svq->vq, sizeof(*elem));
+            }
+            if (!elem) {
+                break;
+            }
+
+            ndescs = elem->out_num + elem->in_num;
+            if (ndescs > svq->vring.num) {
+                /*
+                 * A chain longer than the ring is invalid for a split
+                 * virtqueue of this size, the guest must reset the device
+                 */
+                virtio_error(svq->vdev, "vhost shadow virtqueue: %u "
+                             "descriptors do not fit in a ring of %u",
+                             ndescs, svq->vring.num);
+                virtqueue_detach_element(svq->vq, elem, 0);
+                g_free(elem);
+                goto out;
+            }
+            if (ndescs > svq->num_free) {
+                /* Resumed by vhost_svq_flush() when the device returns some */
+                svq->next_guest_avail_elem = elem;
+                goto out;
+            }
+
+            vhost_svq_add(svq, elem);
+            added++;
+        }
+
+        virtio_queue_set_notification(svq->vq, true);
+    } while (!virtio_queue_empty(svq->vq));
+
+out:
+    trace_vhost_svq_process_guest(svq, added);
+    if (added) {
+        vhost_svq_kick_device(svq);
+    }
+}
+
+static void vhost_svq_handle_guest_kick(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             guest_kick);
+
+    event_notifier_test_and_clear(n);
+    vhost_svq_process_guest(svq);
+}
+
+static bool vhost_svq_more_used(VhostShadowVirtqueue *svq)
+{
+    if (svq->last_used_idx != svq->shadow_used_idx) {
+        return true;
+    }
+
+    svq->shadow_used_idx = le16_to_cpu(qatomic_read(&svq->vring.used->idx));
+    return svq->last_used_idx != svq->shadow_used_idx;
+}
+
+/* Fetch the next used element; call only after vhost_svq_more_used() */
+static struct vring_used_elem vhost_svq_next_used(VhostShadowVirtqueue *svq)
+{
+    struct vring_used_elem used;
+
+    /* Only read the used element after seeing the new index */
+    smp_rmb();
+    used = svq->vring.used->ring[svq->last_used_idx % svq->vring.num];
+    used.id = le32_to_cpu(used.id);
+    used.len = le32_to_cpu(used.len);
+    svq->last_used_idx++;
+    return used;
+}
+
+/* Give the chain of @ndescs descriptors at @head back to the free list */
+static void vhost_svq_free_chain(VhostShadowVirtqueue *svq, uint16_t head,
+                                 unsigned int ndescs)
+{
+    uint16_t last = head;
+    unsigned int n;
+
+    for (n = 1; n < ndescs; n++) {
+        last = le16_to_cpu(svq->vring.desc[last].next);
+    }
+    svq->vring.desc[last].next = cpu_to_le16(svq->free_head);
+    svq->free_head = head;
+    svq->num_free += ndescs;
+}
+
+static VirtQueueElement *vhost_svq_get_buf(VhostShadowVirtqueue *svq,
+                                           uint32_t *len)
+{
+    struct vring_used_elem used;
+    VirtQueueElement *elem;
+
+    if (!vhost_svq_more_used(svq)) {
+        return NULL;
+    }
+
+    used = vhost_svq_next_used(svq);
+    if (used.id >= svq->vring.num || !svq->ring_id_maps[used.id]) {
+        error_report("vhost shadow virtqueue: device %s used invalid "
+                     "descriptor %u", svq->vdev->name, used.id);
+        return NULL;
+    }
+
+    elem = svq->ring_id_maps[used.id];
+    svq->ring_id_maps[used.id] = NULL;
+    vhost_svq_free_chain(svq, used.id, elem->out_num + elem->in_num);
+
+    *len = used.len;
+    return elem;
+}
+
+/* Return the buffers used by the device to the guest */
+static void vhost_svq_flush(VhostShadowVirtqueue *svq, bool process_guest)
+{
+    unsigned int guest_num = virtio_queue_get_num(svq->vdev,
+                                    virtio_get_queue_index(svq->vq));
+    VirtQueueElement *elem;
+    unsigned int i;
+    uint32_t len;
+
+    /* virtqueue_fill() and virtqueue_flush() access the guest's vring */
+    RCU_READ_LOCK_GUARD();
+
+    do {
+        i = 0;
+        svq->vring.avail->flags = cpu_to_le16(VRING_AVAIL_F_NO_INTERRUPT);
+
+        while ((elem = vhost_svq_get_buf(svq, &len))) {
+            if (i == guest_num) {
+                virtqueue_flush(svq->vq, i);
+                i = 0;
+            }
+            if (svq->ops && svq->ops->used_handler) {
+                svq->ops->used_handler(svq, elem, len, svq->ops_opaque);
+            }
+            virtqueue_fill(svq->vq, elem, len, i++);
+            g_free(elem);
+        }
+
+        trace_vhost_svq_flush(svq, i);
+        if (i) {
+            virtqueue_flush(svq->vq, i);
+            vhost_svq_notify_guest(svq);
+        }
+
+        svq->vring.avail->flags = 0;
+        /* Re-enable calls before checking for buffers used meanwhile */
+        smp_mb();
+
+        if (process_guest && svq->next_guest_avail_elem) {
+            vhost_svq_process_guest(svq);
+        }
+    } while (vhost_svq_more_used(svq));
+}
+
+static void vhost_svq_handle_call(EventNotifier *n)
+{
+    VhostShadowVirtqueue *svq = container_of(n, VhostShadowVirtqueue,
+                                             hdev_call);
+
+    event_notifier_test_and_clear(n);
+    vhost_svq_flush(svq, true);
+}
+
+/*
+ * Count the buffers in flight that are older than a buffer the device has
+ * used.  The guest virtqueue's last_avail_idx cannot be rewound past the
+ * used buffer, so these cannot be made available again.
+ */
+static unsigned int vhost_svq_count_stranded(VhostShadowVirtqueue *svq)
+{
+    g_autofree unsigned long *seen = bitmap_new(svq->vring.num);
+    uint16_t avail_idx = svq->shadow_avail_idx;
+    unsigned int i, in_flight = 0;
+
+    for (i = 0; i < svq->vring.num; i++) {
+        if (svq->ring_id_maps[i]) {
+            in_flight++;
+        }
+    }
+
+    /*
+     * Walk the newest buffers in flight.  A head seen twice was used and
+     * then reused by a newer buffer.
+     */
+    for (i = 0; i < in_flight; i++) {
+        uint16_t head;
+
+        avail_idx--;
+        head = le16_to_cpu(svq->vring.avail->ring[avail_idx %
+                                                  svq->vring.num]);
+        if (!svq->ring_id_maps[head] || test_and_set_bit(head, seen)) {
+            break;
+        }
+    }
+    return in_flight - i;
+}
+
+/**
+ * vhost_svq_drain: stop forwarding guest buffers and let the device catch up
+ *
+ * @svq: the shadow virtqueue
+ *
+ * The device may use buffers out of order.  Wait until it has used every
+ * buffer in flight that is older than one it used, and return them to the
+ * guest, so that vhost_svq_stop() can make all remaining buffers available
+ * again.  Buffers that nothing is older than, such as receive buffers
+ * waiting for packets, are not waited for.
+ *
+ * The device must still be running.
+ */
+void vhost_svq_drain(VhostShadowVirtqueue *svq)
+{
+    int64_t deadline;
+    unsigned int stranded;
+
+    if (!svq->vq) {
+        return;
+    }
+
+    event_notifier_set_handler(&svq->guest_kick, NULL);
+    event_notifier_set_handler(&svq->hdev_call, NULL);
+
+    deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+               VHOST_SVQ_DRAIN_TIMEOUT_NS;
+    while (true) {
+        vhost_svq_flush(svq, false);
+        stranded = vhost_svq_count_stranded(svq);
+        if (!stranded ||
+            qemu_clock_get_ns(QEMU_CLOCK_REALTIME) > deadline) {
+            break;
+        }
+        while (!vhost_svq_more_used(svq) &&
+               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) <= deadline) {
+            cpu_relax();
+        }
+    }
+
+    trace_vhost_svq_drain(svq, stranded);
+}
+
+/**
+ * vhost_svq_send_sync: send a buffer of QEMU's own to the device
+ *
+ * @svq: the shadow virtqueue
+ * @out_addr: device address of the buffer the device reads
+ * @out_len: length of the buffer at @out_addr
+ * @in_addr: device address of the buffer the device writes
+ * @in_len: length of the buffer at @in_addr
+ *
+ * Wait until the device has used the buffer.  The shadow vring must not
+ * hold any of the guest's buffers, so this is meant to be called right
+ * after vhost_svq_start(), before the guest's kick is processed.
+ *
+ * Returns: the number of bytes the device wrote, or -errno.
+ */
+ssize_t vhost_svq_send_sync(VhostShadowVirtqueue *svq,
+                            hwaddr out_addr, size_t out_len,
+                            hwaddr in_addr, size_t in_len)
+{
+    struct iovec out_sg = { .iov_len = out_len };
+    struct iovec in_sg = { .iov_len = in_len };
+    struct vring_used_elem used;
+    int64_t deadline;
+    uint16_t head;
+
+    if (svq->num_free != svq->vring.num || svq->next_guest_avail_elem) {
+        return -EBUSY;
+    }
+
+    head = vhost_svq_add_chain(svq, &out_addr, &out_sg, 1,
+                               &in_addr, &in_sg, 1);
+    vhost_svq_kick_device(svq);
+
+    deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+               VHOST_SVQ_SEND_TIMEOUT_NS;
+    while (!vhost_svq_more_used(svq)) {
+        if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) > deadline) {
+            error_report("vhost shadow virtqueue: device %s did not use "
+                         "the buffer in time", svq->vdev->name);
+            return -ETIMEDOUT;
+        }
+        cpu_relax();
+    }
+
+    used = vhost_svq_next_used(svq);
+    if (used.id != head) {
+        error_report("vhost shadow virtqueue: device %s used invalid "
+                     "descriptor %u", svq->vdev->name, used.id);
+        return -EIO;
+    }
+    vhost_svq_free_chain(svq, head, 2);
+
+    return MIN(used.len, in_len);
+}
+
+/**
+ * vhost_svq_start: start shadowing a guest virtqueue
+ *
+ * @svq: the shadow virtqueue
+ * @vdev: the device of @vq
+ * @vq: the guest virtqueue
+ *
+ * The shadow vring is as large as the guest's and starts empty.  The guest
+ * kick notifier must have been set with vhost_svq_set_guest_kick_fd().
+ */
+void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
+                     VirtQueue *vq)
+{
+    uint16_t num = virtio_queue_get_num(vdev, virtio_get_queue_index(vq));
+    size_t driver_size = vhost_svq_driver_area_size(num);
+    size_t device_size = vhost_svq_device_area_size(num);
+    void *driver_area, *device_area;
+    unsigned int i;
+
+    svq->vdev = vdev;
+    svq->vq = vq;
+
+    driver_area = qemu_memalign(qemu_real_host_page_size, driver_size);
+    memset(driver_area, 0, driver_size);
+    device_area = qemu_memalign(qemu_real_host_page_size, device_size);
+    memset(device_area, 0, device_size);
+
+    svq->vring.num = num;
+    svq->vring.desc = driver_area;
+    svq->vring.avail = driver_area + sizeof(struct vring_desc) * num;
+    svq->vring.used = device_area;
+    for (i = 0; i < num - 1; i++) {
+        svq->vring.desc[i].next = cpu_to_le16(i + 1);
+    }
+
+    svq->ring_id_maps = g_new0(VirtQueueElement *, num);
+    svq->next_guest_avail_elem = NULL;
+    svq->free_head = 0;
+    svq->num_free = num;
+    svq->shadow_avail_idx = 0;
+    svq->shadow_used_idx = 0;
+    svq->last_used_idx = 0;
+
+    event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
+    event_notifier_set_handler(&svq->guest_kick, vhost_svq_handle_guest_kick);
+
+    /* Pick up the buffers the guest made available while we were stopped */
+    event_notifier_set(&svq->guest_kick);
+}
+
+/**
+ * vhost_svq_stop: stop shadowing the guest virtqueue
+ *
+ * @svq: the shadow virtqueue
+ *
+ * The device must not access the shadow vring anymore.  The buffers it
+ * has used are returned to the guest.  The ones still in flight are made
+ * available again, so that the guest virtqueue's last_avail_idx is the
+ * vring base to resume from.  Call vhost_svq_drain() first, while the
+ * device is running, so that this is possible for all of them.
+ */
+void vhost_svq_stop(VhostShadowVirtqueue *svq)
+{
+    VirtQueueElement *elem;
+    uint16_t avail_idx;
+    unsigned int i, n;
+
+    if (!svq->vq) {
+        return;
+    }
+
+    event_notifier_set_handler(&svq->guest_kick, NULL);
+    event_notifier_set_handler(&svq->hdev_call, NULL);
+
+    vhost_svq_flush(svq, false);
+
+    /*
+     * virtqueue_unpop() only rewinds last_avail_idx, so unpop the buffers
+     * newest first.  The element waiting for room was popped last.
+     */
+    if (svq->next_guest_avail_elem) {
+        virtqueue_unpop(svq->vq, svq->next_guest_avail_elem, 0);
+        g_free(svq->next_guest_avail_elem);
+        svq->next_guest_avail_elem = NULL;
+    }
+    avail_idx = svq->shadow_avail_idx;
+    for (i = 0; i < svq->vring.num; i++) {
+        uint16_t head;
+
+        avail_idx--;
+        head = le16_to_cpu(svq->vring.avail->ring[avail_idx %
+                                                  svq->vring.num]);
+        elem = svq->ring_id_maps[head];
+        if (!elem) {
+            break;
+        }
+        virtqueue_unpop(svq->vq, elem, 0);
+        svq->ring_id_maps[head] = NULL;
+        g_free(elem);
+    }
+
+    /*
+     * Only left if vhost_svq_drain() timed out or was not called.  These
+     * buffers are older than one the device used, and last_avail_idx
+     * cannot be rewound past that one: it would be made available twice.
+     * They go back to the guest as used without any data, which loses
+     * whatever they carried, e.g. transmitted packets.
+     */
+    n = 0;
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (i = 0; i < svq->vring.num; i++) {
+            elem = svq->ring_id_maps[i];
+            if (elem) {
+                virtqueue_fill(svq->vq, elem, 0, n++);
+                svq->ring_id_maps[i] = NULL;
+                g_free(elem);
+            }
+        }
+        if (n) {
+            virtqueue_flush(svq->vq, n);
+        }
+    }
+    if (n) {
+        warn_report("vhost shadow virtqueue: device %s did not use %u "
+                    "buffers of queue %d, returning them without data",
+                    svq->vdev->name, n, virtio_get_queue_index(svq->vq));
+        vhost_svq_notify_guest(svq);
+    }
+
+    g_free(svq->ring_id_maps);
+    svq->ring_id_maps = NULL;
+    qemu_vfree(svq->vring.desc);
+    qemu_vfree(svq->vring.used);
+    memset(&svq->vring, 0, sizeof(svq->vring));
+    svq->vdev = NULL;
+    svq->vq = NULL;
+}
+
+/**
+ * vhost_svq_new: create a shadow virtqueue
+ *
+ * @ops: callbacks for the buffers that go through the queue, or NULL
+ * @ops_opaque: opaque pointer passed to @ops
+ */
+VhostShadowVirtqueue *vhost_svq_new(const VhostShadowVirtqueueOps *ops,
+                                    void *ops_opaque)
+{
+    VhostShadowVirtqueue *svq = g_new0(VhostShadowVirtqueue, 1);
+    int r;
+
+    r = event_notifier_init(&svq->hdev_kick, 0);
+    if (r != 0) {
+        error_report("Couldn't create kick event notifier: %s",
+                     strerror(-r));
+        goto err_init_hdev_kick;
+    }
+
+    r = event_notifier_init(&svq->hdev_call, 0);
+    if (r != 0) {
+        error_report("Couldn't create call event notifier: %s",
+                     strerror(-r));
+        goto err_init_hdev_call;
+    }
+
+    event_notifier_init_fd(&svq->guest_kick, -1);
+    event_notifier_init_fd(&svq->guest_call, -1);
+    svq->ops = ops;
+    svq->ops_opaque = ops_opaque;
+    return svq;
+
+err_init_hdev_call:
+    event_notifier_cleanup(&svq->hdev_kick);
+
+err_init_hdev_kick:
+    g_free(svq);
+    return NULL;
+}
+
+void vhost_svq_free(VhostShadowVirtqueue *svq)
+{
+    if (!svq) {
+        return;
+    }
+
+    vhost_svq_stop(svq);
+    event_notifier_cleanup(&svq->hdev_kick);
+    event_notifier_cleanup(&svq->hdev_call);
+    g_free(svq);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * vhost shadow virtqueue
+ */
+
+#ifndef VHOST_SHADOW_VIRTQUEUE_H
+#define VHOST_SHADOW_VIRTQUEUE_H
+
+#include "hw/virtio/virtio.h"
+
+typedef struct VhostShadowVirtqueue VhostShadowVirtqueue;
+
+typedef struct VhostShadowVirtqueueOps {
+    /*
+     * Called for each buffer used by the device, before it is returned to
+     * the guest with @len bytes written
+     */
+    void (*used_handler)(VhostShadowVirtqueue *svq, VirtQueueElement *elem,
+                         uint32_t len, void *opaque);
+} VhostShadowVirtqueueOps;
+
+uint64_t vhost_svq_device_features(uint64_t features);
+
+void vhost_svq_set_guest_kick_fd(VhostShadowVirtqueue *svq, int kick_fd);
+void vhost_svq_set_guest_call_fd(VhostShadowVirtqueue *svq, int call_fd);
+int vhost_svq_get_device_kick_fd(const VhostShadowVirtqueue *svq);
+int vhost_svq_get_device_call_fd(const VhostShadowVirtqueue *svq);
+
+size_t vhost_svq_driver_area_size(uint16_t num);
+size_t vhost_svq_device_area_size(uint16_t num);
+void *vhost_svq_get_driver_area(const VhostShadowVirtqueue *svq);
+void *vhost_svq_get_device_area(const VhostShadowVirtqueue *svq);
+uint16_t vhost_svq_get_num(const VhostShadowVirtqueue *svq);
+
+void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
+                     VirtQueue *vq);
+void vhost_svq_drain(VhostShadowVirtqueue *svq);
+void vhost_svq_stop(VhostShadowVirtqueue *svq);
+ssize_t vhost_svq_send_sync(VhostShadowVirtqueue *svq,
+                            hwaddr out_addr, size_t out_len,
+                            hwaddr in_addr, size_t in_len);
+
+VhostShadowVirtqueue *vhost_svq_new(const VhostShadowVirtqueueOps *ops,
+                                    void *ops_opaque);
+void vhost_svq_free(VhostShadowVirtqueue *svq);
+
+#endif
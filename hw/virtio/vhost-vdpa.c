@@ -18,6 +18,7 @@
 #include "hw/virtio/vhost-backend.h"
 #include "hw/virtio/virtio-net.h"
 #include "hw/virtio/vhost-vdpa.h"
+#include "vhost-shadow-virtqueue.h"
 #include "qemu/main-loop.h"
 #include "cpu.h"
 #include "trace.h"
@@ -86,6 +87,34 @@ static int vhost_vdpa_dma_unmap(struct vhost_vdpa *v, hwaddr iova,
     return ret;
 }
 
+/*
+ * The shadow vrings are mapped at the top of the device's IOVA range, in
+ * one fixed slot per virtqueue that fits the largest vring.  The slot below
+ * them holds buffers that QEMU sends itself, see vhost_vdpa_svq_send().
+ * Guest memory is mapped 1:1 below that.
+ */
+static hwaddr vhost_vdpa_svq_iova_slot_size(void)
+{
+    return vhost_svq_driver_area_size(VIRTQUEUE_MAX_SIZE) +
+           vhost_svq_device_area_size(VIRTQUEUE_MAX_SIZE);
+}
+
+static hwaddr vhost_vdpa_svq_iova(struct vhost_vdpa *v, int vq_index)
+{
+    return v->iova_range.last + 1 -
+           (vq_index + 1) * vhost_vdpa_svq_iova_slot_size();
+}
+
+static hwaddr vhost_vdpa_svq_buf_iova(struct vhost_vdpa *v)
+{
+    return vhost_vdpa_svq_iova(v, VIRTIO_QUEUE_MAX);
+}
+
+static hwaddr vhost_vdpa_svq_iova_floor(struct vhost_vdpa *v)
+{
+    return vhost_vdpa_svq_buf_iova(v);
+}
+
 static void vhost_vdpa_listener_begin(MemoryListener *listener)
 {
     struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
@@ -167,6 +196,13 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (v->shadow_vqs_enabled &&
+        int128_gt(llend, int128_make64(vhost_vdpa_svq_iova_floor(v)))) {
+        error_report("vhost-vdpa: guest memory at 0x%" HWADDR_PRIx
+                     " overlaps the shadow virtqueues", iova);
+        goto fail;
+    }
+
     ret = vhost_vdpa_dma_map(v, iova, int128_get64(llsize),
                              vaddr, section->readonly);
     if (ret) {
@@ -258,6 +294,17 @@ static int vhost_vdpa_call(struct vhost_dev *dev, unsigned long int request,
     return ioctl(fd, request, arg);
 }
 
+/*
+ * All the net clients of a device share its file descriptor: requests
+ * that apply to the whole device are only sent by the first one.
+ */
+static bool vhost_vdpa_one_time_request(struct vhost_dev *dev)
+{
+    struct vhost_vdpa *v = dev->opaque;
+
+    return v->index != 0;
+}
+
 static void vhost_vdpa_add_status(struct vhost_dev *dev, uint8_t status)
 {
     uint8_t s;
@@ -287,6 +334,25 @@ static int vhost_vdpa_init(struct vhost_dev *dev, void *opaque)
     v->listener = vhost_vdpa_memory_listener;
     v->msg_type = VHOST_IOTLB_MSG_V2;
 
+    if (v->shadow_vqs_enabled) {
+        int i;
+
+        v->shadow_vqs = g_ptr_array_new_full(dev->nvqs,
+                                             (GDestroyNotify)vhost_svq_free);
+        for (i = 0; i < dev->nvqs; ++i) {
+            VhostShadowVirtqueue *svq;
+
+            svq = vhost_svq_new(v->shadow_vq_ops, v->shadow_vq_ops_opaque);
+
+            if (!svq) {
+                g_ptr_array_free(v->shadow_vqs, true);
+                v->shadow_vqs = NULL;
+                return -ENOMEM;
+            }
+            g_ptr_array_add(v->shadow_vqs, svq);
+        }
+    }
+
     vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                VIRTIO_CONFIG_S_DRIVER);
 
@@ -300,6 +366,10 @@ static int vhost_vdpa_cleanup(struct vhost_dev *dev)
     v = dev->opaque;
     trace_vhost_vdpa_cleanup(dev, v);
     memory_listener_unregister(&v->listener);
+    if (v->shadow_vqs) {
+        g_ptr_array_free(v->shadow_vqs, true);
+        v->shadow_vqs = NULL;
+    }
 
     dev->opaque = NULL;
     return 0;
@@ -336,10 +406,30 @@ static int vhost_vdpa_set_mem_table(struct vhost_dev *dev,
 static int vhost_vdpa_set_features(struct vhost_dev *dev,
                                    uint64_t features)
 {
+    struct vhost_vdpa *v = dev->opaque;
+    uint8_t status = 0;
     int ret;
+
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
+    if (v->shadow_vqs_enabled) {
+        /*
+         * Turning dirty logging on and off must not touch the device, the
+         * shadow virtqueues log the guest's pages themselves.  That is
+         * also the only change possible once the features are accepted.
+         */
+        vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
+        if (status & VIRTIO_CONFIG_S_FEATURES_OK) {
+            return 0;
+        }
+        features &= ~(1ULL << VHOST_F_LOG_ALL);
+        features = vhost_svq_device_features(features);
+    }
+
     trace_vhost_vdpa_set_features(dev, features);
     ret = vhost_vdpa_call(dev, VHOST_SET_FEATURES, &features);
-    uint8_t status = 0;
     if (ret) {
         return ret;
     }
@@ -394,18 +484,19 @@ static int vhost_vdpa_get_vq_index(struct vhost_dev *dev, int idx)
 {
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
 
-    trace_vhost_vdpa_get_vq_index(dev, idx, idx - dev->vq_index);
-    return idx - dev->vq_index;
+    /* The vrings of all the net clients are numbered device-wide */
+    trace_vhost_vdpa_get_vq_index(dev, idx, idx);
+    return idx;
 }
 
-static int vhost_vdpa_set_vring_ready(struct vhost_dev *dev)
+static int vhost_vdpa_set_vring_ready(struct vhost_dev *dev, bool ready)
 {
     int i;
-    trace_vhost_vdpa_set_vring_ready(dev);
+    trace_vhost_vdpa_set_vring_ready(dev, ready);
     for (i = 0; i < dev->nvqs; ++i) {
         struct vhost_vring_state state = {
             .index = dev->vq_index + i,
-            .num = 1,
+            .num = ready,
         };
         vhost_vdpa_call(dev, VHOST_VDPA_SET_VRING_ENABLE, &state);
     }
@@ -468,19 +559,227 @@ static int vhost_vdpa_get_config(struct vhost_dev *dev, uint8_t *config,
     return ret;
  }
 
+static int vhost_vdpa_svq_start(struct vhost_dev *dev, int i)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, i);
+    int vq_index = dev->vq_index + i;
+    hwaddr iova = vhost_vdpa_svq_iova(v, vq_index);
+    hwaddr driver_iova = iova;
+    hwaddr device_iova = iova +
+                         vhost_svq_driver_area_size(VIRTQUEUE_MAX_SIZE);
+    struct vhost_vring_state state = {
+        .index = vq_index,
+        .num = 0,
+    };
+    struct vhost_vring_addr addr = {
+        .index = vq_index,
+    };
+    struct vhost_vring_file file = {
+        .index = vq_index,
+    };
+    uint16_t num;
+    int r;
+
+    if (iova < v->iova_range.first) {
+        error_report("vhost-vdpa: no room for the shadow virtqueues in the "
+                     "device's IOVA range");
+        return -ENOMEM;
+    }
+
+    vhost_svq_start(svq, dev->vdev, virtio_get_queue(dev->vdev, vq_index));
+    num = vhost_svq_get_num(svq);
+    trace_vhost_vdpa_svq_start(dev, vq_index, iova, num);
+
+    r = vhost_vdpa_dma_map(v, driver_iova, vhost_svq_driver_area_size(num),
+                           vhost_svq_get_driver_area(svq), true);
+    if (r) {
+        goto err_map_driver;
+    }
+    r = vhost_vdpa_dma_map(v, device_iova, vhost_svq_device_area_size(num),
+                           vhost_svq_get_device_area(svq), false);
+    if (r) {
+        goto err_map_device;
+    }
+
+    addr.desc_user_addr = driver_iova;
+    addr.avail_user_addr = driver_iova + sizeof(struct vring_desc) * num;
+    addr.used_user_addr = device_iova;
+    r = vhost_vdpa_call(dev, VHOST_SET_VRING_ADDR, &addr);
+    if (r) {
+        goto err_set;
+    }
+    r = vhost_vdpa_call(dev, VHOST_SET_VRING_BASE, &state);
+    if (r) {
+        goto err_set;
+    }
+    file.fd = vhost_svq_get_device_kick_fd(svq);
+    r = vhost_vdpa_call(dev, VHOST_SET_VRING_KICK, &file);
+    if (r) {
+        goto err_set;
+    }
+    file.fd = vhost_svq_get_device_call_fd(svq);
+    r = vhost_vdpa_call(dev, VHOST_SET_VRING_CALL, &file);
+    if (r) {
+        goto err_set;
+    }
+
+    return 0;
+
+err_set:
+    vhost_vdpa_dma_unmap(v, device_iova, vhost_svq_device_area_size(num));
+err_map_device:
+    vhost_vdpa_dma_unmap(v, driver_iova, vhost_svq_driver_area_size(num));
+err_map_driver:
+    vhost_svq_stop(svq);
+    return r;
+}
+
+/**
+ * vhost_vdpa_svq_send: send a buffer of QEMU's own to the device
+ *
+ * @v: the vhost-vdpa backend, with its shadow virtqueues started
+ * @idx: index of the shadow virtqueue among the ones of @v
+ * @out: data for the device to read
+ * @out_len: length of @out
+ * @in: buffer for the device to write
+ * @in_len: length of @in
+ *
+ * Used to restore device state that the guest set through a virtqueue,
+ * e.g. the filters of a network device's control virtqueue, after the
+ * device was reset or on the destination of a migration.
+ *
+ * Returns: the number of bytes the device wrote to @in, or -errno.
+ */
+ssize_t vhost_vdpa_svq_send(struct vhost_vdpa *v, int idx,
+                            const void *out, size_t out_len,
+                            void *in, size_t in_len)
+{
+    VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, idx);
+    hwaddr iova = vhost_vdpa_svq_buf_iova(v);
+    size_t size = ROUND_UP(out_len + in_len, qemu_real_host_page_size);
+    uint8_t *buf;
+    ssize_t ret;
+
+    if (size > vhost_vdpa_svq_iova_slot_size()) {
+        return -E2BIG;
+    }
+    if (iova < v->iova_range.first) {
+        return -ENOMEM;
+    }
+
+    buf = qemu_memalign(qemu_real_host_page_size, size);
+    memcpy(buf, out, out_len);
+    memset(buf + out_len, 0, size - out_len);
+
+    ret = vhost_vdpa_dma_map(v, iova, size, buf, false);
+    if (ret) {
+        goto out;
+    }
+
+    ret = vhost_svq_send_sync(svq, iova, out_len, iova + out_len, in_len);
+    if (ret >= 0) {
+        memcpy(in, buf + out_len, ret);
+    }
+    vhost_vdpa_dma_unmap(v, iova, size);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static void vhost_vdpa_svq_stop(struct vhost_dev *dev, int i)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    VhostShadowVirtqueue *svq = g_ptr_array_index(v->shadow_vqs, i);
+    hwaddr iova = vhost_vdpa_svq_iova(v, dev->vq_index + i);
+    uint16_t num = vhost_svq_get_num(svq);
+
+    if (!num) {
+        return;
+    }
+
+    trace_vhost_vdpa_svq_stop(dev, dev->vq_index + i);
+    vhost_vdpa_dma_unmap(v, iova, vhost_svq_driver_area_size(num));
+    vhost_vdpa_dma_unmap(v, iova +
+                         vhost_svq_driver_area_size(VIRTQUEUE_MAX_SIZE),
+                         vhost_svq_device_area_size(num));
+    vhost_svq_stop(svq);
+}
+
+static int vhost_vdpa_svqs_start(struct vhost_dev *dev)
+{
+    int i, r;
+
+    for (i = 0; i < dev->nvqs; ++i) {
+        if (!virtio_queue_get_desc_addr(dev->vdev, dev->vq_index + i)) {
+            /* Not started by vhost_virtqueue_start() either */
+            continue;
+        }
+        r = vhost_vdpa_svq_start(dev, i);
+        if (r) {
+            while (--i >= 0) {
+                vhost_vdpa_svq_stop(dev, i);
+            }
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static void vhost_vdpa_svqs_stop(struct vhost_dev *dev)
+{
+    struct vhost_vdpa *v = dev->opaque;
+    int i;
+
+    /* Only the device can complete some of the buffers it holds */
+    for (i = 0; i < dev->nvqs; ++i) {
+        vhost_svq_drain(g_ptr_array_index(v->shadow_vqs, i));
+    }
+
+    /* Keep the device away from the shadow vrings before freeing them */
+    vhost_vdpa_set_vring_ready(dev, false);
+    for (i = 0; i < dev->nvqs; ++i) {
+        vhost_vdpa_svq_stop(dev, i);
+    }
+}
+
 static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
 {
     struct vhost_vdpa *v = dev->opaque;
     trace_vhost_vdpa_dev_start(dev, started);
     if (started) {
         uint8_t status = 0;
+        int r;
+
+        if (v->shadow_vqs_enabled) {
+            r = vhost_vdpa_svqs_start(dev);
+            if (r) {
+                return r;
+            }
+        }
+        vhost_vdpa_set_vring_ready(dev, true);
+
+        /* The device starts with the vrings of the last net client */
+        if (dev->vq_index + dev->nvqs != dev->vq_index_end) {
+            return 0;
+        }
+
         memory_listener_register(&v->listener, &address_space_memory);
-        vhost_vdpa_set_vring_ready(dev);
         vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
         vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
 
         return !(status & VIRTIO_CONFIG_S_DRIVER_OK);
     } else {
+        if (v->shadow_vqs_enabled) {
+            vhost_vdpa_svqs_stop(dev);
+        }
+
+        if (dev->vq_index + dev->nvqs != dev->vq_index_end) {
+            return 0;
+        }
+
         vhost_vdpa_reset_device(dev);
         vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                    VIRTIO_CONFIG_S_DRIVER);
@@ -493,6 +792,13 @@ static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
 static int vhost_vdpa_set_log_base(struct vhost_dev *dev, uint64_t base,
                                      struct vhost_log *log)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_enabled) {
+        /* Dirty pages are logged by the shadow virtqueues */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_log_base(dev, base, log->size, log->refcnt, log->fd,
                                   log->log);
     return vhost_vdpa_call(dev, VHOST_SET_LOG_BASE, &base);
@@ -501,6 +807,13 @@ static int vhost_vdpa_set_log_base(struct vhost_dev *dev, uint64_t base,
 static int vhost_vdpa_set_vring_addr(struct vhost_dev *dev,
                                        struct vhost_vring_addr *addr)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_enabled) {
+        /* The device gets the shadow vring, see vhost_vdpa_svq_start() */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_vring_addr(dev, addr->index, addr->flags,
                                     addr->desc_user_addr, addr->used_user_addr,
                                     addr->avail_user_addr,
@@ -518,6 +831,13 @@ static int vhost_vdpa_set_vring_num(struct vhost_dev *dev,
 static int vhost_vdpa_set_vring_base(struct vhost_dev *dev,
                                        struct vhost_vring_state *ring)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
+    if (v->shadow_vqs_enabled) {
+        /* The shadow vring always starts from 0 */
+        return 0;
+    }
+
     trace_vhost_vdpa_set_vring_base(dev, ring->index, ring->num);
     return vhost_vdpa_call(dev, VHOST_SET_VRING_BASE, ring);
 }
@@ -525,8 +845,16 @@ static int vhost_vdpa_set_vring_base(struct vhost_dev *dev,
 static int vhost_vdpa_get_vring_base(struct vhost_dev *dev,
                                        struct vhost_vring_state *ring)
 {
+    struct vhost_vdpa *v = dev->opaque;
     int ret;
 
+    if (v->shadow_vqs_enabled) {
+        /* vhost_svq_stop() left the guest virtqueue where to resume */
+        ring->num = virtio_queue_get_last_avail_idx(dev->vdev, ring->index);
+        trace_vhost_vdpa_get_vring_base(dev, ring->index, ring->num);
+        return 0;
+    }
+
     ret = vhost_vdpa_call(dev, VHOST_GET_VRING_BASE, ring);
     trace_vhost_vdpa_get_vring_base(dev, ring->index, ring->num);
     return ret;
@@ -535,29 +863,58 @@ static int vhost_vdpa_get_vring_base(struct vhost_dev *dev,
 static int vhost_vdpa_set_vring_kick(struct vhost_dev *dev,
                                        struct vhost_vring_file *file)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
     trace_vhost_vdpa_set_vring_kick(dev, file->index, file->fd);
+    if (v->shadow_vqs_enabled) {
+        int vq_index = file->index - dev->vq_index;
+
+        vhost_svq_set_guest_kick_fd(g_ptr_array_index(v->shadow_vqs,
+                                                      vq_index), file->fd);
+        return 0;
+    }
+
     return vhost_vdpa_call(dev, VHOST_SET_VRING_KICK, file);
 }
 
 static int vhost_vdpa_set_vring_call(struct vhost_dev *dev,
                                        struct vhost_vring_file *file)
 {
+    struct vhost_vdpa *v = dev->opaque;
+
     trace_vhost_vdpa_set_vring_call(dev, file->index, file->fd);
+    if (v->shadow_vqs_enabled) {
+        int vq_index = file->index - dev->vq_index;
+
+        vhost_svq_set_guest_call_fd(g_ptr_array_index(v->shadow_vqs,
+                                                      vq_index), file->fd);
+        return 0;
+    }
+
     return vhost_vdpa_call(dev, VHOST_SET_VRING_CALL, file);
 }
 
 static int vhost_vdpa_get_features(struct vhost_dev *dev,
                                      uint64_t *features)
 {
+    struct vhost_vdpa *v = dev->opaque;
     int ret;
 
     ret = vhost_vdpa_call(dev, VHOST_GET_FEATURES, features);
+    if (!ret && v->shadow_vqs_enabled) {
+        /* The shadow virtqueues track the pages the device writes to */
+        *features |= 1ULL << VHOST_F_LOG_ALL;
+    }
     trace_vhost_vdpa_get_features(dev, *features);
     return ret;
 }
 
 static int vhost_vdpa_set_owner(struct vhost_dev *dev)
 {
+    if (vhost_vdpa_one_time_request(dev)) {
+        return 0;
+    }
+
     trace_vhost_vdpa_set_owner(dev);
     return vhost_vdpa_call(dev, VHOST_SET_OWNER, NULL);
 }
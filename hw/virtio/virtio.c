@@ -20,6 +20,8 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qapi/visitor.h"
 #include "hw/virtio/virtio.h"
 #include "migration/qemu-file-types.h"
 #include "qemu/atomic.h"
@@ -132,6 +134,13 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Interrupt coalescing state, see virtio_notify_coalesce() */
+    QEMUTimer *notify_timer;
+    uint32_t notify_pending;
+    uint32_t notify_delay_us;
+    uint32_t notify_window_frames;
+    int64_t notify_window_start;
 };
 
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
@@ -531,12 +540,11 @@ static void vring_packed_desc_read(VirtIODevice *vdev,
         smp_rmb();
     }
 
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
-                              &desc->addr, sizeof(desc->addr));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
-                              &desc->id, sizeof(desc->id));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
-                              &desc->len, sizeof(desc->len));
+    /* addr, len and id precede flags, fetch them with a single access */
+    QEMU_BUILD_BUG_ON(offsetof(VRingPackedDesc, flags) !=
+                      sizeof(VRingPackedDesc) - sizeof(desc->flags));
+    address_space_read_cached(cache, off, desc,
+                              offsetof(VRingPackedDesc, flags));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap16s(vdev, &desc->id);
     virtio_tswap32s(vdev, &desc->len);
@@ -547,17 +555,17 @@ static void vring_packed_desc_write_data(VirtIODevice *vdev,
                                          MemoryRegionCache *cache,
                                          int i)
 {
-    hwaddr off_id = i * sizeof(VRingPackedDesc) +
-                    offsetof(VRingPackedDesc, id);
-    hwaddr off_len = i * sizeof(VRingPackedDesc) +
-                    offsetof(VRingPackedDesc, len);
+    /* len and id are adjacent, write and invalidate them together */
+    hwaddr off = i * sizeof(VRingPackedDesc) + offsetof(VRingPackedDesc, len);
+    hwaddr size = offsetof(VRingPackedDesc, flags) -
+                  offsetof(VRingPackedDesc, len);
 
+    QEMU_BUILD_BUG_ON(offsetof(VRingPackedDesc, id) !=
+                      offsetof(VRingPackedDesc, len) + sizeof(desc->len));
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->id);
-    address_space_write_cached(cache, off_id, &desc->id, sizeof(desc->id));
-    address_space_cache_invalidate(cache, off_id, sizeof(desc->id));
-    address_space_write_cached(cache, off_len, &desc->len, sizeof(desc->len));
-    address_space_cache_invalidate(cache, off_len, sizeof(desc->len));
+    address_space_write_cached(cache, off, &desc->len, size);
+    address_space_cache_invalidate(cache, off, size);
 }
 
 static void vring_packed_desc_write_flags(VirtIODevice *vdev,
@@ -695,22 +703,6 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                          elem->out_sg[i].iov_len);
 }
 
-/* virtqueue_detach_element:
- * @vq: The #VirtQueue
- * @elem: The #VirtQueueElement
- * @len: number of bytes written
- *
- * Detach the element from the virtqueue.  This function is suitable for device
- * reset or other situations where a #VirtQueueElement is simply freed and will
- * not be pushed or discarded.
- */
-void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
-                              unsigned int len)
-{
-    vq->inuse -= elem->ndescs;
-    virtqueue_unmap_sg(vq, elem, len);
-}
-
 static void virtqueue_split_rewind(VirtQueue *vq, unsigned int num)
 {
     vq->last_avail_idx -= num;
@@ -744,7 +736,9 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
         virtqueue_split_rewind(vq, 1);
     }
 
-    virtqueue_detach_element(vq, elem, len);
+    /* With VIRTIO_F_IN_ORDER, the slot is tracked again when refetched */
+    vq->inuse -= elem->ndescs;
+    virtqueue_unmap_sg(vq, elem, len);
 }
 
 /* virtqueue_rewind:
@@ -836,6 +830,51 @@ static void virtqueue_packed_fill_desc(VirtQueue *vq,
     vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head, strict_order);
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER, vq->used_elems is indexed by ring position:
+ * every popped buffer is recorded at the position it was made available
+ * in, and buffers are only returned to the driver once all the buffers
+ * before them have been filled.  Devices can still complete requests
+ * out of order.
+ *
+ * A buffer that is detached instead of filled is returned to the driver
+ * with no data written, see virtqueue_detach_element().
+ */
+static void virtqueue_ordered_track(VirtQueue *vq, unsigned int pos,
+                                    const VirtQueueElement *elem)
+{
+    vq->used_elems[pos].index = elem->index;
+    vq->used_elems[pos].ndescs = elem->ndescs;
+    vq->used_elems[pos].len = 0;
+    vq->used_elems[pos].in_order_filled = false;
+}
+
+static void virtqueue_ordered_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                   unsigned int len)
+{
+    unsigned int i = vq->used_idx % vq->vring.num;
+    unsigned int ndescs = 0;
+
+    while (ndescs < vq->inuse) {
+        VirtQueueElement *used = &vq->used_elems[i];
+
+        if (used->index == elem->index && !used->in_order_filled) {
+            used->len = len;
+            used->in_order_filled = true;
+            return;
+        }
+
+        ndescs += used->ndescs;
+        i += used->ndescs;
+        if (i >= vq->vring.num) {
+            i -= vq->vring.num;
+        }
+    }
+
+    virtio_error(vq->vdev, "Buffer %u was not popped from the virtqueue",
+                 elem->index);
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
@@ -848,7 +887,9 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_fill(vq, elem, len);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_fill(vq, elem, len, idx);
     } else {
         virtqueue_split_fill(vq, elem, len, idx);
@@ -898,6 +939,85 @@ static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
     }
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_ordered_flush(VirtQueue *vq)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int head = vq->used_idx % vq->vring.num;
+    unsigned int i = head, ndescs = 0, count = 0;
+    VRingUsedElem uelem;
+
+    if (unlikely(packed ? !vq->vring.desc : !vq->vring.used)) {
+        return;
+    }
+
+    while (ndescs < vq->inuse && vq->used_elems[i].in_order_filled) {
+        VirtQueueElement *used = &vq->used_elems[i];
+
+        if (!packed) {
+            uelem.id = used->index;
+            uelem.len = used->len;
+            vring_used_write(vq, &uelem, i);
+        } else if (ndescs) {
+            /* The first descriptor is made available last, see below */
+            virtqueue_packed_fill_desc(vq, used, ndescs, false);
+        }
+
+        used->in_order_filled = false;
+        ndescs += used->ndescs;
+        count++;
+        i += used->ndescs;
+        if (i >= vq->vring.num) {
+            i -= vq->vring.num;
+        }
+    }
+
+    if (!count) {
+        return;
+    }
+
+    if (packed) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[head], 0, true);
+        vq->inuse -= ndescs;
+        vq->used_idx += ndescs;
+        if (vq->used_idx >= vq->vring.num) {
+            vq->used_idx -= vq->vring.num;
+            vq->used_wrap_counter ^= 1;
+        }
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
+/* virtqueue_detach_element:
+ * @vq: The #VirtQueue
+ * @elem: The #VirtQueueElement
+ * @len: number of bytes written
+ *
+ * Detach the element from the virtqueue.  This function is suitable for device
+ * reset or other situations where a #VirtQueueElement is simply freed and will
+ * not be pushed or discarded.
+ *
+ * With VIRTIO_F_IN_ORDER, the buffers made available after the element could
+ * not be used anymore, so unless the device is being reset or is broken, the
+ * element is returned to the driver with no data written instead.
+ */
+void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
+                              unsigned int len)
+{
+    virtqueue_unmap_sg(vq, elem, len);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER) &&
+        vq->vdev->status && !virtio_device_disabled(vq->vdev)) {
+        RCU_READ_LOCK_GUARD();
+        virtqueue_ordered_fill(vq, elem, 0);
+        virtqueue_ordered_flush(vq);
+        return;
+    }
+
+    vq->inuse -= elem->ndescs;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -905,7 +1025,9 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_flush(vq);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_flush(vq, count);
     } else {
         virtqueue_split_flush(vq, count);
@@ -920,6 +1042,26 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * Return @count elements to the driver with a single update of the used
+ * index.  @len may be NULL if no data was written to any of the elements.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *len, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], len ? len[i] : 0, i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1411,7 +1553,8 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz,
+                                 bool set_avail_event)
 {
     unsigned int i, head, max;
     VRingMemoryRegionCaches *caches;
@@ -1448,7 +1591,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (set_avail_event &&
+        virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
@@ -1535,6 +1679,10 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_track(vq, (uint16_t)(vq->last_avail_idx - 1) %
+                                    vq->vring.num, elem);
+    }
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
@@ -1661,6 +1809,9 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     elem->index = id;
     elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_ordered_track(vq, vq->last_avail_idx, elem);
+    }
     vq->last_avail_idx += elem->ndescs;
     vq->inuse += elem->ndescs;
 
@@ -1692,10 +1843,46 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         return virtqueue_packed_pop(vq, sz);
     } else {
-        return virtqueue_split_pop(vq, sz);
+        return virtqueue_split_pop(vq, sz, true);
     }
 }
 
+/*
+ * Pop up to @max elements of size @sz into @elems.  This is equivalent
+ * to calling virtqueue_pop() repeatedly, but for a split ring the avail
+ * event is only published once for the whole batch.
+ *
+ * Returns the number of elements popped.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+    unsigned int n = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    while (n < max) {
+        void *elem = packed ? virtqueue_packed_pop(vq, sz)
+                            : virtqueue_split_pop(vq, sz, false);
+        if (!elem) {
+            break;
+        }
+        elems[n++] = elem;
+    }
+
+    if (n && !packed &&
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    trace_virtqueue_pop_batch(vq, n, max);
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1731,6 +1918,10 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
                                                vq->vring.num, &idx, false)) {
             ++elem.ndescs;
         }
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_ordered_track(vq, vq->last_avail_idx, &elem);
+        }
+        vq->inuse += elem.ndescs;
         /*
          * immediately push the element, nothing to unmap
          * as both in_num and out_num are set to 0.
@@ -1750,9 +1941,10 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
 {
     unsigned int dropped = 0;
-    VirtQueueElement elem = {};
+    VirtQueueElement elem = { .ndescs = 1 };
     VirtIODevice *vdev = vq->vdev;
     bool fEventIdx = virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+    bool in_order = virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER);
 
     while (!virtio_queue_empty(vq) && vq->inuse < vq->vring.num) {
         /* works similar to virtqueue_pop but does not map buffers
@@ -1761,6 +1953,10 @@ static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
         if (!virtqueue_get_head(vq, vq->last_avail_idx, &elem.index)) {
             break;
         }
+        if (in_order) {
+            virtqueue_ordered_track(vq, vq->last_avail_idx % vq->vring.num,
+                                    &elem);
+        }
         vq->inuse++;
         vq->last_avail_idx++;
         if (fEventIdx) {
@@ -1982,6 +2178,15 @@ static enum virtio_device_endian virtio_current_cpu_endian(void)
     }
 }
 
+/* Drop the notification held back by virtio_notify_coalesce() */
+static void virtio_notify_coalesce_cancel(VirtQueue *vq)
+{
+    if (vq->notify_timer) {
+        timer_del(vq->notify_timer);
+    }
+    vq->notify_pending = 0;
+}
+
 void virtio_reset(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -2028,6 +2233,11 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        virtio_notify_coalesce_cancel(&vdev->vq[i]);
+        if (vdev->vq[i].used_elems) {
+            memset(vdev->vq[i].used_elems, 0, sizeof(VirtQueueElement) *
+                   vdev->vq[i].vring.num_default);
+        }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
@@ -2426,6 +2636,9 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_aio_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    timer_free(vq->notify_timer);
+    vq->notify_timer = NULL;
+    vq->notify_pending = 0;
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2516,7 +2729,7 @@ static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
         return virtio_packed_should_notify(vdev, vq);
@@ -2560,7 +2773,7 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2572,6 +2785,113 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_irq(vq);
 }
 
+/* Length of the window over which the adaptive mode measures the rate */
+#define VIRTIO_NOTIFY_COALESCE_WINDOW_US 1000
+/* Completions per window that get the full delay in adaptive mode */
+#define VIRTIO_NOTIFY_COALESCE_BUSY_FRAMES 32
+/* Upper limit for notify-coalesce-usecs */
+#define VIRTIO_NOTIFY_COALESCE_MAX_USECS 1000000
+
+static void virtio_notify_coalesce_cb(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    vq->notify_pending = 0;
+    virtio_notify_now(vq->vdev, vq);
+}
+
+/*
+ * Send the notifications that are being held back, e.g. because the VM
+ * stops or the coalescing parameters change.
+ */
+static void virtio_notify_coalesce_flush(VirtIODevice *vdev)
+{
+    int i;
+
+    if (!vdev->vq) {
+        return;
+    }
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+
+        if (vq->vring.num == 0) {
+            break;
+        }
+        if (vq->notify_pending) {
+            virtio_notify_coalesce_cancel(vq);
+            virtio_notify_now(vdev, vq);
+        }
+        vq->notify_delay_us = 0;
+        vq->notify_window_frames = 0;
+    }
+}
+
+/*
+ * Adaptive mode: scale the delay with the number of completions seen in
+ * the last window, so that a mostly idle queue is notified immediately
+ * and only a busy one waits for the full notify-coalesce-usecs.
+ */
+static uint32_t virtio_notify_coalesce_adapt(VirtIODevice *vdev,
+                                             VirtQueue *vq, int64_t now)
+{
+    uint32_t busy = vdev->notify_coalesce_frames ?:
+                    VIRTIO_NOTIFY_COALESCE_BUSY_FRAMES;
+
+    vq->notify_window_frames++;
+    if (now - vq->notify_window_start >= VIRTIO_NOTIFY_COALESCE_WINDOW_US) {
+        vq->notify_delay_us = (uint64_t)vdev->notify_coalesce_usecs *
+                              MIN(vq->notify_window_frames - 1, busy) / busy;
+        vq->notify_window_start = now;
+        vq->notify_window_frames = 0;
+    }
+    return vq->notify_delay_us;
+}
+
+/*
+ * Hold back the notification until notify-coalesce-frames completions
+ * have accumulated, or notify-coalesce-usecs have passed since the
+ * first of them.  Whether the driver wants to be notified at all is
+ * only checked when the notification is eventually sent, so that
+ * VIRTIO_RING_F_EVENT_IDX sees all the buffers used in the meantime.
+ *
+ * Returns true if the notification was deferred.
+ */
+static bool virtio_notify_coalesce(VirtIODevice *vdev, VirtQueue *vq)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    uint32_t delay = vdev->notify_coalesce_usecs;
+
+    if (vdev->notify_coalesce_adaptive) {
+        delay = virtio_notify_coalesce_adapt(vdev, vq, now);
+    }
+
+    if (!delay || (vdev->notify_coalesce_frames &&
+                   vq->notify_pending + 1 >= vdev->notify_coalesce_frames)) {
+        virtio_notify_coalesce_cancel(vq);
+        return false;
+    }
+
+    if (!vq->notify_pending++) {
+        if (!vq->notify_timer) {
+            vq->notify_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                            virtio_notify_coalesce_cb, vq);
+        }
+        timer_mod(vq->notify_timer, now + delay);
+    }
+    trace_virtio_notify_coalesce(vdev, vq, vq->notify_pending, delay);
+    return true;
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (vdev->notify_coalesce_usecs && virtio_notify_coalesce(vdev, vq)) {
+        return;
+    }
+
+    virtio_notify_now(vdev, vq);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -2659,6 +2979,35 @@ static bool virtio_disabled_needed(void *opaque)
     return vdev->disabled;
 }
 
+static bool virtqueue_has_in_order_filled(VirtQueue *vq)
+{
+    unsigned int i;
+
+    for (i = 0; i < vq->vring.num; i++) {
+        if (vq->used_elems[i].in_order_filled) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool virtio_in_order_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+    int i;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        return false;
+    }
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        if (virtqueue_has_in_order_filled(&vdev->vq[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static const VMStateDescription vmstate_virtqueue = {
     .name = "virtqueue_state",
     .version_id = 1,
@@ -2780,6 +3129,101 @@ static const VMStateDescription vmstate_virtio_extra_state = {
     }
 };
 
+/*
+ * With VIRTIO_F_IN_ORDER, buffers that the device has filled but that wait
+ * for an earlier buffer before they are returned to the driver are only
+ * recorded in vq->used_elems.  The device has completed them, so nothing
+ * would fill them again on the destination.
+ *
+ * For each virtqueue, the stream holds the number of such buffers, then
+ * the ring position and used length of each.  virtqueue_ordered_restore()
+ * keeps them when it rebuilds the rest of the bookkeeping.
+ */
+static int get_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        uint16_t count = qemu_get_be16(f);
+
+        if (count > vq->vring.num) {
+            error_report("VQ %d: %u filled buffers exceed ring size 0x%x",
+                         i, count, vq->vring.num);
+            return -EINVAL;
+        }
+
+        while (count--) {
+            uint16_t pos = qemu_get_be16(f);
+            uint32_t len = qemu_get_be32(f);
+
+            if (pos >= vq->vring.num) {
+                error_report("VQ %d: filled buffer position 0x%x exceeds "
+                             "ring size 0x%x", i, pos, vq->vring.num);
+                return -EINVAL;
+            }
+            vq->used_elems[pos].in_order_filled = true;
+            vq->used_elems[pos].len = len;
+        }
+    }
+
+    return 0;
+}
+
+static int put_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field, JSONWriter *vmdesc)
+{
+    VirtIODevice *vdev = pv;
+    unsigned int pos;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        uint16_t count = 0;
+
+        for (pos = 0; pos < vq->vring.num; pos++) {
+            count += vq->used_elems[pos].in_order_filled;
+        }
+
+        qemu_put_be16(f, count);
+        for (pos = 0; pos < vq->vring.num; pos++) {
+            if (vq->used_elems[pos].in_order_filled) {
+                qemu_put_be16(f, pos);
+                qemu_put_be32(f, vq->used_elems[pos].len);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_in_order_state = {
+    .name = "virtqueue_in_order_state",
+    .get = get_in_order_state,
+    .put = put_in_order_state,
+};
+
+static const VMStateDescription vmstate_virtio_in_order = {
+    .name = "virtio/in_order",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_in_order_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "in_order_state",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_in_order_state,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_device_endian = {
     .name = "virtio/device_endian",
     .version_id = 1,
@@ -2853,6 +3297,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_started,
         &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_disabled,
+        &vmstate_virtio_in_order,
         NULL
     }
 };
@@ -2997,6 +3442,59 @@ size_t virtio_feature_get_config_size(VirtIOFeature *feature_sizes,
     return config_size;
 }
 
+/*
+ * Rebuild the VIRTIO_F_IN_ORDER bookkeeping for the buffers that were in
+ * flight on the source.  They are still described by the available ring,
+ * starting at the used index.  Buffers that the source had already filled
+ * were marked by the virtio/in_order subsection and stay filled.
+ *
+ * Called within rcu_read_lock().
+ */
+static void virtqueue_ordered_restore(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+    VirtQueueElement elem = {};
+    unsigned int pos = vq->used_idx % vq->vring.num;
+    unsigned int ndescs = 0;
+
+    if (!caches) {
+        return;
+    }
+
+    while (ndescs < vq->inuse) {
+        unsigned int len;
+        bool filled;
+
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            VRingPackedDesc desc;
+            unsigned int i = pos;
+
+            vring_packed_desc_read(vq->vdev, &desc, &caches->desc, i, false);
+            elem.index = desc.id;
+            elem.ndescs = 1;
+            while (virtqueue_packed_read_next_desc(vq, &desc, &caches->desc,
+                                                   vq->vring.num, &i, false)) {
+                elem.ndescs++;
+            }
+        } else {
+            elem.index = vring_avail_ring(vq, pos);
+            elem.ndescs = 1;
+        }
+
+        filled = vq->used_elems[pos].in_order_filled;
+        len = vq->used_elems[pos].len;
+        virtqueue_ordered_track(vq, pos, &elem);
+        vq->used_elems[pos].in_order_filled = filled;
+        vq->used_elems[pos].len = len;
+
+        ndescs += elem.ndescs;
+        pos += elem.ndescs;
+        if (pos >= vq->vring.num) {
+            pos -= vq->vring.num;
+        }
+    }
+}
+
 int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 {
     int i, ret;
@@ -3155,6 +3653,9 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
                 vdev->vq[i].shadow_avail_wrap_counter =
                                         vdev->vq[i].last_avail_wrap_counter;
+                if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+                    virtqueue_ordered_restore(&vdev->vq[i]);
+                }
                 continue;
             }
 
@@ -3190,6 +3691,9 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              vdev->vq[i].used_idx);
                 return -1;
             }
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+                virtqueue_ordered_restore(&vdev->vq[i]);
+            }
         }
     }
 
@@ -3227,6 +3731,11 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    if (!running) {
+        /* Deferred notifications must not be lost across migration */
+        virtio_notify_coalesce_flush(vdev);
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -3238,6 +3747,12 @@ void virtio_instance_init_common(Object *proxy_obj, void *data,
                                        vdev_size, vdev_name, &error_abort,
                                        NULL);
     qdev_alias_all_properties(vdev, proxy_obj);
+    object_property_add_alias(proxy_obj, "notify-coalesce-frames",
+                              OBJECT(vdev), "notify-coalesce-frames");
+    object_property_add_alias(proxy_obj, "notify-coalesce-usecs",
+                              OBJECT(vdev), "notify-coalesce-usecs");
+    object_property_add_alias(proxy_obj, "notify-coalesce-adaptive",
+                              OBJECT(vdev), "notify-coalesce-adaptive");
 }
 
 void virtio_init(VirtIODevice *vdev, const char *name,
@@ -3702,6 +4217,7 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        timer_free(vdev->vq[i].notify_timer);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -3830,6 +4346,74 @@ void virtio_device_release_ioeventfd(VirtIODevice *vdev)
     virtio_bus_release_ioeventfd(vbus);
 }
 
+static void virtio_get_notify_coalesce_frames(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+
+    visit_type_uint32(v, name, &vdev->notify_coalesce_frames, errp);
+}
+
+static void virtio_set_notify_coalesce_frames(Object *obj, Visitor *v,
+                                              const char *name, void *opaque,
+                                              Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    vdev->notify_coalesce_frames = value;
+    virtio_notify_coalesce_flush(vdev);
+}
+
+static void virtio_get_notify_coalesce_usecs(Object *obj, Visitor *v,
+                                             const char *name, void *opaque,
+                                             Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+
+    visit_type_uint32(v, name, &vdev->notify_coalesce_usecs, errp);
+}
+
+static void virtio_set_notify_coalesce_usecs(Object *obj, Visitor *v,
+                                             const char *name, void *opaque,
+                                             Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value > VIRTIO_NOTIFY_COALESCE_MAX_USECS) {
+        error_setg(errp, "Property '%s' must be at most %u", name,
+                   VIRTIO_NOTIFY_COALESCE_MAX_USECS);
+        return;
+    }
+
+    vdev->notify_coalesce_usecs = value;
+    virtio_notify_coalesce_flush(vdev);
+}
+
+static bool virtio_get_notify_coalesce_adaptive(Object *obj, Error **errp)
+{
+    return VIRTIO_DEVICE(obj)->notify_coalesce_adaptive;
+}
+
+static void virtio_set_notify_coalesce_adaptive(Object *obj, bool value,
+                                                Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+
+    vdev->notify_coalesce_adaptive = value;
+    virtio_notify_coalesce_flush(vdev);
+}
+
 static void virtio_device_class_init(ObjectClass *klass, void *data)
 {
     /* Set the default value here. */
@@ -3844,6 +4428,30 @@ static void virtio_device_class_init(ObjectClass *klass, void *data)
     vdc->stop_ioeventfd = virtio_device_stop_ioeventfd_impl;
 
     vdc->legacy_features |= VIRTIO_LEGACY_FEATURES;
+
+    /*
+     * Not qdev properties, because they can be changed with qom-set
+     * while the device is running.
+     */
+    object_class_property_add(klass, "notify-coalesce-frames", "uint32",
+                              virtio_get_notify_coalesce_frames,
+                              virtio_set_notify_coalesce_frames,
+                              NULL, NULL);
+    object_class_property_set_description(klass, "notify-coalesce-frames",
+        "Send a held back interrupt after this many completions, 0 for no "
+        "limit");
+    object_class_property_add(klass, "notify-coalesce-usecs", "uint32",
+                              virtio_get_notify_coalesce_usecs,
+                              virtio_set_notify_coalesce_usecs,
+                              NULL, NULL);
+    object_class_property_set_description(klass, "notify-coalesce-usecs",
+        "Maximum time in microseconds an interrupt is held back, 0 disables "
+        "interrupt coalescing");
+    object_class_property_add_bool(klass, "notify-coalesce-adaptive",
+                                   virtio_get_notify_coalesce_adaptive,
+                                   virtio_set_notify_coalesce_adaptive);
+    object_class_property_set_description(klass, "notify-coalesce-adaptive",
+        "Scale the interrupt delay with the completion rate");
 }
 
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev)
@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/stats64.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -232,6 +233,21 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /*
+     * Adaptive polling parameters, see aio_context_set_poll_adaptive().
+     * Only accessed by the event loop thread, except for the parameters
+     * themselves which may be changed at any time.
+     */
+    bool poll_adaptive;
+    int64_t poll_cpu_budget;    /* max % of wall time spent polling */
+    int64_t poll_budget_start;  /* start of the current budget period */
+    int64_t poll_budget_used;   /* ns spent polling in the budget period */
+
+    /* Polling statistics, may be read from any thread */
+    Stat64 poll_hits;           /* polling found an event */
+    Stat64 poll_misses;         /* polling timed out without an event */
+    Stat64 poll_wasted_ns;      /* time spent in polling misses */
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -727,4 +743,39 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_poll_adaptive:
+ * @ctx: the aio context
+ * @adaptive: choose the polling time per handler from observed event timing
+ * @cpu_budget: maximum percentage of wall-clock time to spend busy polling,
+ *              0 means no limit
+ *
+ * In adaptive mode the grow/shrink factors are ignored.  Instead, the time
+ * until each polled handler becomes ready is recorded in a histogram, and
+ * each handler is polled for the window that best trades busy polling time
+ * against the cost of a blocking wait and wakeup.  The context polls for
+ * the longest of the handlers' windows, bounded by poll_max_ns.
+ *
+ * The CPU budget applies in both modes: once the context has polled for
+ * @cpu_budget percent of a 100 ms period, polling is suspended until the
+ * next period.
+ */
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   int64_t cpu_budget, Error **errp);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t wasted_ns;
+} AioPollStats;
+
+/**
+ * aio_context_get_poll_stats:
+ * @ctx: the aio context
+ * @stats: filled in with the polling statistics of @ctx
+ *
+ * May be called from any thread.
+ */
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats);
+
 #endif
@@ -70,6 +70,8 @@ enum BdrvTrackedRequestType {
     BDRV_TRACKED_TRUNCATE,
 };
 
+typedef struct BdrvBlockStatusCache BdrvBlockStatusCache;
+
 /*
  * That is not quite good that BdrvTrackedRequest structure is public,
  * as block/io.c is very careful about incoming offset/bytes being
@@ -429,6 +431,22 @@ struct BlockDriver {
         uint64_t offset, uint64_t bytes, QEMUIOVector *qiov,
         size_t qiov_offset);
 
+    /*
+     * Compress a single cluster of guest data, to be written at @offset
+     * later with bdrv_co_pwrite_precompressed().  Compressing is separate
+     * from writing so that callers that must keep writes in order can
+     * still compress in parallel.
+     *
+     * Returns the size of the compressed data stored in @dest, or
+     * -ENOSPC if the data does not compress into @dest_size bytes; it
+     * should then be written with a normal write.
+     */
+    int coroutine_fn (*bdrv_co_compress)(BlockDriverState *bs,
+        uint64_t offset, uint64_t bytes, const void *buf,
+        void *dest, size_t dest_size);
+    int coroutine_fn (*bdrv_co_pwrite_precompressed)(BlockDriverState *bs,
+        uint64_t offset, uint64_t bytes, const void *buf, size_t buf_size);
+
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
     int (*bdrv_snapshot_goto)(BlockDriverState *bs,
@@ -448,6 +466,14 @@ struct BlockDriver {
                                                  Error **errp);
     BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
+    /*
+     * Returns a host file descriptor from which the guest-visible data of
+     * @bs can be read at unchanged offsets (e.g. with sendfile()), or
+     * -errno if there is no such file descriptor.  The descriptor remains
+     * owned by the driver and is only valid while @bs is not drained.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -1000,6 +1026,9 @@ struct BlockDriverState {
 
     unsigned int write_gen;               /* Current data generation */
 
+    /* Cached driver block status, see bdrv_co_block_status() */
+    BdrvBlockStatusCache *block_status_cache;
+
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
@@ -1052,6 +1081,10 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_compress(BdrvChild *child, int64_t offset,
+    int64_t bytes, const void *buf, void *dest, size_t dest_size);
+int coroutine_fn bdrv_co_pwrite_precompressed(BdrvChild *child,
+    int64_t offset, int64_t bytes, const void *buf, size_t buf_size);
 
 static inline int coroutine_fn bdrv_co_pread(BdrvChild *child,
     int64_t offset, unsigned int bytes, void *buf, BdrvRequestFlags flags)
@@ -1247,6 +1280,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @perf: Performance options, or %NULL for the defaults.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1263,7 +1297,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, const MirrorPerf *perf,
+                  Error **errp);
 
 /*
  * backup_job_create:
@@ -1364,6 +1399,11 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+void bdrv_bsc_invalidate_range(BlockDriverState *bs,
+                               int64_t offset, int64_t bytes);
+void bdrv_bsc_invalidate_all(BlockDriverState *bs);
+void bdrv_bsc_free(BlockDriverState *bs);
+
 void blockdev_close_all_bdrv_states(void);
 
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
@@ -64,6 +64,13 @@ void bdrv_dirty_bitmap_serialize_part(const BdrvDirtyBitmap *bitmap,
 void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
                                         uint8_t *buf, uint64_t offset,
                                         uint64_t bytes, bool finish);
+ssize_t bdrv_dirty_bitmap_serialize_runs(const BdrvDirtyBitmap *bitmap,
+                                         uint8_t *buf, size_t size,
+                                         uint64_t offset, uint64_t bytes);
+bool bdrv_dirty_bitmap_deserialize_runs(BdrvDirtyBitmap *bitmap,
+                                        const uint8_t *buf, size_t size,
+                                        uint64_t offset, uint64_t bytes,
+                                        bool finish);
 void bdrv_dirty_bitmap_deserialize_zeroes(BdrvDirtyBitmap *bitmap,
                                           uint64_t offset, uint64_t bytes,
                                           bool finish);
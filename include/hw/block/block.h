@@ -30,6 +30,8 @@ typedef struct BlockConf {
     uint32_t lcyls, lheads, lsecs;
     OnOffAuto wce;
     bool share_rw;
+    /* request merging, only devices that plug the BlockBackend use this */
+    bool merge_requests;
     BlockdevOnError rerror;
     BlockdevOnError werror;
 } BlockConf;
@@ -13,15 +13,28 @@
 #define HW_VIRTIO_VHOST_VDPA_H
 
 #include "hw/virtio/virtio.h"
+#include "hw/virtio/vhost-shadow-virtqueue.h"
+#include "standard-headers/linux/vhost_types.h"
 
 typedef struct vhost_vdpa {
     int device_fd;
+    /* index of the net client among the ones sharing device_fd */
+    int index;
     uint32_t msg_type;
     MemoryListener listener;
+    struct vhost_vdpa_iova_range iova_range;
+    /* intercept the vrings with a VhostShadowVirtqueue each */
+    bool shadow_vqs_enabled;
+    GPtrArray *shadow_vqs;
+    const VhostShadowVirtqueueOps *shadow_vq_ops;
+    void *shadow_vq_ops_opaque;
     struct vhost_dev *dev;
 } VhostVDPA;
 
 extern AddressSpace address_space_memory;
 extern int vhost_vdpa_get_device_id(struct vhost_dev *dev,
                                    uint32_t *device_id);
+ssize_t vhost_vdpa_svq_send(struct vhost_vdpa *v, int idx,
+                            const void *out, size_t out_len,
+                            void *in, size_t in_len);
 #endif
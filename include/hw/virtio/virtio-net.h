@@ -18,6 +18,7 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "net/checksum.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
 
@@ -125,6 +126,9 @@ typedef struct VirtioNetRscChain {
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 * KiB))
 
+#define MAC_TABLE_ENTRIES    64
+#define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
+
 #define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
 #define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
 
@@ -134,6 +138,8 @@ typedef struct VirtioNetRssData {
     bool    populate_hash;
     uint32_t hash_types;
     uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* Derived from @key by virtio_net_rss_update_key() */
+    NetToeplitzTable key_table;
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
@@ -193,6 +199,8 @@ struct VirtIONet {
     int multiqueue;
     uint16_t max_queues;
     uint16_t curr_queues;
+    /* peers, including a backend's control virtqueue */
+    uint16_t max_ncs;
     size_t config_size;
     char *netclient_name;
     char *netclient_type;
@@ -213,5 +221,8 @@ struct VirtIONet {
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
                                    const char *type);
+virtio_net_ctrl_ack virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
+                                               const struct iovec *out_sg,
+                                               unsigned int out_num);
 
 #endif
@@ -27,6 +27,7 @@ struct iovec;
 #define CSUM_ALL    (CSUM_IP | CSUM_TCP | CSUM_UDP)
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq);
+bool test_net_checksum_next_accel(void);
 uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
@@ -108,4 +109,48 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest RSS input: IPv6 source and destination address and ports */
+#define NET_TOEPLITZ_MAX_INPUT 36
+
+/*
+ * Precomputed Toeplitz hash for one key: the contribution of every
+ * value of every input nibble, so that hashing takes two table lookups
+ * per input byte instead of eight shift/xor steps.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t nibble[NET_TOEPLITZ_MAX_INPUT * 2][16];
+} NetToeplitzTable;
+
+/**
+ * net_toeplitz_table_init: precompute the Toeplitz hash for a key
+ *
+ * @table: table to fill
+ * @key: the hash key, must be at least NET_TOEPLITZ_MAX_INPUT + 4 bytes
+ */
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key);
+
+/**
+ * net_toeplitz_table_hash: compute the same hash as net_toeplitz_add()
+ *
+ * @table: table filled by net_toeplitz_table_init()
+ * @input: hash input
+ * @len: length of @input, at most NET_TOEPLITZ_MAX_INPUT
+ */
+static inline
+uint32_t net_toeplitz_table_hash(const NetToeplitzTable *table,
+                                 const uint8_t *input, uint32_t len)
+{
+    uint32_t result = 0;
+    uint32_t i;
+
+    assert(len <= NET_TOEPLITZ_MAX_INPUT);
+
+    for (i = 0; i < len; i++) {
+        result ^= table->nibble[2 * i][input[i] >> 4] ^
+                  table->nibble[2 * i + 1][input[i] & 0xf];
+    }
+
+    return result;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
@@ -225,6 +225,47 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               uint64_t start, uint64_t count,
                               bool finish);
 
+/**
+ * hbitmap_serialize_runs
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the encoded runs.
+ * @size: Size of @buf in bytes.
+ * @start: First bit to store.
+ * @count: Number of bits to store.
+ *
+ * Stores the runs of set bits in the given region as a sequence of pairs of
+ * unsigned LEB128 numbers: the number of clear granules since the end of the
+ * previous run (or @start), and the number of set granules in the run.
+ * Clear areas are skipped using the upper HBitmap levels, so sparse regions
+ * are encoded quickly and compactly.  @start and @count must be aligned as
+ * for hbitmap_serialize_part.
+ *
+ * Returns the number of bytes stored, or -1 if the encoding does not fit
+ * into @size bytes.
+ */
+ssize_t hbitmap_serialize_runs(const HBitmap *hb, uint8_t *buf, size_t size,
+                               uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_runs
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer with runs encoded by hbitmap_serialize_runs.
+ * @size: Size of @buf in bytes.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Restores HBitmap data corresponding to given region from its run encoding.
+ *
+ * Returns false if @buf is malformed or describes bits outside of the region.
+ * The content of the region is undefined then.
+ *
+ * If @finish is false, caller must call hbitmap_serialize_finish before using
+ * the bitmap.
+ */
+bool hbitmap_deserialize_runs(HBitmap *hb, const uint8_t *buf, size_t size,
+                              uint64_t start, uint64_t count, bool finish);
+
 /**
  * hbitmap_deserialize_zeroes
  * @hb: HBitmap to operate on.
@@ -107,6 +107,7 @@ void blk_get_perm(BlockBackend *blk, uint64_t *perm, uint64_t *shared_perm);
 void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow);
 void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow);
 void blk_set_disable_request_queuing(BlockBackend *blk, bool disable);
+void blk_set_request_merging(BlockBackend *blk, bool enable);
 void blk_iostatus_enable(BlockBackend *blk);
 bool blk_iostatus_is_enabled(const BlockBackend *blk);
 BlockDeviceIoStatus blk_iostatus(const BlockBackend *blk);
@@ -130,6 +131,12 @@ int coroutine_fn blk_co_pwritev_part(BlockBackend *blk, int64_t offset,
 int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags);
+int coroutine_fn blk_co_compress(BlockBackend *blk, int64_t offset,
+                                 unsigned int bytes, const void *buf,
+                                 void *dest, size_t dest_size);
+int coroutine_fn blk_co_pwrite_precompressed(BlockBackend *blk, int64_t offset,
+                                             unsigned int bytes,
+                                             const void *buf, size_t buf_size);
 
 static inline int coroutine_fn blk_co_pread(BlockBackend *blk, int64_t offset,
                                             unsigned int bytes, void *buf,
@@ -37,6 +37,8 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+    bool poll_adaptive;
+    int64_t poll_cpu_budget;
 };
 typedef struct IOThread IOThread;
 
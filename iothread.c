@@ -183,6 +183,12 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        aio_context_set_poll_adaptive(iothread->ctx,
+                                      iothread->poll_adaptive,
+                                      iothread->poll_cpu_budget,
+                                      &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
@@ -219,6 +225,9 @@ static PollParamInfo poll_grow_info = {
 static PollParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static PollParamInfo poll_cpu_budget_info = {
+    "poll-cpu-budget", offsetof(IOThread, poll_cpu_budget),
+};
 
 static void iothread_get_poll_param(Object *obj, Visitor *v,
         const char *name, void *opaque, Error **errp)
@@ -248,9 +257,22 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
         return;
     }
 
+    if (info == &poll_cpu_budget_info && value > 100) {
+        error_setg(errp, "%s value must be in range [0, 100]", info->name);
+        return;
+    }
+
     *field = value;
 
-    if (iothread->ctx) {
+    if (!iothread->ctx) {
+        return;
+    }
+    if (info == &poll_cpu_budget_info) {
+        aio_context_set_poll_adaptive(iothread->ctx,
+                                      iothread->poll_adaptive,
+                                      iothread->poll_cpu_budget,
+                                      errp);
+    } else {
         aio_context_set_poll_params(iothread->ctx,
                                     iothread->poll_max_ns,
                                     iothread->poll_grow,
@@ -259,6 +281,27 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_poll_adaptive(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->poll_adaptive;
+}
+
+static void iothread_set_poll_adaptive(Object *obj, bool value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_adaptive = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_adaptive(iothread->ctx,
+                                      iothread->poll_adaptive,
+                                      iothread->poll_cpu_budget,
+                                      errp);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -276,6 +319,13 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "poll-cpu-budget", "int",
+                              iothread_get_poll_param,
+                              iothread_set_poll_param,
+                              NULL, &poll_cpu_budget_info);
+    object_class_property_add_bool(klass, "poll-adaptive",
+                                   iothread_get_poll_adaptive,
+                                   iothread_set_poll_adaptive);
 }
 
 static const TypeInfo iothread_info = {
@@ -313,6 +363,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    AioPollStats stats = {};
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -325,6 +376,14 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->poll_adaptive = iothread->poll_adaptive;
+    info->poll_cpu_budget = iothread->poll_cpu_budget;
+    if (iothread->ctx) {
+        aio_context_get_poll_stats(iothread->ctx, &stats);
+    }
+    info->poll_hits = stats.hits;
+    info->poll_misses = stats.misses;
+    info->poll_wasted_ns = stats.wasted_ns;
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
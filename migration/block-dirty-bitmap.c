@@ -53,6 +53,13 @@
  * [ be64: buffer size  ] \ ! (flags & ZEROES)
  * [ n bytes: buffer    ] /
  *
+ * If flags & RUNS (only sent with the x-dirty-bitmaps-compress capability),
+ * the buffer does not hold the raw bits of the chunk but its dirty runs as
+ * encoded by hbitmap_serialize_runs(): pairs of unsigned LEB128 numbers, the
+ * count of clean granules before a run and the count of dirty granules in it.
+ * With that capability, ZEROES chunks may also cover more than one regular
+ * chunk.
+ *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
@@ -99,6 +106,9 @@
 
 #define DIRTY_BITMAP_MIG_EXTRA_FLAGS        0x80
 
+/* Two-byte flags; the first byte carries DIRTY_BITMAP_MIG_EXTRA_FLAGS */
+#define DIRTY_BITMAP_MIG_FLAG_RUNS          0x0100
+
 #define DIRTY_BITMAP_MIG_START_FLAG_ENABLED          0x01
 #define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT       0x02
 /* 0x04 was "AUTOLOAD" flags on older versions, now it is ignored */
@@ -356,7 +366,7 @@ bool check_dirty_bitmap_mig_alias_map(const BitmapMigrationNodeAliasList *bbm,
 
 static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 {
-    uint8_t flags = qemu_get_byte(f);
+    uint32_t flags = qemu_get_byte(f);
     if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
         flags = flags << 8 | qemu_get_byte(f);
         if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
@@ -369,9 +379,12 @@ static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 
 static void qemu_put_bitmap_flags(QEMUFile *f, uint32_t flags)
 {
-    /* The code currently does not send flags as more than one byte */
-    assert(!(flags & (0xffffff00 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
+    /* The code currently does not send flags as more than two bytes */
+    assert(!(flags & (0xffff8000 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
 
+    if (flags & 0xff00) {
+        qemu_put_byte(f, (flags >> 8) | DIRTY_BITMAP_MIG_EXTRA_FLAGS);
+    }
     qemu_put_byte(f, flags);
 }
 
@@ -418,6 +431,23 @@ static void send_bitmap_complete(QEMUFile *f, DBMSaveState *s,
     send_bitmap_header(f, s, dbms, DIRTY_BITMAP_MIG_FLAG_COMPLETE);
 }
 
+static void send_bitmap_zeroes(QEMUFile *f, DBMSaveState *s,
+                               SaveBitmapState *dbms,
+                               uint64_t start_sector, uint32_t nr_sectors)
+{
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS | DIRTY_BITMAP_MIG_FLAG_ZEROES;
+
+    trace_send_bitmap_bits(flags, start_sector, nr_sectors, 0);
+
+    send_bitmap_header(f, s, dbms, flags);
+
+    qemu_put_be64(f, start_sector);
+    qemu_put_be32(f, nr_sectors);
+
+    /* See send_bitmap_bits() */
+    qemu_fflush(f);
+}
+
 static void send_bitmap_bits(QEMUFile *f, DBMSaveState *s,
                              SaveBitmapState *dbms,
                              uint64_t start_sector, uint32_t nr_sectors)
@@ -431,15 +461,40 @@ static void send_bitmap_bits(QEMUFile *f, DBMSaveState *s,
     uint64_t buf_size = QEMU_ALIGN_UP(unaligned_size, align);
     uint8_t *buf = g_malloc0(buf_size);
     uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS;
+    ssize_t runs_size = -1;
 
-    bdrv_dirty_bitmap_serialize_part(
-        dbms->bitmap, buf, start_sector << BDRV_SECTOR_BITS,
-        (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
+    if (migrate_dirty_bitmaps_compress()) {
+        /*
+         * Only use the runs if they are smaller than the raw bits.  The
+         * destination compares against the unaligned size, so the padding
+         * of buf must not count.
+         */
+        runs_size = bdrv_dirty_bitmap_serialize_runs(
+            dbms->bitmap, buf, unaligned_size - 1,
+            start_sector << BDRV_SECTOR_BITS,
+            (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
+    }
 
-    if (buffer_is_zero(buf, buf_size)) {
+    if (runs_size > 0) {
+        flags |= DIRTY_BITMAP_MIG_FLAG_RUNS;
+        buf_size = runs_size;
+    } else if (runs_size == 0) {
         g_free(buf);
         buf = NULL;
         flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+    } else {
+        if (migrate_dirty_bitmaps_compress()) {
+            memset(buf, 0, buf_size);
+        }
+        bdrv_dirty_bitmap_serialize_part(
+            dbms->bitmap, buf, start_sector << BDRV_SECTOR_BITS,
+            (uint64_t)nr_sectors << BDRV_SECTOR_BITS);
+
+        if (buffer_is_zero(buf, buf_size)) {
+            g_free(buf);
+            buf = NULL;
+            flags |= DIRTY_BITMAP_MIG_FLAG_ZEROES;
+        }
     }
 
     trace_send_bitmap_bits(flags, start_sector, nr_sectors, buf_size);
@@ -682,14 +737,48 @@ fail:
     return -1;
 }
 
+/*
+ * Return the number of sectors from @dbms->cur_sector on that can be sent as
+ * a single ZEROES chunk, or 0 if the next regular chunk has dirty bits.  The
+ * result is a multiple of the chunk size unless it reaches the end of the
+ * bitmap.
+ */
+static uint64_t bulk_phase_clean_sectors(SaveBitmapState *dbms)
+{
+    uint64_t max_sectors = QEMU_ALIGN_DOWN(UINT32_MAX, dbms->sectors_per_chunk);
+    uint64_t end_sector = MIN(dbms->total_sectors,
+                              dbms->cur_sector + max_sectors);
+    int64_t next_dirty;
+
+    next_dirty = bdrv_dirty_bitmap_next_dirty(
+        dbms->bitmap, dbms->cur_sector << BDRV_SECTOR_BITS,
+        (end_sector - dbms->cur_sector) << BDRV_SECTOR_BITS);
+    if (next_dirty < 0) {
+        return end_sector - dbms->cur_sector;
+    }
+
+    return QEMU_ALIGN_DOWN((next_dirty >> BDRV_SECTOR_BITS) - dbms->cur_sector,
+                           dbms->sectors_per_chunk);
+}
+
 /* Called with no lock taken.  */
 static void bulk_phase_send_chunk(QEMUFile *f, DBMSaveState *s,
                                   SaveBitmapState *dbms)
 {
     uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
                              dbms->sectors_per_chunk);
+    uint64_t clean_sectors = 0;
+
+    if (migrate_dirty_bitmaps_compress()) {
+        clean_sectors = bulk_phase_clean_sectors(dbms);
+    }
 
-    send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    if (clean_sectors > nr_sectors) {
+        nr_sectors = clean_sectors;
+        send_bitmap_zeroes(f, s, dbms, dbms->cur_sector, nr_sectors);
+    } else {
+        send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -1023,6 +1112,20 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
                                                            first_byte,
                                                            nr_bytes);
 
+        if (s->flags & DIRTY_BITMAP_MIG_FLAG_RUNS) {
+            trace_dirty_bitmap_load_bits_runs(buf_size);
+            /* The sender only uses runs if they are smaller than the bits */
+            if (buf_size >= needed_size ||
+                !bdrv_dirty_bitmap_deserialize_runs(s->bitmap, buf, buf_size,
+                                                    first_byte, nr_bytes,
+                                                    false)) {
+                error_report("Malformed dirty runs for bitmap '%s'",
+                             bdrv_dirty_bitmap_name(s->bitmap));
+                cancel_incoming_locked(s);
+            }
+            return 0;
+        }
+
         if (needed_size > buf_size ||
             buf_size > QEMU_ALIGN_UP(needed_size, 4 * sizeof(long))
              /* Here used same alignment as in send_bitmap_bits */
@@ -2428,6 +2428,16 @@ bool migrate_dirty_bitmaps(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
 }
 
+bool migrate_dirty_bitmaps_compress(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_X_DIRTY_BITMAPS_COMPRESS];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s;
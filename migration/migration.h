@@ -315,6 +315,7 @@ bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
+bool migrate_dirty_bitmaps_compress(void);
 bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
 
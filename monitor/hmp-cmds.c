@@ -1889,6 +1889,13 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  poll-adaptive=%s\n",
+                       value->poll_adaptive ? "on" : "off");
+        monitor_printf(mon, "  poll-cpu-budget=%" PRId64 "\n",
+                       value->poll_cpu_budget);
+        monitor_printf(mon, "  poll-hits=%" PRId64 " poll-misses=%" PRId64
+                       " poll-wasted-ns=%" PRId64 "\n", value->poll_hits,
+                       value->poll_misses, value->poll_wasted_ns);
     }
 
     qapi_free_IOThreadInfoList(info_list);
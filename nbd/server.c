@@ -26,6 +26,11 @@
 #include "nbd-internal.h"
 #include "qemu/units.h"
 
+#ifdef CONFIG_SENDFILE
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
 /* Dirty bitmaps use 'NBD_META_ID_DIRTY_BITMAP + i', so keep this id last. */
@@ -97,6 +102,17 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool zero_copy;
+#ifdef CONFIG_SENDFILE
+    /*
+     * Read-only mapping of the whole host file of a zero-copy export, to
+     * check with mincore() which of its pages are cached.  NULL if mapping
+     * @zero_copy_fd failed.
+     */
+    int zero_copy_fd;
+    void *zero_copy_map;
+    size_t zero_copy_map_len;
+#endif
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
 };
@@ -1634,6 +1650,14 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         return -EEXIST;
     }
 
+#ifndef CONFIG_SENDFILE
+    if (arg->zero_copy) {
+        error_setg(errp, "zero-copy read replies are not supported on this "
+                   "host");
+        return -ENOTSUP;
+    }
+#endif
+
     size = blk_getlength(blk);
     if (size < 0) {
         error_setg_errno(errp, -size,
@@ -1654,11 +1678,14 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     exp->description = g_strdup(arg->description);
     exp->nbdflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
+    if (arg->has_multi_conn && arg->multi_conn != ON_OFF_AUTO_AUTO) {
+        shared = arg->multi_conn == ON_OFF_AUTO_ON;
+    }
+    if (shared) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
@@ -1714,6 +1741,10 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
+#ifdef CONFIG_SENDFILE
+    exp->zero_copy_fd = -1;
+#endif
 
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
 
@@ -1793,6 +1824,12 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+#ifdef CONFIG_SENDFILE
+    if (exp->zero_copy_map) {
+        munmap(exp->zero_copy_map, exp->zero_copy_map_len);
+    }
+#endif
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -1820,6 +1857,148 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+#ifdef CONFIG_SENDFILE
+/*
+ * Like nbd_co_send_iov(), but follow @iov with @size bytes read directly
+ * from the host file @fd at @offset.  The reply header has already been
+ * sent once we read from @fd, so a failure there can only be reported by
+ * dropping the connection.
+ */
+static int coroutine_fn nbd_co_send_iov_file(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             int fd, off_t offset, size_t size,
+                                             Error **errp)
+{
+    int sockfd = client->sioc->fd;
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+
+    while (ret == 0 && size > 0) {
+        ssize_t len = sendfile(sockfd, fd, &offset, size);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                qio_channel_yield(client->ioc, G_IO_OUT);
+                continue;
+            }
+            error_setg_errno(errp, errno, "sendfile failed");
+            ret = -EIO;
+        } else if (len == 0) {
+            /*
+             * The file was shrunk behind our back.  We have promised the
+             * client @size bytes, so pad the reply with zeroes.
+             */
+            size_t chunk = MIN(size, 64 * KiB);
+            g_autofree void *zeroes = g_malloc0(chunk);
+
+            while (ret == 0 && size > 0) {
+                chunk = MIN(size, 64 * KiB);
+                ret = qio_channel_write_all(client->ioc, zeroes, chunk,
+                                            errp) < 0 ? -EIO : 0;
+                size -= chunk;
+            }
+        } else {
+            size -= len;
+        }
+    }
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
+/*
+ * Return whether all pages of @fd between @offset and @offset + @size are in
+ * the page cache.  sendfile() from them neither blocks the event loop on
+ * disk I/O nor fails after the reply header has been sent.
+ *
+ * The file is mapped once per export and host file descriptor, rather than
+ * for every read; mapping it does not fault any pages in.
+ */
+static bool nbd_host_file_resident(NBDExport *exp, int fd, uint64_t offset,
+                                   size_t size)
+{
+    size_t page_size = qemu_real_host_page_size;
+    uint64_t start = QEMU_ALIGN_DOWN(offset, page_size);
+    size_t len = QEMU_ALIGN_UP(offset + size, page_size) - start;
+    g_autofree unsigned char *vec = NULL;
+    size_t i;
+
+    if (fd != exp->zero_copy_fd) {
+        if (exp->zero_copy_map) {
+            munmap(exp->zero_copy_map, exp->zero_copy_map_len);
+        }
+        exp->zero_copy_fd = fd;
+        exp->zero_copy_map_len = QEMU_ALIGN_UP(exp->size, page_size);
+        exp->zero_copy_map = mmap(NULL, exp->zero_copy_map_len, PROT_READ,
+                                  MAP_SHARED, fd, 0);
+        if (exp->zero_copy_map == MAP_FAILED) {
+            exp->zero_copy_map = NULL;
+        }
+    }
+    if (!exp->zero_copy_map || start + len > exp->zero_copy_map_len) {
+        return false;
+    }
+
+    vec = g_malloc(len / page_size);
+    if (mincore((uint8_t *)exp->zero_copy_map + start, len, vec) < 0) {
+        return false;
+    }
+    for (i = 0; i < len / page_size; i++) {
+        if (!(vec[i] & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Return the host file descriptor from which @size bytes at @offset can be
+ * sent to @client without copying the data through QEMU, or -errno if the
+ * request has to go through the block layer.
+ *
+ * Data that is not in the page cache goes through the block layer, which
+ * reads it in the thread pool and reports errors to the client properly.
+ * Pages evicted between the check and sendfile() are read synchronously.
+ */
+static int nbd_zero_copy_fd(NBDClient *client, uint64_t offset, size_t size)
+{
+    NBDExport *exp = client->exp;
+    BlockBackend *blk = exp->common.blk;
+    BlockDriverState *bs = blk_bs(blk);
+    int fd;
+
+    if (!exp->zero_copy || !bs) {
+        return -ENOTSUP;
+    }
+    /* TLS has to encrypt the data in userspace anyway */
+    if (client->ioc != (QIOChannel *)client->sioc) {
+        return -ENOTSUP;
+    }
+    if (blk_get_public(blk)->throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    fd = bdrv_get_host_fd(bs);
+    if (fd < 0) {
+        return fd;
+    }
+    if (!nbd_host_file_resident(exp, fd, offset, size)) {
+        trace_nbd_zero_copy_not_resident(offset, size);
+        return -EAGAIN;
+    }
+    return fd;
+}
+#endif
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1849,6 +2028,26 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+#ifdef CONFIG_SENDFILE
+static int coroutine_fn nbd_co_send_simple_reply_file(NBDClient *client,
+                                                      uint64_t handle,
+                                                      int fd,
+                                                      uint64_t offset,
+                                                      size_t len,
+                                                      Error **errp)
+{
+    NBDSimpleReply reply;
+    struct iovec iov[] = {
+        {.iov_base = &reply, .iov_len = sizeof(reply)},
+    };
+
+    trace_nbd_co_send_simple_reply_file(handle, offset, len);
+    set_be_simple_reply(&reply, 0, handle);
+
+    return nbd_co_send_iov_file(client, iov, 1, fd, offset, len, errp);
+}
+#endif
+
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
                                 uint16_t type, uint64_t handle, uint32_t length)
 {
@@ -1898,6 +2097,31 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+#ifdef CONFIG_SENDFILE
+static int coroutine_fn nbd_co_send_structured_read_file(NBDClient *client,
+                                                         uint64_t handle,
+                                                         uint64_t offset,
+                                                         int fd,
+                                                         size_t size,
+                                                         bool final,
+                                                         Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    assert(size);
+    trace_nbd_co_send_structured_read_file(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov_file(client, iov, 1, fd, offset, size, errp);
+}
+#endif
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1923,6 +2147,8 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
 }
 
 /* Do a sparse read and send the structured reply to the client.
+ * Data extents that are cached in the host file of a zero-copy export are
+ * sent directly from there instead of being read into @data.
  * Returns -errno if sending fails. bdrv_block_status_above() failure is
  * reported to the client, at which point this function succeeds.
  */
@@ -1944,6 +2170,9 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
                                              size - progress, &pnum, NULL,
                                              NULL);
         bool final;
+#ifdef CONFIG_SENDFILE
+        int fd;
+#endif
 
         if (status < 0) {
             char *msg = g_strdup_printf("unable to check for holes: %s",
@@ -1970,6 +2199,19 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
+#ifdef CONFIG_SENDFILE
+        } else if ((fd = nbd_zero_copy_fd(client, offset + progress,
+                                          pnum)) >= 0) {
+            /*
+             * Keep the node from being drained, and thus its fd from being
+             * closed or replaced, while we send from it.
+             */
+            blk_inc_in_flight(exp->common.blk);
+            ret = nbd_co_send_structured_read_file(client, handle,
+                                                   offset + progress, fd,
+                                                   pnum, final, errp);
+            blk_dec_in_flight(exp->common.blk);
+#endif
         } else {
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
@@ -2357,6 +2599,9 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                         uint8_t *data, Error **errp)
 {
     int ret;
+#ifdef CONFIG_SENDFILE
+    int fd = -1;
+#endif
     NBDExport *exp = client->exp;
 
     assert(request->type == NBD_CMD_READ);
@@ -2377,6 +2622,27 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+#ifdef CONFIG_SENDFILE
+    if (request->len) {
+        fd = nbd_zero_copy_fd(client, request->from, request->len);
+    }
+    if (fd >= 0) {
+        /* See nbd_co_send_sparse_read() */
+        blk_inc_in_flight(exp->common.blk);
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_read_file(client, request->handle,
+                                                   request->from, fd,
+                                                   request->len, true, errp);
+        } else {
+            ret = nbd_co_send_simple_reply_file(client, request->handle, fd,
+                                                request->from, request->len,
+                                                errp);
+        }
+        blk_dec_in_flight(exp->common.blk);
+        return ret;
+    }
+#endif
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
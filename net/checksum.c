@@ -19,24 +19,242 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
+void net_toeplitz_table_init(NetToeplitzTable *table, const uint8_t *key)
+{
+    /* 8-byte loads at the end of the key must not read past it */
+    uint8_t padded[NET_TOEPLITZ_MAX_INPUT + 8] = { 0 };
+    uint32_t window[4];
+    uint64_t bits;
+    int pos, bit, val;
+
+    memcpy(padded, key, NET_TOEPLITZ_MAX_INPUT + 4);
+
+    for (pos = 0; pos < NET_TOEPLITZ_MAX_INPUT * 2; pos++) {
+        /* Key bits 4 * pos ... 4 * pos + 39, MSB first */
+        bits = ldq_be_p(padded + pos / 2) >> (pos & 1 ? 20 : 24);
+
+        /* The 32 key bits that are xored if input bit 4 * pos + bit is set */
+        for (bit = 0; bit < 4; bit++) {
+            window[bit] = bits >> (8 - bit);
+        }
+
+        for (val = 0; val < 16; val++) {
+            uint32_t result = 0;
+
+            for (bit = 0; bit < 4; bit++) {
+                if (val & (8 >> bit)) {
+                    result ^= window[bit];
+                }
+            }
+            table->nibble[pos][val] = result;
+        }
+    }
+}
+
+/*
+ * The kernels below add up the buffer as little-endian words of any
+ * width.  Since 2^16 == 1 modulo 0xffff, the ones' complement sum of
+ * the result equals the sum of the little-endian 16-bit words, which is
+ * the byte-swapped internet checksum (RFC 1071).  @len is even.
+ */
+static uint64_t net_checksum_sum_int(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v = ldq_le_p(buf + i);
+
+        sum += (v & 0xffffffff) + (v >> 32);
+    }
+    for (; i < len; i += 2) {
+        sum += lduw_le_p(buf + i);
+    }
+
+    return sum;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/*
+ * Every iteration adds at most 2 * 0xffff to each 32-bit lane, so the
+ * lanes are folded into the 64-bit sum before they can overflow.
+ */
+#define NET_CHECKSUM_SIMD_BATCH 16384
+
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+static uint64_t net_checksum_sum_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    while (i + 16 <= len) {
+        __m128i acc = zero;
+        uint32_t lanes[4];
+        size_t n;
+
+        for (n = 0; n < NET_CHECKSUM_SIMD_BATCH && i + 16 <= len; n++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+            i += 16;
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return sum + net_checksum_sum_int(buf + i, len - i);
+}
+#if defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_sum_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    while (i + 32 <= len) {
+        __m256i acc = zero;
+        uint32_t lanes[8];
+        size_t n;
+
+        for (n = 0; n < NET_CHECKSUM_SIMD_BATCH && i + 32 <= len; n++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            i += 32;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (n = 0; n < 8; n++) {
+            sum += lanes[n];
+        }
+    }
+
+    return sum + net_checksum_sum_int(buf + i, len - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+#endif /* CONFIG_AVX2_OPT || __SSE2__ */
+
+/*
+ * Note that for test_net_checksum_next_accel, the most preferred ISA must
+ * have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+#if defined(__SSE2__)
+static unsigned cpuid_cache = CACHE_SSE2;
+static uint64_t (*net_checksum_sum)(const uint8_t *, size_t) =
+    net_checksum_sum_sse2;
+#else
+static unsigned cpuid_cache;
+static uint64_t (*net_checksum_sum)(const uint8_t *, size_t) =
+    net_checksum_sum_int;
+#endif
+
+static void init_accel(unsigned cache)
+{
+    uint64_t (*fn)(const uint8_t *, size_t) = net_checksum_sum_int;
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+    if (cache & CACHE_SSE2) {
+        fn = net_checksum_sum_sse2;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = net_checksum_sum_avx2;
+    }
+#endif
+    net_checksum_sum = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) net_checksum_init_accel(void)
+{
+    unsigned cache = 0;
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_net_checksum_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested net_checksum_sum_int, and there are
+     * no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum;
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    if (len <= 0) {
+        return 0;
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+
+    sum = net_checksum_sum(buf, len & ~1);
+    if (len & 1) {
+        /* The odd byte is the low half of a little-endian word */
+        sum += buf[len - 1];
     }
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
     }
+
+    /*
+     * The sum is over little-endian words, i.e. the bytes at even offsets
+     * are the low halves.  That matches the network byte order only if
+     * @buf starts at an odd offset of the checksummed data.
+     */
+    return (seq & 1) ? sum : bswap16(sum);
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
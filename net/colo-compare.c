@@ -55,6 +55,8 @@ static NotifierList colo_compare_notifiers =
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
 
+#define MAX_COMPARE_THREADS 64
+
 /* #define DEBUG_COLO_PACKETS */
 
 static QemuMutex colo_compare_mutex;
@@ -103,6 +105,45 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are distributed over shards by the hash of their key, so
+ * that all packets of one connection are compared by the same shard, in
+ * order.  With compare_threads=N each shard is served by its own thread;
+ * otherwise there is a single shard that is processed by the iothread.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+    QemuThread thread;
+
+    /* Protects the queues below and @stopping */
+    QemuMutex lock;
+    QemuCond cond;
+    /* Packets not yet queued to their connection, element type: Packet */
+    GQueue primary_in;
+    GQueue secondary_in;
+    /* Matched primary packets to be sent by the iothread */
+    GQueue release_list;
+    bool stopping;
+
+    /*
+     * Held while the connections are accessed.  Taken before @lock when
+     * both are needed.
+     */
+    QemuMutex conn_lock;
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* Statistics of released primary packets, protected by @conn_lock */
+    uint64_t compared_packets;
+    uint64_t lag_sum_ms;
+    uint64_t lag_max_ms;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -122,14 +163,14 @@ struct CompareState {
     bool vnet_hdr;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+    uint32_t n_shards;
+    /* Sends the packets released by the compare threads */
+    QEMUBH *release_bh;
+    /* A compare thread found a mismatch, set from any thread */
+    bool inconsistent;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -225,11 +266,18 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 {
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
+            Packet *tail = g_queue_peek_tail(queue);
+
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            /* Segments usually arrive in order, avoid walking the queue */
+            if (tail && seq_sorter(tail, pkt, NULL) < 0) {
+                g_queue_push_tail(queue, pkt);
+            } else {
+                g_queue_insert_sorted(queue,
+                                      pkt,
+                                      (GCompareDataFunc)seq_sorter,
+                                      NULL);
+            }
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -239,39 +287,24 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Queue a packet that was parsed with parse_packet_early() to its
+ * connection.  Called with shard->conn_lock held.
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static void packet_enqueue(CompareShard *shard, Packet *pkt, int mode,
+                           Connection **con)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
     int ret;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -289,8 +322,6 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
 
     *con = conn;
-
-    return 0;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -298,7 +329,7 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
     ret = compare_chr_send(s,
@@ -310,10 +341,47 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+/* Called with shard->conn_lock held */
+static void colo_release_primary_pkt(CompareShard *shard, Packet *pkt)
+{
+    CompareState *s = shard->s;
+    int64_t lag = qemu_clock_get_ms(QEMU_CLOCK_HOST) - pkt->creation_ms;
+
+    lag = MAX(lag, 0);
+    shard->compared_packets++;
+    shard->lag_sum_ms += lag;
+    shard->lag_max_ms = MAX(shard->lag_max_ms, lag);
+
+    trace_colo_compare_main("packet same and release packet");
+
+    if (!s->compare_threads) {
+        colo_send_primary_pkt(s, pkt);
+        return;
+    }
+
+    /* The chardev belongs to the iothread, colo_compare_release_bh() sends */
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(&shard->release_list, pkt);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/* Called with shard->conn_lock held */
+static void colo_compare_shard_inconsistent(CompareShard *shard)
+{
+    CompareState *s = shard->s;
+
+    if (!s->compare_threads) {
+        colo_compare_inconsistency_notify(s);
+        return;
+    }
+
+    /* The compare thread kicks s->release_bh when the batch is done */
+    qatomic_set(&s->inconsistent, true);
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -397,7 +465,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *shard, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -428,13 +496,13 @@ sec:
     spkt = g_queue_pop_head(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
@@ -474,7 +542,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             g_queue_push_head(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -483,7 +551,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -496,7 +564,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_shard_inconsistent(shard);
     }
 }
 
@@ -666,16 +734,29 @@ out:
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
+    CompareShard *shard;
+    GList *found;
+    uint32_t i;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    for (i = 0; i < s->n_shards; i++) {
+        shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->conn_lock);
+        found = g_queue_find_custom(&shard->conn_list, s,
+                            (GCompareFunc)colo_old_packet_check_one_conn);
+        qemu_mutex_unlock(&shard->conn_lock);
+
+        if (found) {
+            break;
+        }
+    }
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *shard, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -689,7 +770,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(shard, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -702,7 +783,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_head(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_shard_inconsistent(shard);
             break;
         }
     }
@@ -714,27 +795,144 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  * specified connection when a new packet was
  * queued to it.
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareShard *shard, Connection *conn)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
-
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(shard, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(shard, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(shard, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(shard, conn, colo_packet_compare_other);
         break;
     }
 }
 
+/* Called with shard->conn_lock held */
+static void colo_compare_shard_packet(CompareShard *shard, Packet *pkt,
+                                      int mode)
+{
+    Connection *conn = NULL;
+
+    packet_enqueue(shard, pkt, mode, &conn);
+    colo_compare_connection(shard, conn);
+}
+
+static void *colo_compare_shard_thread(void *opaque)
+{
+    CompareShard *shard = opaque;
+    CompareState *s = shard->s;
+    GQueue primary, secondary;
+    Packet *pkt;
+
+    while (true) {
+        qemu_mutex_lock(&shard->lock);
+        while (g_queue_is_empty(&shard->primary_in) &&
+               g_queue_is_empty(&shard->secondary_in) &&
+               !shard->stopping) {
+            qemu_cond_wait(&shard->cond, &shard->lock);
+        }
+        if (shard->stopping) {
+            /* colo_compare_finalize() flushes what is left */
+            qemu_mutex_unlock(&shard->lock);
+            break;
+        }
+        qemu_mutex_unlock(&shard->lock);
+
+        /*
+         * Take the whole batch under conn_lock, so that a checkpoint
+         * flush sees every packet either in a connection or still in
+         * the input queues.
+         */
+        qemu_mutex_lock(&shard->conn_lock);
+        qemu_mutex_lock(&shard->lock);
+        primary = shard->primary_in;
+        secondary = shard->secondary_in;
+        g_queue_init(&shard->primary_in);
+        g_queue_init(&shard->secondary_in);
+        qemu_mutex_unlock(&shard->lock);
+
+        while ((pkt = g_queue_pop_head(&primary))) {
+            colo_compare_shard_packet(shard, pkt, PRIMARY_IN);
+        }
+        while ((pkt = g_queue_pop_head(&secondary))) {
+            colo_compare_shard_packet(shard, pkt, SECONDARY_IN);
+        }
+        qemu_mutex_unlock(&shard->conn_lock);
+
+        qemu_bh_schedule(s->release_bh);
+    }
+
+    return NULL;
+}
+
+/*
+ * Called from the compare iothread, which runs the chardev handlers, for a
+ * packet parsed by parse_packet_early().  Without compare threads, the
+ * packet is compared right here under conn_lock, and matched packets are
+ * sent directly since the iothread owns the chardevs.  Otherwise only
+ * shard->lock is taken, so this never waits for a compare thread that
+ * holds conn_lock for a whole batch.
+ */
+static void colo_compare_dispatch(CompareState *s, Packet *pkt, int mode)
+{
+    CompareShard *shard = &s->shards[0];
+    ConnectionKey key;
+
+    if (s->n_shards > 1) {
+        fill_connection_key(pkt, &key);
+        shard = &s->shards[connection_key_hash(&key) % s->n_shards];
+    }
+
+    if (!s->compare_threads) {
+        qemu_mutex_lock(&shard->conn_lock);
+        colo_compare_shard_packet(shard, pkt, mode);
+        qemu_mutex_unlock(&shard->conn_lock);
+        return;
+    }
+
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &shard->primary_in
+                                         : &shard->secondary_in, pkt);
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+static void colo_compare_release_shard(CompareShard *shard)
+{
+    GQueue release;
+    Packet *pkt;
+
+    qemu_mutex_lock(&shard->lock);
+    release = shard->release_list;
+    g_queue_init(&shard->release_list);
+    qemu_mutex_unlock(&shard->lock);
+
+    while ((pkt = g_queue_pop_head(&release))) {
+        colo_send_primary_pkt(shard->s, pkt);
+    }
+}
+
+/* Runs in the iothread, which owns the chardevs */
+static void colo_compare_release_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->n_shards; i++) {
+        colo_compare_release_shard(&s->shards[i]);
+    }
+
+    if (qatomic_xchg(&s->inconsistent, false)) {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -852,7 +1050,7 @@ static int compare_chr_can_read(void *opaque)
 }
 
 /*
- * Called from the main thread on the primary for packets
+ * Called from the compare iothread on the primary for packets
  * arriving over the socket from the primary.
  */
 static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
@@ -869,7 +1067,7 @@ static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
 }
 
 /*
- * Called from the main thread on the primary for packets
+ * Called from the compare iothread on the primary for packets
  * arriving over the socket from the secondary.
  */
 static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
@@ -957,7 +1155,7 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
+static void colo_compare_flush(CompareState *s);
 
 static void colo_compare_handle_event(void *opaque)
 {
@@ -965,7 +1163,7 @@ static void colo_compare_handle_event(void *opaque)
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -1000,6 +1198,7 @@ static void colo_compare_iothread(CompareState *s)
 
     colo_compare_timer_init(s);
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->release_bh = aio_bh_new(ctx, colo_compare_release_bh, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1134,6 +1333,83 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (s->shards) {
+        error_setg(errp, "Property '%s.%s' can't be changed after creation",
+                   object_get_typename(obj), name);
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > MAX_COMPARE_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be at most %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
+enum {
+    COMPARE_STAT_PACKETS,
+    COMPARE_STAT_LAG_AVG,
+    COMPARE_STAT_LAG_MAX,
+};
+
+/*
+ * Number of primary packets released after a successful comparison, and
+ * how long they were held by colo-compare.
+ */
+static void compare_get_stat(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t packets = 0, lag_sum = 0, lag_max = 0;
+    uint64_t value = 0;
+    uint32_t i;
+
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->conn_lock);
+        packets += shard->compared_packets;
+        lag_sum += shard->lag_sum_ms;
+        lag_max = MAX(lag_max, shard->lag_max_ms);
+        qemu_mutex_unlock(&shard->conn_lock);
+    }
+
+    switch ((uintptr_t)opaque) {
+    case COMPARE_STAT_PACKETS:
+        value = packets;
+        break;
+    case COMPARE_STAT_LAG_AVG:
+        value = packets ? lag_sum / packets : 0;
+        break;
+    case COMPARE_STAT_LAG_MAX:
+        value = lag_max;
+        break;
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1168,9 +1444,13 @@ out:
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
+    Packet *pkt;
+
+    pkt = packet_new(pri_rs->buf, pri_rs->packet_len, pri_rs->vnet_hdr_len);
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    /* unsupported packets (arp and ipv6) are sent right away */
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1180,20 +1460,23 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          false);
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, PRIMARY_IN);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
+    Packet *pkt;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    pkt = packet_new(sec_rs->buf, sec_rs->packet_len, sec_rs->vnet_hdr_len);
+
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
         trace_colo_compare_main("secondary: unsupported packet in");
     } else {
         /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        colo_compare_dispatch(s, pkt, SECONDARY_IN);
     }
 }
 
@@ -1215,7 +1498,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1259,6 +1542,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1330,15 +1614,37 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
+    s->n_shards = MAX(s->compare_threads, 1);
+    s->shards = g_new0(CompareShard, s->n_shards);
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *shard = &s->shards[i];
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+        shard->s = s;
+        qemu_mutex_init(&shard->lock);
+        qemu_cond_init(&shard->cond);
+        qemu_mutex_init(&shard->conn_lock);
+        g_queue_init(&shard->primary_in);
+        g_queue_init(&shard->secondary_in);
+        g_queue_init(&shard->release_list);
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash,
+                                  connection_key_equal,
+                                  g_free,
+                                  connection_destroy);
+    }
 
     colo_compare_iothread(s);
 
+    for (i = 0; i < s->compare_threads; i++) {
+        char *name = g_strdup_printf("colo-compare/%u", i);
+
+        qemu_thread_create(&s->shards[i].thread, name,
+                           colo_compare_shard_thread, &s->shards[i],
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+
     qemu_mutex_lock(&colo_compare_mutex);
     if (!colo_compare_active) {
         qemu_mutex_init(&event_mtx);
@@ -1373,6 +1679,42 @@ static void colo_flush_packets(void *opaque, void *user_data)
     }
 }
 
+/*
+ * Send all primary packets and drop all secondary packets, including
+ * those that a compare thread has not seen yet.
+ */
+static void colo_compare_flush(CompareState *s)
+{
+    GQueue primary, secondary;
+    Packet *pkt;
+    uint32_t i;
+
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->conn_lock);
+
+        /* Keep the order of each connection: released, queued, incoming */
+        colo_compare_release_shard(shard);
+        g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
+
+        qemu_mutex_lock(&shard->lock);
+        primary = shard->primary_in;
+        secondary = shard->secondary_in;
+        g_queue_init(&shard->primary_in);
+        g_queue_init(&shard->secondary_in);
+        qemu_mutex_unlock(&shard->lock);
+
+        while ((pkt = g_queue_pop_head(&primary))) {
+            colo_send_primary_pkt(s, pkt);
+        }
+        g_queue_foreach(&secondary, packet_destroy, NULL);
+        g_queue_clear(&secondary);
+
+        qemu_mutex_unlock(&shard->conn_lock);
+    }
+}
+
 static void colo_compare_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -1410,6 +1752,20 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
+    object_property_add(obj, "compared_packets", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        (void *)COMPARE_STAT_PACKETS);
+    object_property_add(obj, "compare_lag_avg_ms", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        (void *)COMPARE_STAT_LAG_AVG);
+    object_property_add(obj, "compare_lag_max_ms", "uint64",
+                        compare_get_stat, NULL, NULL,
+                        (void *)COMPARE_STAT_LAG_MAX);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1419,6 +1775,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1443,7 +1800,22 @@ static void colo_compare_finalize(Object *obj)
 
     colo_compare_timer_del(s);
 
+    if (s->shards) {
+        for (i = 0; i < s->compare_threads; i++) {
+            CompareShard *shard = &s->shards[i];
+
+            qemu_mutex_lock(&shard->lock);
+            shard->stopping = true;
+            qemu_cond_signal(&shard->cond);
+            qemu_mutex_unlock(&shard->lock);
+            qemu_thread_join(&shard->thread);
+        }
+    }
+
     qemu_bh_delete(s->event_bh);
+    if (s->release_bh) {
+        qemu_bh_delete(s->release_bh);
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
@@ -1454,18 +1826,24 @@ static void colo_compare_finalize(Object *obj)
     aio_context_release(ctx);
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    colo_compare_flush(s);
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; i < s->n_shards; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
+        qemu_mutex_destroy(&shard->conn_lock);
+        qemu_cond_destroy(&shard->cond);
+        qemu_mutex_destroy(&shard->lock);
     }
+    g_free(s->shards);
 
     object_unref(OBJECT(s->iothread));
 
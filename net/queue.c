@@ -24,6 +24,8 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,13 +42,26 @@
  * unbounded queueing.
  */
 
+/*
+ * Packet data is reference counted, so that a packet that is forwarded
+ * from one queue to another one (e.g. by filter-buffer or a hub) while
+ * it is being flushed is not copied again.  The data is never modified
+ * once it has been queued.
+ */
+typedef struct NetPacketBuf {
+    unsigned refcnt;
+    size_t capacity;
+    QSLIST_ENTRY(NetPacketBuf) pool_next;
+    uint8_t data[];
+} NetPacketBuf;
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[];
+    NetPacketBuf *buf;
 };
 
 struct NetQueue {
@@ -60,6 +75,101 @@ struct NetQueue {
     unsigned delivering : 1;
 };
 
+/*
+ * Buffers that fit a packet of the usual MTU are recycled through a
+ * per-thread free list instead of being allocated for each packet.
+ */
+#define NET_PACKET_POOL_BUF_SIZE 2048
+#define NET_PACKET_POOL_MAX      256
+
+static __thread QSLIST_HEAD(, NetPacketBuf) packet_buf_pool =
+    QSLIST_HEAD_INITIALIZER(packet_buf_pool);
+static __thread unsigned int packet_buf_pool_size;
+static __thread Notifier packet_buf_pool_cleanup_notifier;
+
+/* The packet that qemu_net_queue_flush() is delivering in this thread */
+static __thread NetPacket *delivering_packet;
+
+static void net_packet_buf_pool_cleanup(Notifier *n, void *value)
+{
+    NetPacketBuf *buf, *tmp;
+
+    QSLIST_FOREACH_SAFE(buf, &packet_buf_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&packet_buf_pool, pool_next);
+        g_free(buf);
+    }
+    packet_buf_pool_size = 0;
+}
+
+static NetPacketBuf *net_packet_buf_new(size_t size)
+{
+    NetPacketBuf *buf = NULL;
+
+    if (size <= NET_PACKET_POOL_BUF_SIZE) {
+        buf = QSLIST_FIRST(&packet_buf_pool);
+        if (buf) {
+            QSLIST_REMOVE_HEAD(&packet_buf_pool, pool_next);
+            packet_buf_pool_size--;
+        } else {
+            size = NET_PACKET_POOL_BUF_SIZE;
+        }
+    }
+
+    if (!buf) {
+        buf = g_malloc(sizeof(NetPacketBuf) + size);
+        buf->capacity = size;
+    }
+    buf->refcnt = 1;
+
+    return buf;
+}
+
+static void net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (--buf->refcnt) {
+        return;
+    }
+
+    if (buf->capacity == NET_PACKET_POOL_BUF_SIZE &&
+        packet_buf_pool_size < NET_PACKET_POOL_MAX) {
+        if (!packet_buf_pool_cleanup_notifier.notify) {
+            packet_buf_pool_cleanup_notifier.notify =
+                net_packet_buf_pool_cleanup;
+            qemu_thread_atexit_add(&packet_buf_pool_cleanup_notifier);
+        }
+        QSLIST_INSERT_HEAD(&packet_buf_pool, buf, pool_next);
+        packet_buf_pool_size++;
+        return;
+    }
+
+    g_free(buf);
+}
+
+static void net_packet_free(NetPacket *packet)
+{
+    net_packet_buf_unref(packet->buf);
+    g_slice_free(NetPacket, packet);
+}
+
+/*
+ * Return the data of the packet that is being flushed if @iov refers to
+ * exactly that data, so that it can be queued again without a copy.
+ */
+static NetPacketBuf *net_packet_buf_get_delivering(const struct iovec *iov,
+                                                   int iovcnt)
+{
+    NetPacket *packet = delivering_packet;
+
+    if (packet && iovcnt == 1 &&
+        iov[0].iov_base == packet->buf->data &&
+        iov[0].iov_len == (size_t)packet->size) {
+        packet->buf->refcnt++;
+        return packet->buf;
+    }
+
+    return NULL;
+}
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
@@ -84,7 +194,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        net_packet_free(packet);
     }
 
     g_free(queue);
@@ -98,16 +208,24 @@ static void qemu_net_queue_append(NetQueue *queue,
                                   NetPacketSent *sent_cb)
 {
     NetPacket *packet;
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size
+    };
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = g_slice_new(NetPacket);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    packet->buf = net_packet_buf_get_delivering(&iov, 1);
+    if (!packet->buf) {
+        packet->buf = net_packet_buf_new(size);
+        memcpy(packet->buf->data, buf, size);
+    }
 
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
@@ -131,17 +249,15 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = g_slice_new(NetPacket);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+    packet->size = max_len;
+    packet->buf = net_packet_buf_get_delivering(iov, iovcnt);
+    if (!packet->buf) {
+        packet->buf = net_packet_buf_new(max_len);
+        iov_to_buf(iov, iovcnt, 0, packet->buf->data, max_len);
     }
 
     queue->nq_count++;
@@ -265,7 +381,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            net_packet_free(packet);
         }
     }
 }
@@ -276,18 +392,21 @@ bool qemu_net_queue_flush(NetQueue *queue)
         return false;
 
     while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
+        NetPacket *packet, *outer;
         int ret;
 
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
+        outer = delivering_packet;
+        delivering_packet = packet;
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     packet->buf->data,
                                      packet->size);
+        delivering_packet = outer;
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -298,7 +417,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        net_packet_free(packet);
     }
     return true;
 }
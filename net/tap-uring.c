@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Batched tap writes with io_uring
+ *
+ * Packets sent to the tap device are copied into a slot of the ring and
+ * reported as sent right away.  A BH submits all packets queued since it
+ * was scheduled with a single io_uring_enter(), so a burst of packets from
+ * the guest costs one system call instead of one writev() per packet.
+ *
+ * Packets must reach the tap device in the order they were sent, or TCP
+ * peers see reordered segments.  The writes of a batch are linked, so a
+ * write that fails cancels the ones after it, and only one batch is in
+ * flight at a time.  The tap file descriptor is non-blocking, so a write
+ * fails with -EAGAIN when the tap queue is full.  The failed and cancelled
+ * packets are then kept in their slots, in order and ahead of any packets
+ * queued since, and written again once a poll request reports the file
+ * descriptor as writable.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include <poll.h>
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "tap_int.h"
+#include "trace.h"
+
+/* Number of packets that can be in flight */
+#define TAP_URING_ENTRIES 256
+
+typedef struct TapUringSlot {
+    void *buf;
+    size_t buf_size;
+    size_t size;
+    /* Failed with -EAGAIN or was cancelled, to be written again */
+    bool retry;
+    QSLIST_ENTRY(TapUringSlot) next;
+    QSIMPLEQ_ENTRY(TapUringSlot) queue_next;
+} TapUringSlot;
+
+struct TapUring {
+    int fd;
+    struct io_uring ring;
+    QEMUBH *submit_bh;
+
+    TapUringSlot slots[TAP_URING_ENTRIES];
+    QSLIST_HEAD(, TapUringSlot) free_slots;
+
+    /* Packets to be written, in the order they were sent */
+    QSIMPLEQ_HEAD(, TapUringSlot) send_queue;
+    /* The batch of linked writes in flight, in submission order */
+    QSIMPLEQ_HEAD(, TapUringSlot) batch;
+    unsigned int batch_pending;
+
+    /* A write failed with -EAGAIN, wait until the tap fd is writable */
+    bool stalled;
+    bool poll_armed;
+
+    /* Prepared, but not submitted yet */
+    unsigned int in_queue;
+    /* Submitted, completion not seen yet */
+    unsigned int in_flight;
+
+    /* tap_uring_write() has returned 0 since the last completion */
+    bool blocked;
+    void (*writable_cb)(void *opaque);
+    void *opaque;
+};
+
+static void tap_uring_enter(TapUring *tu)
+{
+    int ret;
+
+    if (!tu->in_queue) {
+        return;
+    }
+
+    do {
+        ret = io_uring_submit(&tu->ring);
+    } while (ret == -EINTR);
+    trace_tap_uring_submit(tu, tu->in_queue, ret);
+
+    /*
+     * The kernel reports failures of single requests through their CQEs.
+     * If io_uring_enter() itself fails, the SQEs are left in the ring.
+     * With requests in flight (e.g. -EBUSY because the completion queue is
+     * full), the completion callback submits them again; otherwise retry
+     * from the BH rather than waiting for the next packet.
+     */
+    if (ret > 0) {
+        tu->in_flight += ret;
+        tu->in_queue -= MIN(ret, tu->in_queue);
+    }
+    if (tu->in_queue && !tu->in_flight) {
+        qemu_bh_schedule(tu->submit_bh);
+    }
+}
+
+/*
+ * Submit the queued packets as one chain of linked writes, unless the
+ * previous batch is still in flight or the tap queue is full
+ */
+static void tap_uring_submit_batch(TapUring *tu)
+{
+    struct io_uring_sqe *sqe = NULL;
+    TapUringSlot *slot;
+
+    if (tu->batch_pending || tu->stalled) {
+        return;
+    }
+
+    /* The ring has room for a write per slot, so this never runs out */
+    while ((slot = QSIMPLEQ_FIRST(&tu->send_queue))) {
+        sqe = io_uring_get_sqe(&tu->ring);
+        assert(sqe);
+        io_uring_prep_write(sqe, tu->fd, slot->buf, slot->size, 0);
+        io_uring_sqe_set_data(sqe, slot);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        tu->in_queue++;
+
+        QSIMPLEQ_REMOVE_HEAD(&tu->send_queue, queue_next);
+        QSIMPLEQ_INSERT_TAIL(&tu->batch, slot, queue_next);
+        tu->batch_pending++;
+    }
+
+    /* The last write ends the chain */
+    if (sqe) {
+        io_uring_sqe_set_flags(sqe, 0);
+    }
+}
+
+/*
+ * All writes of the batch have completed.  Put the packets that have to be
+ * written again back at the head of the send queue, in their order.
+ */
+static void tap_uring_batch_done(TapUring *tu)
+{
+    QSIMPLEQ_HEAD(, TapUringSlot) retry = QSIMPLEQ_HEAD_INITIALIZER(retry);
+    TapUringSlot *slot;
+
+    while ((slot = QSIMPLEQ_FIRST(&tu->batch))) {
+        QSIMPLEQ_REMOVE_HEAD(&tu->batch, queue_next);
+        if (slot->retry) {
+            slot->retry = false;
+            QSIMPLEQ_INSERT_TAIL(&retry, slot, queue_next);
+        } else {
+            QSLIST_INSERT_HEAD(&tu->free_slots, slot, next);
+        }
+    }
+
+    QSIMPLEQ_CONCAT(&retry, &tu->send_queue);
+    QSIMPLEQ_CONCAT(&tu->send_queue, &retry);
+}
+
+static void tap_uring_kick(TapUring *tu)
+{
+    struct io_uring_sqe *sqe;
+
+    if (tu->stalled && !tu->poll_armed) {
+        sqe = io_uring_get_sqe(&tu->ring);
+        if (sqe) {
+            io_uring_prep_poll_add(sqe, tu->fd, POLLOUT);
+            io_uring_sqe_set_data(sqe, tu);
+            tu->in_queue++;
+            tu->poll_armed = true;
+        }
+    }
+    tap_uring_submit_batch(tu);
+    tap_uring_enter(tu);
+}
+
+static void tap_uring_submit_bh(void *opaque)
+{
+    tap_uring_kick(opaque);
+}
+
+static void tap_uring_completion_cb(void *opaque)
+{
+    TapUring *tu = opaque;
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&tu->ring, &cqe) == 0) {
+        void *data = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        TapUringSlot *slot = data;
+
+        io_uring_cqe_seen(&tu->ring, cqe);
+        tu->in_flight--;
+
+        if (data == tu) {
+            tu->poll_armed = false;
+            tu->stalled = false;
+            continue;
+        }
+
+        /*
+         * -EAGAIN: the tap queue is full.  -ECANCELED: an earlier write of
+         * the batch failed.  Either way, write the packet again later.
+         */
+        if (ret == -EAGAIN) {
+            tu->stalled = true;
+        }
+        if (ret == -EAGAIN || ret == -ECANCELED) {
+            slot->retry = true;
+        } else if (ret < 0) {
+            /*
+             * The packet has already been reported as sent.  Like a failing
+             * writev() in tap_write_packet(), other errors just drop it.
+             */
+            trace_tap_uring_write_error(tu, ret);
+        }
+
+        if (--tu->batch_pending == 0) {
+            tap_uring_batch_done(tu);
+        }
+    }
+
+    tap_uring_kick(tu);
+
+    if (tu->blocked && !QSLIST_EMPTY(&tu->free_slots)) {
+        tu->blocked = false;
+        tu->writable_cb(tu->opaque);
+    }
+}
+
+ssize_t tap_uring_write(TapUring *tu, const struct iovec *iov, int iovcnt)
+{
+    TapUringSlot *slot;
+    size_t size = iov_size(iov, iovcnt);
+
+    /* The caller queues the packet until @writable_cb is called */
+    slot = QSLIST_FIRST(&tu->free_slots);
+    if (!slot) {
+        tu->blocked = true;
+        return 0;
+    }
+    QSLIST_REMOVE_HEAD(&tu->free_slots, next);
+
+    if (slot->buf_size < size) {
+        g_free(slot->buf);
+        slot->buf = g_malloc(size);
+        slot->buf_size = size;
+    }
+    iov_to_buf(iov, iovcnt, 0, slot->buf, size);
+    slot->size = size;
+
+    /* Behind any packets that wait for the tap fd to become writable */
+    QSIMPLEQ_INSERT_TAIL(&tu->send_queue, slot, queue_next);
+
+    qemu_bh_schedule(tu->submit_bh);
+    return size;
+}
+
+TapUring *tap_uring_new(int fd, void (*writable_cb)(void *opaque),
+                        void *opaque, Error **errp)
+{
+    TapUring *tu = g_new0(TapUring, 1);
+    int ret, i;
+
+    /* Room for a write per slot, plus the poll request and its removal */
+    ret = io_uring_queue_init(TAP_URING_ENTRIES * 2, &tu->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to init linux io_uring ring");
+        g_free(tu);
+        return NULL;
+    }
+
+    tu->fd = fd;
+    tu->writable_cb = writable_cb;
+    tu->opaque = opaque;
+    QSLIST_INIT(&tu->free_slots);
+    for (i = TAP_URING_ENTRIES - 1; i >= 0; i--) {
+        QSLIST_INSERT_HEAD(&tu->free_slots, &tu->slots[i], next);
+    }
+    QSIMPLEQ_INIT(&tu->send_queue);
+    QSIMPLEQ_INIT(&tu->batch);
+
+    tu->submit_bh = qemu_bh_new(tap_uring_submit_bh, tu);
+    qemu_set_fd_handler(tu->ring.ring_fd, tap_uring_completion_cb, NULL, tu);
+
+    return tu;
+}
+
+void tap_uring_free(TapUring *tu)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int i;
+
+    qemu_set_fd_handler(tu->ring.ring_fd, NULL, NULL, NULL);
+
+    /* The poll request may never complete on its own */
+    if (tu->poll_armed) {
+        sqe = io_uring_get_sqe(&tu->ring);
+        if (sqe) {
+            io_uring_prep_poll_remove(sqe, tu);
+            io_uring_sqe_set_data(sqe, NULL);
+            tu->in_queue++;
+        }
+    }
+
+    /* The kernel may still access the slot buffers until completion */
+    while (tu->in_queue || tu->in_flight) {
+        tap_uring_enter(tu);
+        if (!tu->in_flight) {
+            break;
+        }
+        if (io_uring_wait_cqe(&tu->ring, &cqe) < 0) {
+            break;
+        }
+        io_uring_cqe_seen(&tu->ring, cqe);
+        tu->in_flight--;
+    }
+
+    qemu_bh_delete(tu->submit_bh);
+    io_uring_queue_exit(&tu->ring);
+
+    for (i = 0; i < TAP_URING_ENTRIES; i++) {
+        g_free(tu->slots[i].buf);
+    }
+    g_free(tu);
+}
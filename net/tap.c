@@ -62,6 +62,9 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+#ifdef CONFIG_LINUX_IO_URING
+    TapUring *uring;
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -99,10 +102,25 @@ static void tap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_uring_writable(void *opaque)
+{
+    TAPState *s = opaque;
+
+    qemu_flush_queued_packets(&s->nc);
+}
+#endif
+
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        return tap_uring_write(s->uring, iov, iovcnt);
+    }
+#endif
+
     do {
         len = writev(s->fd, iov, iovcnt);
     } while (len == -1 && errno == EINTR);
@@ -334,6 +352,13 @@ static void tap_cleanup(NetClientState *nc)
     tap_exit_notify(&s->exit, NULL);
     qemu_remove_exit_notifier(&s->exit);
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_free(s->uring);
+        s->uring = NULL;
+    }
+#endif
+
     tap_read_poll(s, false);
     tap_write_poll(s, false);
     close(s->fd);
@@ -678,6 +703,18 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         return;
     }
 
+    if (tap->has_x_uring && tap->x_uring) {
+#ifdef CONFIG_LINUX_IO_URING
+        s->uring = tap_uring_new(s->fd, tap_uring_writable, s, errp);
+        if (!s->uring) {
+            return;
+        }
+#else
+        error_setg(errp, "x-uring=on requires QEMU built with io_uring support");
+        return;
+#endif
+    }
+
     if (tap->has_fd || tap->has_fds) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else if (tap->has_helper) {
@@ -701,6 +738,7 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
 
         options.backend_type = VHOST_BACKEND_TYPE_KERNEL;
         options.net_backend = &s->nc;
+        options.nvqs = 2;
         if (tap->has_poll_us) {
             options.busyloop_timeout = tap->poll_us;
         } else {
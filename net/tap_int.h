@@ -45,4 +45,14 @@ int tap_fd_enable(int fd);
 int tap_fd_disable(int fd);
 int tap_fd_get_ifname(int fd, char *ifname);
 
+#ifdef CONFIG_LINUX_IO_URING
+/* tap-uring.c */
+typedef struct TapUring TapUring;
+
+TapUring *tap_uring_new(int fd, void (*writable_cb)(void *opaque),
+                        void *opaque, Error **errp);
+void tap_uring_free(TapUring *tu);
+ssize_t tap_uring_write(TapUring *tu, const struct iovec *iov, int iovcnt);
+#endif
+
 #endif /* NET_TAP_INT_H */
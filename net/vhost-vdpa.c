@@ -14,9 +14,12 @@
 #include "net/vhost_net.h"
 #include "net/vhost-vdpa.h"
 #include "hw/virtio/vhost-vdpa.h"
+#include "hw/virtio/virtio-net.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/option.h"
+#include "qemu/bswap.h"
 #include "qapi/error.h"
 #include <sys/ioctl.h>
 #include <err.h>
@@ -24,7 +27,7 @@
 #include "monitor/monitor.h"
 #include "hw/virtio/vhost.h"
 
-/* Todo:need to add the multiqueue support here */
+/* One per queue pair of the device, plus one for its control virtqueue */
 typedef struct VhostVDPAState {
     NetClientState nc;
     struct vhost_vdpa vhost_vdpa;
@@ -54,8 +57,16 @@ const int vdpa_feature_bits[] = {
     VIRTIO_NET_F_MTU,
     VIRTIO_F_IOMMU_PLATFORM,
     VIRTIO_F_RING_PACKED,
+    VIRTIO_F_IN_ORDER,
     VIRTIO_NET_F_GUEST_ANNOUNCE,
     VIRTIO_NET_F_STATUS,
+    VIRTIO_NET_F_CTRL_VQ,
+    VIRTIO_NET_F_CTRL_RX,
+    VIRTIO_NET_F_CTRL_VLAN,
+    VIRTIO_NET_F_CTRL_RX_EXTRA,
+    VIRTIO_NET_F_CTRL_MAC_ADDR,
+    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS,
+    VIRTIO_NET_F_MQ,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -89,17 +100,7 @@ static int vhost_vdpa_net_check_device_id(struct vhost_net *net)
     return ret;
 }
 
-static void vhost_vdpa_del(NetClientState *ncs)
-{
-    VhostVDPAState *s;
-    assert(ncs->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
-    s = DO_UPCAST(VhostVDPAState, nc, ncs);
-    if (s->vhost_net) {
-        vhost_net_cleanup(s->vhost_net);
-    }
-}
-
-static int vhost_vdpa_add(NetClientState *ncs, void *be)
+static int vhost_vdpa_add(NetClientState *ncs, void *be, int nvqs)
 {
     VhostNetOptions options;
     struct vhost_net *net = NULL;
@@ -112,11 +113,12 @@ static int vhost_vdpa_add(NetClientState *ncs, void *be)
     options.net_backend = ncs;
     options.opaque      = be;
     options.busyloop_timeout = 0;
+    options.nvqs = nvqs;
 
     net = vhost_net_init(&options);
     if (!net) {
         error_report("failed to init vhost_net for queue");
-        goto err;
+        return -1;
     }
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -125,15 +127,12 @@ static int vhost_vdpa_add(NetClientState *ncs, void *be)
     s->vhost_net = net;
     ret = vhost_vdpa_net_check_device_id(net);
     if (ret) {
-        goto err;
-    }
-    return 0;
-err:
-    if (net) {
         vhost_net_cleanup(net);
+        g_free(net);
+        s->vhost_net = NULL;
+        return -1;
     }
-    vhost_vdpa_del(ncs);
-    return -1;
+    return 0;
 }
 
 static void vhost_vdpa_cleanup(NetClientState *nc)
@@ -145,10 +144,11 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
-     if (s->vhost_vdpa.device_fd >= 0) {
+    /* The first net client owns the file descriptor of the device */
+    if (s->vhost_vdpa.index == 0 && s->vhost_vdpa.device_fd >= 0) {
         qemu_close(s->vhost_vdpa.device_fd);
-        s->vhost_vdpa.device_fd = -1;
     }
+    s->vhost_vdpa.device_fd = -1;
 }
 
 static bool vhost_vdpa_has_vnet_hdr(NetClientState *nc)
@@ -177,28 +177,409 @@ static NetClientInfo net_vhost_vdpa_info = {
         .has_ufo = vhost_vdpa_has_ufo,
 };
 
-static int net_vhost_vdpa_init(NetClientState *peer, const char *device,
-                               const char *name, const char *vhostdev)
+/*
+ * With a shadow control virtqueue, the guest's commands go to the device
+ * and never reach virtio-net.  Apply the ones the device accepted to the
+ * virtio-net model as well, so that they are migrated and can be sent to
+ * the device again by vhost_vdpa_net_cvq_load().
+ */
+static void vhost_vdpa_net_cvq_used(VhostShadowVirtqueue *svq,
+                                    VirtQueueElement *elem, uint32_t len,
+                                    void *opaque)
+{
+    VhostVDPAState *s = opaque;
+    virtio_net_ctrl_ack status;
+
+    if (len < sizeof(status) ||
+        iov_to_buf(elem->in_sg, elem->in_num, 0, &status,
+                   sizeof(status)) != sizeof(status) ||
+        status != VIRTIO_NET_OK) {
+        return;
+    }
+
+    virtio_net_handle_ctrl_iov(s->vhost_vdpa.dev->vdev, elem->out_sg,
+                               elem->out_num);
+}
+
+static const VhostShadowVirtqueueOps vhost_vdpa_net_cvq_ops = {
+    .used_handler = vhost_vdpa_net_cvq_used,
+};
+
+static int vhost_vdpa_net_cvq_send(VhostVDPAState *s, uint8_t class,
+                                   uint8_t cmd, const void *data,
+                                   size_t data_len)
+{
+    struct virtio_net_ctrl_hdr ctrl = {
+        .class = class,
+        .cmd = cmd,
+    };
+    virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
+    uint8_t *out = g_malloc(sizeof(ctrl) + data_len);
+    ssize_t ret;
+
+    memcpy(out, &ctrl, sizeof(ctrl));
+    memcpy(out + sizeof(ctrl), data, data_len);
+    ret = vhost_vdpa_svq_send(&s->vhost_vdpa, 0, out,
+                              sizeof(ctrl) + data_len,
+                              &status, sizeof(status));
+    g_free(out);
+    if (ret < 0) {
+        error_report("vhost-vdpa: failed to send control command %u:%u: %s",
+                     class, cmd, strerror(-ret));
+        return ret;
+    }
+    if (ret < sizeof(status) || status != VIRTIO_NET_OK) {
+        error_report("vhost-vdpa: device rejected control command %u:%u",
+                     class, cmd);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * The command payloads below are little endian: vhost-vdpa devices only
+ * implement VIRTIO 1.0 or later.
+ */
+static int vhost_vdpa_net_load_mac(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    uint32_t uni_entries, multi_entries;
+    uint8_t *buf, *p;
+    size_t size;
+    int r;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR)) {
+        r = vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_MAC,
+                                    VIRTIO_NET_CTRL_MAC_ADDR_SET,
+                                    n->mac, sizeof(n->mac));
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX) ||
+        (!n->mac_table.in_use && !n->mac_table.uni_overflow &&
+         !n->mac_table.multi_overflow)) {
+        return 0;
+    }
+
+    /*
+     * virtio-net does not keep the addresses of a table that overflowed.
+     * Overflow the device's table as well, with more entries than fit.
+     */
+    uni_entries = n->mac_table.uni_overflow ? MAC_TABLE_ENTRIES + 1 :
+                  n->mac_table.first_multi;
+    multi_entries = n->mac_table.multi_overflow ? MAC_TABLE_ENTRIES + 1 :
+                    n->mac_table.in_use - n->mac_table.first_multi;
+
+    size = 2 * sizeof(uint32_t) + (uni_entries + multi_entries) * ETH_ALEN;
+    buf = p = g_malloc0(size);
+    stl_le_p(p, uni_entries);
+    p += sizeof(uint32_t);
+    if (!n->mac_table.uni_overflow) {
+        memcpy(p, n->mac_table.macs, uni_entries * ETH_ALEN);
+    }
+    p += uni_entries * ETH_ALEN;
+    stl_le_p(p, multi_entries);
+    p += sizeof(uint32_t);
+    if (!n->mac_table.multi_overflow) {
+        memcpy(p, &n->mac_table.macs[n->mac_table.first_multi * ETH_ALEN],
+               multi_entries * ETH_ALEN);
+    }
+
+    r = vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_MAC,
+                                VIRTIO_NET_CTRL_MAC_TABLE_SET, buf, size);
+    g_free(buf);
+    return r;
+}
+
+static int vhost_vdpa_net_load_mq(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    uint16_t table_len;
+    uint8_t *buf, *p;
+    size_t size;
+    int i, r;
+
+    /* The RSS configuration sets the number of queue pairs too */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_MQ) &&
+        !(rss->enabled && rss->redirect)) {
+        struct virtio_net_ctrl_mq mq;
+
+        stw_le_p(&mq.virtqueue_pairs, n->curr_queues);
+        r = vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_MQ,
+                                    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                                    &mq, sizeof(mq));
+        if (r < 0) {
+            return r;
+        }
+    }
+
+    if (!rss->enabled) {
+        return 0;
+    }
+
+    /*
+     * struct virtio_net_rss_config, which VIRTIO_NET_CTRL_MQ_HASH_CONFIG
+     * shares with a single-entry table.  virtio-net does not keep the
+     * length of the key, so send all of it.
+     */
+    table_len = rss->redirect ? rss->indirections_len : 1;
+    size = offsetof(struct virtio_net_rss_config, indirection_table) +
+           table_len * sizeof(uint16_t) + sizeof(uint16_t) + 1 +
+           VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    buf = p = g_malloc0(size);
+    stl_le_p(p, rss->hash_types);
+    p += sizeof(uint32_t);
+    stw_le_p(p, rss->redirect ? table_len - 1 : 0);
+    p += sizeof(uint16_t);
+    stw_le_p(p, rss->redirect ? rss->default_queue : 0);
+    p += sizeof(uint16_t);
+    for (i = 0; i < table_len; i++) {
+        stw_le_p(p, rss->redirect ? rss->indirections_table[i] : 0);
+        p += sizeof(uint16_t);
+    }
+    stw_le_p(p, rss->redirect ? n->curr_queues : 0);
+    p += sizeof(uint16_t);
+    *p++ = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    memcpy(p, rss->key, VIRTIO_NET_RSS_MAX_KEY_SIZE);
+
+    r = vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_MQ,
+                                rss->redirect ?
+                                VIRTIO_NET_CTRL_MQ_RSS_CONFIG :
+                                VIRTIO_NET_CTRL_MQ_HASH_CONFIG,
+                                buf, size);
+    g_free(buf);
+    return r;
+}
+
+static int vhost_vdpa_net_load_offloads(VhostVDPAState *s, VirtIONet *n)
+{
+    uint64_t offloads;
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(n),
+                                 VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
+        return 0;
+    }
+
+    stq_le_p(&offloads, n->curr_guest_offloads);
+    return vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_GUEST_OFFLOADS,
+                                   VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
+                                   &offloads, sizeof(offloads));
+}
+
+static int vhost_vdpa_net_load_rx_mode(VhostVDPAState *s, uint8_t cmd,
+                                       uint8_t on)
+{
+    return vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_RX, cmd,
+                                   &on, sizeof(on));
+}
+
+/*
+ * Like virtio_net_reset(), a reset device is in promiscuous mode, and has
+ * all other modes off.  Only send the modes that differ.
+ */
+static int vhost_vdpa_net_load_rx(VhostVDPAState *s, VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int r = 0;
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX)) {
+        if (!n->promisc) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_PROMISC, 0);
+        }
+        if (!r && n->allmulti) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_ALLMULTI, 1);
+        }
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_RX_EXTRA)) {
+        if (!r && n->alluni) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_ALLUNI, 1);
+        }
+        if (!r && n->nomulti) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_NOMULTI, 1);
+        }
+        if (!r && n->nouni) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_NOUNI, 1);
+        }
+        if (!r && n->nobcast) {
+            r = vhost_vdpa_net_load_rx_mode(s, VIRTIO_NET_CTRL_RX_NOBCAST, 1);
+        }
+    }
+
+    return r;
+}
+
+static int vhost_vdpa_net_load_vlan(VhostVDPAState *s, VirtIONet *n)
+{
+    uint16_t vid;
+    int r;
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(n), VIRTIO_NET_F_CTRL_VLAN)) {
+        return 0;
+    }
+
+    /* A reset device filters all VLANs */
+    for (vid = 0; vid < MAX_VLAN; vid++) {
+        uint16_t data;
+
+        if (!(n->vlans[vid >> 5] & (1U << (vid & 0x1f)))) {
+            continue;
+        }
+        stw_le_p(&data, vid);
+        r = vhost_vdpa_net_cvq_send(s, VIRTIO_NET_CTRL_VLAN,
+                                    VIRTIO_NET_CTRL_VLAN_ADD,
+                                    &data, sizeof(data));
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The device loses the state that the guest set through the control
+ * virtqueue whenever it is reset, i.e. on every stop, and a migration
+ * destination never had it.  Send it again from the virtio-net model.
+ *
+ * Only the shadow control virtqueue lets QEMU send commands of its own;
+ * without it, migration is blocked anyway.
+ */
+static int vhost_vdpa_net_cvq_load(NetClientState *nc)
+{
+    VhostVDPAState *s = DO_UPCAST(VhostVDPAState, nc, nc);
+    VirtIONet *n;
+    int r;
+
+    if (!s->vhost_vdpa.shadow_vqs_enabled) {
+        return 0;
+    }
+
+    n = VIRTIO_NET(s->vhost_vdpa.dev->vdev);
+    r = vhost_vdpa_net_load_mac(s, n);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_vdpa_net_load_mq(s, n);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_vdpa_net_load_offloads(s, n);
+    if (r < 0) {
+        return r;
+    }
+    r = vhost_vdpa_net_load_rx(s, n);
+    if (r < 0) {
+        return r;
+    }
+    return vhost_vdpa_net_load_vlan(s, n);
+}
+
+static NetClientInfo net_vhost_vdpa_cvq_info = {
+        .type = NET_CLIENT_DRIVER_VHOST_VDPA,
+        .size = sizeof(VhostVDPAState),
+        .cleanup = vhost_vdpa_cleanup,
+        .has_vnet_hdr = vhost_vdpa_has_vnet_hdr,
+        .has_ufo = vhost_vdpa_has_ufo,
+        .load = vhost_vdpa_net_cvq_load,
+};
+
+/*
+ * On failure the net client is deleted along with the ones already created
+ * for the same device, which closes @vdpa_device_fd.
+ */
+static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
+                                           const char *device,
+                                           const char *name,
+                                           int vdpa_device_fd,
+                                           int queue_pair_index,
+                                           int nvqs,
+                                           bool is_datapath,
+                                           bool svq,
+                                           struct vhost_vdpa_iova_range
+                                           iova_range)
 {
     NetClientState *nc = NULL;
     VhostVDPAState *s;
-    int vdpa_device_fd = -1;
     int ret = 0;
     assert(name);
-    nc = qemu_new_net_client(&net_vhost_vdpa_info, peer, device, name);
+    if (is_datapath) {
+        nc = qemu_new_net_client(&net_vhost_vdpa_info, peer, device, name);
+    } else {
+        nc = qemu_new_net_control_client(&net_vhost_vdpa_cvq_info, peer,
+                                         device, name);
+    }
     snprintf(nc->info_str, sizeof(nc->info_str), TYPE_VHOST_VDPA);
-    nc->queue_index = 0;
+    nc->queue_index = queue_pair_index;
     s = DO_UPCAST(VhostVDPAState, nc, nc);
-    vdpa_device_fd = qemu_open_old(vhostdev, O_RDWR);
-    if (vdpa_device_fd == -1) {
+    s->vhost_vdpa.device_fd = vdpa_device_fd;
+    s->vhost_vdpa.index = queue_pair_index;
+    s->vhost_vdpa.shadow_vqs_enabled = svq;
+    s->vhost_vdpa.iova_range = iova_range;
+    if (!is_datapath) {
+        s->vhost_vdpa.shadow_vq_ops = &vhost_vdpa_net_cvq_ops;
+        s->vhost_vdpa.shadow_vq_ops_opaque = s;
+    }
+    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa, nvqs);
+    if (ret) {
+        qemu_del_net_client(nc);
+        return NULL;
+    }
+    return nc;
+}
+
+/*
+ * Returns the number of queue pairs of the device, and whether it has a
+ * control virtqueue in @has_cvq.
+ */
+static int vhost_vdpa_get_max_queue_pairs(int fd, bool *has_cvq,
+                                          Error **errp)
+{
+    unsigned long config_size = offsetof(struct vhost_vdpa_config, buf);
+    struct vhost_vdpa_config *config;
+    uint64_t features;
+    int ret;
+
+    ret = ioctl(fd, VHOST_GET_FEATURES, &features);
+    if (ret) {
+        error_setg_errno(errp, errno, "Failed to query the features of the "
+                         "vhost-vdpa device");
         return -errno;
     }
-    s->vhost_vdpa.device_fd = vdpa_device_fd;
-    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa);
-    assert(s->vhost_net);
+
+    *has_cvq = features & (1ULL << VIRTIO_NET_F_CTRL_VQ);
+    if (!(features & (1ULL << VIRTIO_NET_F_MQ))) {
+        return 1;
+    }
+
+    config = g_malloc0(config_size + sizeof(uint16_t));
+    config->off = offsetof(struct virtio_net_config, max_virtqueue_pairs);
+    config->len = sizeof(uint16_t);
+    ret = ioctl(fd, VHOST_VDPA_GET_CONFIG, config);
+    if (ret) {
+        error_setg_errno(errp, errno, "Failed to read the config of the "
+                         "vhost-vdpa device");
+        g_free(config);
+        return -errno;
+    }
+
+    ret = lduw_le_p(config->buf);
+    g_free(config);
     return ret;
 }
 
+static void vhost_vdpa_get_iova_range(int fd,
+                                      struct vhost_vdpa_iova_range *iova_range)
+{
+    if (ioctl(fd, VHOST_VDPA_GET_IOVA_RANGE, iova_range)) {
+        /* Older kernels don't tell, and accept any address */
+        iova_range->first = 0;
+        iova_range->last = UINT64_MAX;
+    }
+}
+
 static int net_vhost_check_net(void *opaque, QemuOpts *opts, Error **errp)
 {
     const char *name = opaque;
@@ -221,6 +602,10 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                         NetClientState *peer, Error **errp)
 {
     const NetdevVhostVDPAOptions *opts;
+    const char *vhostdev;
+    struct vhost_vdpa_iova_range iova_range;
+    int vdpa_device_fd, queue_pairs, i;
+    bool has_cvq, svq;
 
     assert(netdev->type == NET_CLIENT_DRIVER_VHOST_VDPA);
     opts = &netdev->u.vhost_vdpa;
@@ -229,5 +614,55 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                           (char *)name, errp)) {
         return -1;
     }
-    return net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, opts->vhostdev);
+
+    vhostdev = opts->has_vhostdev ? opts->vhostdev : "/dev/vhost-vdpa-0";
+    vdpa_device_fd = qemu_open_old(vhostdev, O_RDWR);
+    if (vdpa_device_fd == -1) {
+        error_setg_errno(errp, errno, "Failed to open %s", vhostdev);
+        return -errno;
+    }
+
+    queue_pairs = vhost_vdpa_get_max_queue_pairs(vdpa_device_fd, &has_cvq,
+                                                 errp);
+    if (queue_pairs < 0) {
+        qemu_close(vdpa_device_fd);
+        return queue_pairs;
+    }
+    if (queue_pairs < 1 || queue_pairs > MAX_QUEUE_NUM - 1) {
+        error_setg(errp, "vhost-vdpa device %s has an invalid number of "
+                   "queue pairs: %d", vhostdev, queue_pairs);
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+    if (opts->has_queues && opts->queues != queue_pairs) {
+        error_setg(errp, "vhost-vdpa device %s has %d queue pairs, "
+                   "queues=%" PRId64 " does not match", vhostdev,
+                   queue_pairs, opts->queues);
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+
+    vhost_vdpa_get_iova_range(vdpa_device_fd, &iova_range);
+    svq = opts->has_x_svq && opts->x_svq;
+
+    for (i = 0; i < queue_pairs; i++) {
+        if (!net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, vdpa_device_fd,
+                                 i, 2, true, svq, iova_range)) {
+            goto err;
+        }
+    }
+
+    if (has_cvq) {
+        if (!net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, vdpa_device_fd,
+                                 i, 1, false, svq, iova_range)) {
+            goto err;
+        }
+    }
+
+    return 0;
+
+err:
+    error_setg(errp, "Failed to initialize vhost-vdpa device %s",
+               vhostdev);
+    return -1;
 }
@@ -41,6 +41,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "qemu/units.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
@@ -82,6 +83,7 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_REPLAY = 277,
 };
 
 typedef enum OutputFormat {
@@ -1616,7 +1618,7 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1628,7 +1630,10 @@ typedef struct ImgConvertState {
     int64_t allocated_sectors;
     int64_t allocated_done;
     int64_t sector_num;
-    int64_t wr_offs;
+    /* Requests are numbered in the order their ranges are claimed */
+    uint64_t req_seq;
+    /* Number of the request that may write next when writing in order */
+    uint64_t wr_seq;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
     BlockBackend *target;
@@ -1648,7 +1653,8 @@ typedef struct ImgConvertState {
     long num_coroutines;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    /* Coroutine waiting to write request n, at index n % MAX_COROUTINES */
+    Coroutine *wr_waiter[MAX_COROUTINES];
     CoMutex lock;
     int ret;
 } ImgConvertState;
@@ -1920,10 +1926,55 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Compress the data for a compressed target before the request waits for
+ * its turn to write, so that all coroutines compress in parallel even when
+ * writes are kept in order.  Returns the compressed size, 0 if the data is
+ * to be written by convert_co_write(), -ENOSPC if it does not compress, or
+ * another negative errno on failure.
+ */
+static int coroutine_fn convert_co_compress(ImgConvertState *s,
+                                            int64_t sector_num, int nb_sectors,
+                                            uint8_t *buf, uint8_t *out_buf)
+{
+    int ret;
+
+    /* Zeroes are not written, see convert_co_write() */
+    if (s->min_sparse && buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+        return 0;
+    }
+
+    ret = blk_co_compress(s->target, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, buf,
+                          out_buf, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (ret == -ENOTSUP) {
+        /* The driver compresses as part of the write */
+        return 0;
+    }
+    return ret;
+}
+
+/* Write data that convert_co_compress() has compressed */
+static int coroutine_fn
+convert_co_write_compressed(ImgConvertState *s, int64_t sector_num,
+                            int nb_sectors, uint8_t *buf,
+                            uint8_t *out_buf, int out_len)
+{
+    if (out_len == -ENOSPC) {
+        return blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                             nb_sectors << BDRV_SECTOR_BITS, buf, 0);
+    }
+    return blk_co_pwrite_precompressed(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       nb_sectors << BDRV_SECTOR_BITS,
+                                       out_buf, out_len);
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    uint8_t *compressed_buf = NULL;
     int ret, i;
     int index = -1;
 
@@ -1937,12 +1988,17 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->compressed) {
+        compressed_buf = g_malloc(s->buf_sectors * BDRV_SECTOR_SIZE);
+    }
 
     while (1) {
         int n;
         int64_t sector_num;
+        uint64_t seq;
         enum ImgConvertBlockStatus status;
         bool copy_range;
+        int compressed_len = 0;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1964,6 +2020,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
+        seq = s->req_seq++;
         qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
@@ -1986,13 +2043,24 @@ retry:
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
+        if (s->compressed && status == BLK_DATA && s->ret == -EINPROGRESS) {
+            compressed_len = convert_co_compress(s, sector_num, n, buf,
+                                                 compressed_buf);
+            if (compressed_len < 0 && compressed_len != -ENOSPC) {
+                error_report("error while compressing at byte %lld: %s",
+                             sector_num * BDRV_SECTOR_SIZE,
+                             strerror(-compressed_len));
+                s->ret = compressed_len;
+            }
+        }
+
         if (s->wr_in_order) {
             /* keep writes in order */
-            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
-                s->wait_sector_num[index] = sector_num;
+            while (s->wr_seq != seq && s->ret == -EINPROGRESS) {
+                s->wr_waiter[seq % MAX_COROUTINES] = qemu_coroutine_self();
                 qemu_coroutine_yield();
             }
-            s->wait_sector_num[index] = -1;
+            s->wr_waiter[seq % MAX_COROUTINES] = NULL;
         }
 
         if (s->ret == -EINPROGRESS) {
@@ -2002,6 +2070,10 @@ retry:
                     s->copy_range = false;
                     goto retry;
                 }
+            } else if (compressed_len) {
+                ret = convert_co_write_compressed(s, sector_num, n, buf,
+                                                  compressed_buf,
+                                                  compressed_len);
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
             }
@@ -2013,24 +2085,26 @@ retry:
         }
 
         if (s->wr_in_order) {
-            /* reenter the coroutine that might have waited
-             * for this write to complete */
-            s->wr_offs = sector_num + n;
-            for (i = 0; i < s->num_coroutines; i++) {
-                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
-                    /*
-                     * A -> B -> A cannot occur because A has
-                     * s->wait_sector_num[i] == -1 during A -> B.  Therefore
-                     * B will never enter A during this time window.
-                     */
-                    qemu_coroutine_enter(s->co[i]);
-                    break;
-                }
+            /*
+             * Reenter the coroutine that might have waited for this write
+             * to complete.  At most num_coroutines requests are claimed and
+             * not yet written, so the next one has its own waiter slot.
+             * A -> B -> A cannot occur because A has cleared its slot
+             * during A -> B.  Therefore B will never enter A during this
+             * time window.
+             */
+            Coroutine *co;
+
+            s->wr_seq = seq + 1;
+            co = s->wr_waiter[s->wr_seq % MAX_COROUTINES];
+            if (co) {
+                qemu_coroutine_enter(co);
             }
         }
     }
 
     qemu_vfree(buf);
+    g_free(compressed_buf);
     s->co[index] = NULL;
     s->running_coroutines--;
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
@@ -2079,7 +2153,6 @@ static int convert_do_copy(ImgConvertState *s)
     qemu_co_mutex_init(&s->lock);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
-        s->wait_sector_num[i] = -1;
         qemu_coroutine_enter(s->co[i]);
     }
 
@@ -4261,13 +4334,319 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+typedef enum BenchOp {
+    BENCH_OP_READ,
+    BENCH_OP_WRITE,
+    BENCH_OP_DISCARD,
+    BENCH_OP_FLUSH,
+} BenchOp;
+
+typedef struct BenchTraceEntry {
+    BenchOp op;
+    int64_t offset;
+    int64_t bytes;
+} BenchTraceEntry;
+
+typedef struct BenchReplay BenchReplay;
+
+typedef struct BenchReplayReq {
+    BenchReplay *r;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    int64_t start_ns;
+} BenchReplayReq;
+
+struct BenchReplay {
+    BlockBackend *blk;
+    BenchTraceEntry *trace;
+    int nb_entries;
+    int next_entry;
+    int remaining;
+    int in_flight;
+    int depth;
+
+    BenchReplayReq *reqs;
+    BenchReplayReq **free_reqs;
+    int nb_free_reqs;
+
+    int64_t *latencies;
+    int nb_latencies;
+};
+
+/*
+ * Parse an I/O trace for qemu-img bench --replay.  Each line contains one
+ * request: "r OFFSET BYTES", "w OFFSET BYTES", "d OFFSET BYTES" (discard) or
+ * "f" (flush).  Empty lines and lines starting with '#' are ignored.
+ */
+static int bench_parse_trace(const char *filename, int64_t image_size,
+                             BenchTraceEntry **entries, int *nb_entries,
+                             int64_t *max_bytes, bool *has_writes)
+{
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    GError *gerr = NULL;
+    GArray *trace;
+    int i;
+
+    if (!g_file_get_contents(filename, &contents, NULL, &gerr)) {
+        error_report("Could not read trace file: %s", gerr->message);
+        g_error_free(gerr);
+        return -1;
+    }
+
+    *max_bytes = 0;
+    *has_writes = false;
+    trace = g_array_new(false, false, sizeof(BenchTraceEntry));
+    lines = g_strsplit(contents, "\n", -1);
+
+    for (i = 0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        BenchTraceEntry e = {};
+        const char *p;
+
+        if (!*line || *line == '#') {
+            continue;
+        }
+
+        switch (*line) {
+        case 'r':
+            e.op = BENCH_OP_READ;
+            break;
+        case 'w':
+            e.op = BENCH_OP_WRITE;
+            break;
+        case 'd':
+            e.op = BENCH_OP_DISCARD;
+            break;
+        case 'f':
+            e.op = BENCH_OP_FLUSH;
+            break;
+        default:
+            goto fail;
+        }
+
+        if (e.op != BENCH_OP_FLUSH) {
+            if (qemu_strtoi64(line + 1, &p, 0, &e.offset) < 0 ||
+                qemu_strtoi64(p, NULL, 0, &e.bytes) < 0 ||
+                e.offset < 0 || e.bytes <= 0 ||
+                e.bytes > BDRV_REQUEST_MAX_BYTES) {
+                goto fail;
+            }
+            if (e.offset > image_size - e.bytes) {
+                error_report("Trace line %d: request beyond the end of the "
+                             "image", i + 1);
+                g_array_free(trace, true);
+                return -1;
+            }
+        } else if (line[1]) {
+            goto fail;
+        }
+
+        if (e.op == BENCH_OP_READ || e.op == BENCH_OP_WRITE) {
+            *max_bytes = MAX(*max_bytes, e.bytes);
+        }
+        if (e.op != BENCH_OP_READ) {
+            *has_writes = true;
+        }
+        g_array_append_val(trace, e);
+    }
+
+    if (!trace->len) {
+        error_report("Trace file contains no requests");
+        g_array_free(trace, true);
+        return -1;
+    }
+
+    *nb_entries = trace->len;
+    *entries = (BenchTraceEntry *)g_array_free(trace, false);
+    return 0;
+
+fail:
+    error_report("Trace line %d: invalid request '%s'", i + 1, lines[i]);
+    g_array_free(trace, true);
+    return -1;
+}
+
+static void bench_replay_submit(BenchReplay *r);
+
+static void bench_replay_cb(void *opaque, int ret)
+{
+    BenchReplayReq *req = opaque;
+    BenchReplay *r = req->r;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    r->latencies[r->nb_latencies++] = get_clock() - req->start_ns;
+    r->free_reqs[r->nb_free_reqs++] = req;
+    r->in_flight--;
+
+    bench_replay_submit(r);
+}
+
+static void bench_replay_submit(BenchReplay *r)
+{
+    while (r->remaining > 0 && r->in_flight < r->depth) {
+        BenchTraceEntry *e = &r->trace[r->next_entry];
+        BenchReplayReq *req = r->free_reqs[--r->nb_free_reqs];
+        BlockAIOCB *acb;
+
+        /* The request may complete right away, so update the state first */
+        r->next_entry = (r->next_entry + 1) % r->nb_entries;
+        r->remaining--;
+        r->in_flight++;
+        req->start_ns = get_clock();
+
+        switch (e->op) {
+        case BENCH_OP_READ:
+            qemu_iovec_init_buf(&req->qiov, req->buf, e->bytes);
+            acb = blk_aio_preadv(r->blk, e->offset, &req->qiov, 0,
+                                 bench_replay_cb, req);
+            break;
+        case BENCH_OP_WRITE:
+            qemu_iovec_init_buf(&req->qiov, req->buf, e->bytes);
+            acb = blk_aio_pwritev(r->blk, e->offset, &req->qiov, 0,
+                                  bench_replay_cb, req);
+            break;
+        case BENCH_OP_DISCARD:
+            acb = blk_aio_pdiscard(r->blk, e->offset, e->bytes,
+                                   bench_replay_cb, req);
+            break;
+        case BENCH_OP_FLUSH:
+            acb = blk_aio_flush(r->blk, bench_replay_cb, req);
+            break;
+        default:
+            abort();
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static int bench_cmp_latency(const void *a, const void *b)
+{
+    int64_t l1 = *(const int64_t *)a;
+    int64_t l2 = *(const int64_t *)b;
+
+    return l1 < l2 ? -1 : l1 > l2;
+}
+
+static double bench_percentile_us(int64_t *sorted, int n, double p)
+{
+    int i = MIN(n - 1, (int)(n * p / 100));
+
+    return sorted[i] / 1000.0;
+}
+
+/* Replay the I/O trace in @trace_file against @blk and print statistics */
+static int bench_replay(BlockBackend *blk, int64_t image_size,
+                        const char *trace_file, int count, int depth,
+                        bool is_write, int pattern)
+{
+    BenchReplay r = {};
+    int64_t max_bytes, total_ns, sum_ns = 0;
+    bool has_writes;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    int i, ret;
+
+    ret = bench_parse_trace(trace_file, image_size, &r.trace, &r.nb_entries,
+                            &max_bytes, &has_writes);
+    if (ret < 0) {
+        return ret;
+    }
+    if (has_writes && !is_write) {
+        error_report("The trace contains writes, discards or flushes, "
+                     "use -w to replay it");
+        g_free(r.trace);
+        return -1;
+    }
+
+    r = (BenchReplay) {
+        .blk        = blk,
+        .trace      = r.trace,
+        .nb_entries = r.nb_entries,
+        .remaining  = count > 0 ? count : r.nb_entries,
+        .depth      = depth,
+    };
+    r.reqs = g_new0(BenchReplayReq, depth);
+    r.free_reqs = g_new(BenchReplayReq *, depth);
+
+    /* Both sizes come from the command line and the trace */
+    max_bytes = MAX(max_bytes, BDRV_SECTOR_SIZE);
+    if (max_bytes <= SIZE_MAX / depth) {
+        buf_size = depth * max_bytes;
+        buf = blk_try_blockalign(blk, buf_size);
+    }
+    r.latencies = g_try_new(int64_t, r.remaining);
+    if (!buf || !r.latencies) {
+        error_report("Could not allocate buffers for %d requests of up to "
+                     "%" PRId64 " bytes: %s", depth, max_bytes,
+                     strerror(ENOMEM));
+        qemu_vfree(buf);
+        g_free(r.latencies);
+        g_free(r.free_reqs);
+        g_free(r.reqs);
+        g_free(r.trace);
+        return -ENOMEM;
+    }
+    memset(buf, pattern, buf_size);
+    blk_register_buf(blk, buf, buf_size);
+
+    for (i = 0; i < depth; i++) {
+        r.reqs[i].r = &r;
+        r.reqs[i].buf = buf + i * max_bytes;
+        r.free_reqs[r.nb_free_reqs++] = &r.reqs[i];
+    }
+
+    printf("Replaying %d requests from '%s' (%d trace entries), "
+           "%d in parallel\n", r.remaining, trace_file, r.nb_entries, depth);
+
+    total_ns = get_clock();
+    bench_replay_submit(&r);
+    while (r.remaining > 0 || r.in_flight > 0) {
+        main_loop_wait(false);
+    }
+    total_ns = get_clock() - total_ns;
+
+    printf("Run completed in %3.3f seconds (%.0f requests/s).\n",
+           total_ns / 1e9, r.nb_latencies / (total_ns / 1e9));
+
+    qsort(r.latencies, r.nb_latencies, sizeof(r.latencies[0]),
+          bench_cmp_latency);
+    for (i = 0; i < r.nb_latencies; i++) {
+        sum_ns += r.latencies[i];
+    }
+    printf("Latency (us): min %.1f avg %.1f p50 %.1f p90 %.1f p99 %.1f "
+           "p99.9 %.1f max %.1f\n",
+           r.latencies[0] / 1000.0, sum_ns / 1000.0 / r.nb_latencies,
+           bench_percentile_us(r.latencies, r.nb_latencies, 50),
+           bench_percentile_us(r.latencies, r.nb_latencies, 90),
+           bench_percentile_us(r.latencies, r.nb_latencies, 99),
+           bench_percentile_us(r.latencies, r.nb_latencies, 99.9),
+           r.latencies[r.nb_latencies - 1] / 1000.0);
+
+    blk_unregister_buf(blk, buf);
+    qemu_vfree(buf);
+    g_free(r.latencies);
+    g_free(r.free_reqs);
+    g_free(r.reqs);
+    g_free(r.trace);
+    return 0;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
-    const char *fmt = NULL, *filename;
+    const char *fmt = NULL, *filename, *replay_file = NULL;
     bool quiet = false;
     bool image_opts = false;
     bool is_write = false;
+    bool count_set = false;
     int count = 75000;
     int depth = 64;
     int64_t offset = 0;
@@ -4293,6 +4672,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"replay", required_argument, 0, OPTION_REPLAY},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4321,6 +4701,7 @@ static int img_bench(int argc, char **argv)
                 return 1;
             }
             count = res;
+            count_set = true;
             break;
         }
         case 'd':
@@ -4424,6 +4805,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_REPLAY:
+            replay_file = optarg;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4445,6 +4829,17 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (replay_file && (flush_interval || offset || step)) {
+        error_report("--replay can't be combined with --flush-interval, "
+                     "-o or -S");
+        ret = -1;
+        goto out;
+    }
+    if (depth < 1) {
+        error_report("Queue depth must be at least 1");
+        ret = -1;
+        goto out;
+    }
 
     blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
                    force_share);
@@ -4459,6 +4854,12 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
+    if (replay_file) {
+        ret = bench_replay(blk, image_size, replay_file,
+                           count_set ? count : 0, depth, is_write, pattern);
+        goto out;
+    }
+
     data = (BenchData) {
         .blk            = blk,
         .image_size     = image_size,
@@ -99,7 +99,7 @@ static void help(void)
 "                         (requires --nbd-server)\n"
 "\n"
 "  --export [type=]fuse,id=<id>,node-name=<node-name>,mountpoint=<file>\n"
-"           [,growable=on|off][,writable=on|off]\n"
+"           [,growable=on|off][,writable=on|off][,zero-copy=on|off]\n"
 "                         export the specified block node over FUSE\n"
 "\n"
 "  --monitor [chardev=]name[,mode=control][,pretty[=on|off]]\n"
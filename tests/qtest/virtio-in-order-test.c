@@ -0,0 +1,176 @@
+/*
+ * QTest testcase for VIRTIO_F_IN_ORDER migration
+ *
+ * Copyright (c) 2021 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+#define PCI_SLOT                0x04
+
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER       35
+#endif
+
+static char *tmp_path;
+static char *debug_path;
+static char *mig_socket;
+
+typedef struct QVirtioBlkReq {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} QVirtioBlkReq;
+
+static QOSState *in_order_boot(const char *drive, const char *extra)
+{
+    return qtest_pc_boot("-drive if=none,id=drive0,file=%s,format=raw,"
+                         "werror=stop,rerror=stop "
+                         "-device virtio-blk-pci,drive=drive0,addr=%x.0,"
+                         "in_order=on %s",
+                         drive, PCI_SLOT, extra);
+}
+
+/* Queue a 512 byte write of @sector, returns the head descriptor */
+static uint32_t in_order_write(QOSState *qs, QVirtioDevice *d, QVirtQueue *vq,
+                               uint64_t sector, uint64_t *req_addr)
+{
+    QVirtioBlkReq req = {
+        .type = cpu_to_le32(VIRTIO_BLK_T_OUT),
+        .sector = cpu_to_le64(sector),
+    };
+    uint8_t status = 0xff;
+    uint32_t free_head;
+    uint64_t addr;
+
+    addr = qmalloc(qs, sizeof(req) + 512 + 1);
+    qtest_memwrite(qs->qts, addr, &req, sizeof(req));
+    qtest_memset(qs->qts, addr + 16, sector & 0xff, 512);
+    qtest_memwrite(qs->qts, addr + 528, &status, sizeof(status));
+
+    free_head = qvirtqueue_add(qs->qts, vq, addr, 16, false, true);
+    qvirtqueue_add(qs->qts, vq, addr + 16, 512, false, true);
+    qvirtqueue_add(qs->qts, vq, addr + 528, 1, true, false);
+    qvirtqueue_kick(qs->qts, d, vq, free_head);
+
+    *req_addr = addr;
+    return free_head;
+}
+
+/*
+ * The first of two writes fails and stops the VM, while the second one
+ * completes.  With VIRTIO_F_IN_ORDER, the second buffer cannot be returned
+ * to the driver before the first one, so it is migrated as filled but not
+ * yet used.  After resuming on the destination, the first write is retried
+ * and both buffers must be used, in order.
+ */
+static void test_migrate_filled(void)
+{
+    QOSState *src, *dst;
+    QVirtioPCIDevice *dev;
+    QVirtQueue *vq;
+    uint64_t features;
+    uint64_t addr[2];
+    uint32_t head[2];
+    uint32_t desc_idx;
+    char *drive = g_strdup_printf("blkdebug:%s:%s", debug_path, tmp_path);
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+    char *incoming = g_strdup_printf("-incoming %s", uri);
+
+    prepare_blkdebug_script(debug_path, "write_aio");
+
+    src = in_order_boot(drive, "");
+    dst = in_order_boot(tmp_path, incoming);
+
+    dev = virtio_pci_new(src->pcibus,
+                         &(QPCIAddress) { .devfn = QPCI_DEVFN(PCI_SLOT, 0) });
+    g_assert_nonnull(dev);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_start_device(&dev->vdev);
+
+    features = qvirtio_get_features(&dev->vdev);
+    g_assert(features & (1ull << VIRTIO_F_IN_ORDER));
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                  (1ull << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+
+    vq = qvirtqueue_setup(&dev->vdev, &src->alloc, 0);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    /* Not adjacent, so that virtio-blk does not merge them */
+    head[0] = in_order_write(src, &dev->vdev, vq, 0, &addr[0]);
+    head[1] = in_order_write(src, &dev->vdev, vq, 8, &addr[1]);
+    qtest_qmp_eventwait(src->qts, "STOP");
+
+    /* The second write waits for the first one */
+    g_assert(!qvirtqueue_get_buf(src->qts, vq, &desc_idx, NULL));
+
+    migrate(src, dst, uri);
+    dev->pdev->bus = dst->pcibus;
+
+    qtest_qmp_send(dst->qts, "{'execute':'cont' }");
+    qtest_qmp_eventwait(dst->qts, "RESUME");
+
+    qvirtio_wait_used_elem(dst->qts, &dev->vdev, vq, head[0], NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert(qvirtqueue_get_buf(dst->qts, vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, head[1]);
+
+    g_assert_cmpint(qtest_readb(dst->qts, addr[0] + 528), ==, 0);
+    g_assert_cmpint(qtest_readb(dst->qts, addr[1] + 528), ==, 0);
+
+    qvirtqueue_cleanup(dev->vdev.bus, vq, &dst->alloc);
+    qvirtio_pci_destructor(&dev->obj);
+    g_free(dev);
+    qtest_shutdown(src);
+    qtest_shutdown(dst);
+    g_free(incoming);
+    g_free(uri);
+    g_free(drive);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    debug_path = g_strdup("/tmp/qtest-blkdebug.XXXXXX");
+    fd = mkstemp(debug_path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    mig_socket = g_strdup_printf("/tmp/qtest-migration.%d", getpid());
+
+    qtest_add_func("/virtio/in-order/migrate-filled", test_migrate_filled);
+
+    ret = g_test_run();
+
+    unlink(tmp_path);
+    unlink(debug_path);
+    unlink(mig_socket);
+    g_free(tmp_path);
+    g_free(debug_path);
+    g_free(mig_socket);
+
+    return ret;
+}
@@ -10,8 +10,15 @@
 #include "qemu/osdep.h"
 #include "libqtest-single.h"
 #include "qemu/module.h"
+#include "hw/virtio/virtio.h"
+#include "standard-headers/linux/virtio_console.h"
 #include "libqos/virtio-serial.h"
 
+#define QVIRTIO_SERIAL_TIMEOUT_US (30 * 1000 * 1000)
+
+/* Larger than what the socket can buffer, so that the port gets throttled */
+#define THROTTLE_BUF_SIZE (4 * 1024 * 1024)
+
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void virtio_serial_nop(void *obj, void *data, QGuestAllocator *alloc)
 {
@@ -24,6 +31,104 @@ static void serial_hotplug(void *obj, void *data, QGuestAllocator *alloc)
     qtest_qmp_device_del(global_qtest, "hp-port");
 }
 
+#ifndef _WIN32
+
+/*
+ * With VIRTIO_F_IN_ORDER, a buffer that the device detaches must still be
+ * used, or the buffers after it are never returned.  virtio-serial detaches
+ * the buffer of a throttled port when the host side of the port is closed.
+ */
+static void serial_in_order_detach(void *obj, void *data,
+                                   QGuestAllocator *alloc)
+{
+    QVirtioSerial *serial = obj;
+    QVirtioDevice *dev = serial->vdev;
+    QTestState *qts = global_qtest;
+    int *sv = data;
+    uint64_t features;
+    QVirtQueue *vq;
+    uint64_t big_addr, small_addr;
+    uint32_t big_head, small_head, desc_idx, len;
+    char byte;
+
+    features = qvirtio_get_features(dev);
+    if (!(features & (1ull << VIRTIO_F_IN_ORDER))) {
+        g_test_skip("VIRTIO_F_IN_ORDER not available");
+        return;
+    }
+    features &= (1ull << VIRTIO_F_VERSION_1) |
+                (1ull << VIRTIO_F_IN_ORDER) |
+                (1ull << VIRTIO_CONSOLE_F_MULTIPORT);
+    qvirtio_set_features(dev, features);
+
+    /* Transmit queue of port 1 */
+    vq = qvirtqueue_setup(dev, alloc, 5);
+    qvirtio_set_driver_ok(dev);
+
+    big_addr = guest_alloc(alloc, THROTTLE_BUF_SIZE);
+    big_head = qvirtqueue_add(qts, vq, big_addr, THROTTLE_BUF_SIZE,
+                              false, false);
+    qvirtqueue_kick(qts, dev, vq, big_head);
+
+    /*
+     * Wait until the port has started writing the first buffer.  As long as
+     * the rest of it does not fit in the socket, the port stays throttled.
+     */
+    g_assert_cmpint(recv(sv[0], &byte, 1, 0), ==, 1);
+
+    small_addr = guest_alloc(alloc, 64);
+    small_head = qvirtqueue_add(qts, vq, small_addr, 64, false, false);
+    qvirtqueue_kick(qts, dev, vq, small_head);
+
+    /* Closing the host side detaches it and drops the queued buffer */
+    close(sv[0]);
+    sv[0] = -1;
+
+    qvirtio_wait_used_elem(qts, dev, vq, big_head, &len,
+                           QVIRTIO_SERIAL_TIMEOUT_US);
+    g_assert_cmpint(len, ==, 0);
+    g_assert(qvirtqueue_get_buf(qts, vq, &desc_idx, NULL));
+    g_assert_cmpint(desc_idx, ==, small_head);
+
+    guest_free(alloc, small_addr);
+    guest_free(alloc, big_addr);
+    qvirtqueue_cleanup(dev->bus, vq, alloc);
+}
+
+static void virtio_serial_socket_cleanup(void *sockets)
+{
+    int *sv = sockets;
+
+    if (sv[0] >= 0) {
+        close(sv[0]);
+    }
+    qos_invalidate_command_line();
+    close(sv[1]);
+    g_free(sv);
+}
+
+static void *virtio_serial_socket_setup(GString *cmd_line, void *arg)
+{
+    int ret;
+    int *sv = g_new(int, 2);
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+    /* The test closes its end, QEMU must not keep a copy of it */
+    qemu_set_cloexec(sv[0]);
+
+    g_string_append_printf(cmd_line,
+                           " -global virtio-serial-device.in_order=on"
+                           " -chardev socket,id=cs0,fd=%d"
+                           " -device virtserialport,bus=vser0.0,nr=1,"
+                           "chardev=cs0 ", sv[1]);
+
+    g_test_queue_destroy(virtio_serial_socket_cleanup, sv);
+    return sv;
+}
+
+#endif
+
 static void register_virtio_serial_test(void)
 {
     QOSGraphTestOptions opts = { };
@@ -35,5 +140,12 @@ static void register_virtio_serial_test(void)
     qos_add_test("serialport-nop", "virtio-serial", virtio_serial_nop, &opts);
 
     qos_add_test("hotplug", "virtio-serial", serial_hotplug, NULL);
+
+#ifndef _WIN32
+    opts.edge.before_cmd_line = NULL;
+    opts.before = virtio_serial_socket_setup;
+    qos_add_test("in-order-detach", "virtio-serial", serial_in_order_detach,
+                 &opts);
+#endif
 }
 libqos_init(register_virtio_serial_test);
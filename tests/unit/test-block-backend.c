@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "block/block.h"
+#include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qemu/main-loop.h"
@@ -70,6 +71,409 @@ static void test_drain_all_aio_error(void)
     blk_unref(blk);
 }
 
+typedef struct BDRVMergeTestState {
+    int nb_reads;
+    uint64_t last_bytes;
+    /* Requests in the order they reached the driver */
+    struct {
+        bool is_write;
+        uint64_t offset;
+        uint64_t bytes;
+    } log[8];
+    int nb_log;
+} BDRVMergeTestState;
+
+static void bdrv_merge_test_log(BDRVMergeTestState *s, bool is_write,
+                                uint64_t offset, uint64_t bytes)
+{
+    g_assert_cmpint(s->nb_log, <, ARRAY_SIZE(s->log));
+    s->log[s->nb_log].is_write = is_write;
+    s->log[s->nb_log].offset = offset;
+    s->log[s->nb_log].bytes = bytes;
+    s->nb_log++;
+}
+
+static int coroutine_fn bdrv_merge_test_co_preadv(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  int flags)
+{
+    BDRVMergeTestState *s = bs->opaque;
+
+    s->nb_reads++;
+    s->last_bytes = bytes;
+    bdrv_merge_test_log(s, false, offset, bytes);
+    qemu_iovec_memset(qiov, 0, 0xa5, bytes);
+    return 0;
+}
+
+static int coroutine_fn bdrv_merge_test_co_pwritev(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   int flags)
+{
+    bdrv_merge_test_log(bs->opaque, true, offset, bytes);
+    return 0;
+}
+
+static BlockDriver bdrv_merge_test = {
+    .format_name            = "merge-test",
+    .instance_size          = sizeof(BDRVMergeTestState),
+    .bdrv_co_preadv         = bdrv_merge_test_co_preadv,
+    .bdrv_co_pwritev        = bdrv_merge_test_co_pwritev,
+};
+
+static void test_merge_aio_cb(void *opaque, int ret)
+{
+    int *completed = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    (*completed)++;
+}
+
+static void test_merge_requests(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+    BDRVMergeTestState *s;
+    QEMUIOVector qiov[4];
+    uint8_t buf[4][512];
+    int completed = 0;
+    int i;
+
+    bs = bdrv_new_open_driver(&bdrv_merge_test, "base", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    s = bs->opaque;
+
+    blk_set_request_merging(blk, true);
+
+    /* Adjacent reads submitted while plugged end up in one driver request */
+    blk_io_plug(blk);
+    for (i = 0; i < 4; i++) {
+        memset(buf[i], 0, sizeof(buf[i]));
+        qemu_iovec_init_buf(&qiov[i], buf[i], sizeof(buf[i]));
+        blk_aio_preadv(blk, i * 512, &qiov[i], 0, test_merge_aio_cb,
+                       &completed);
+    }
+    g_assert_cmpint(s->nb_reads, ==, 0);
+    blk_io_unplug(blk);
+
+    blk_drain(blk);
+    g_assert_cmpint(completed, ==, 4);
+    g_assert_cmpint(s->nb_reads, ==, 1);
+    g_assert_cmpint(s->last_bytes, ==, 4 * 512);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmpint(buf[i][0], ==, 0xa5);
+        g_assert_cmpint(buf[i][511], ==, 0xa5);
+    }
+
+    /* Without plugging, requests are submitted right away */
+    completed = 0;
+    s->nb_reads = 0;
+    for (i = 0; i < 2; i++) {
+        blk_aio_preadv(blk, i * 512, &qiov[i], 0, test_merge_aio_cb,
+                       &completed);
+    }
+    blk_drain(blk);
+    g_assert_cmpint(completed, ==, 2);
+    g_assert_cmpint(s->nb_reads, ==, 2);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+/*
+ * Requests are sorted by offset for merging, but never moved across an
+ * overlapping write
+ */
+static void test_merge_requests_overlap(void)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+    BDRVMergeTestState *s;
+    static const struct {
+        bool is_write;
+        int64_t offset;
+        int bytes;
+    } reqs[] = {
+        /* Merged into one write of 1536 bytes */
+        { true,  1024, 512 },
+        { true,  0,    512 },
+        { true,  512,  512 },
+        /* Must see the data written above */
+        { false, 0,    1024 },
+        /* Must not overtake the read */
+        { true,  512,  512 },
+    };
+    QEMUIOVector qiov[ARRAY_SIZE(reqs)];
+    uint8_t buf[ARRAY_SIZE(reqs)][1024];
+    int completed = 0;
+    int i;
+
+    bs = bdrv_new_open_driver(&bdrv_merge_test, "base", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+    s = bs->opaque;
+
+    blk_set_request_merging(blk, true);
+
+    blk_io_plug(blk);
+    for (i = 0; i < ARRAY_SIZE(reqs); i++) {
+        qemu_iovec_init_buf(&qiov[i], buf[i], reqs[i].bytes);
+        if (reqs[i].is_write) {
+            blk_aio_pwritev(blk, reqs[i].offset, &qiov[i], 0,
+                            test_merge_aio_cb, &completed);
+        } else {
+            blk_aio_preadv(blk, reqs[i].offset, &qiov[i], 0,
+                           test_merge_aio_cb, &completed);
+        }
+    }
+    g_assert_cmpint(s->nb_log, ==, 0);
+    blk_io_unplug(blk);
+
+    blk_drain(blk);
+    g_assert_cmpint(completed, ==, ARRAY_SIZE(reqs));
+    g_assert_cmpint(s->nb_log, ==, 3);
+
+    g_assert_true(s->log[0].is_write);
+    g_assert_cmpint(s->log[0].offset, ==, 0);
+    g_assert_cmpint(s->log[0].bytes, ==, 1536);
+
+    g_assert_false(s->log[1].is_write);
+    g_assert_cmpint(s->log[1].offset, ==, 0);
+    g_assert_cmpint(s->log[1].bytes, ==, 1024);
+
+    g_assert_true(s->log[2].is_write);
+    g_assert_cmpint(s->log[2].offset, ==, 512);
+    g_assert_cmpint(s->log[2].bytes, ==, 512);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+#define STATUS_TEST_CLUSTER_SIZE 4096
+
+/*
+ * A format driver that allocates whole clusters on writes, like qcow2 or
+ * vmdk do.  Initially, only the first cluster is allocated.
+ */
+typedef struct BDRVStatusTestState {
+    int nb_block_status;
+    /* One bit per allocated cluster */
+    uint64_t allocated;
+} BDRVStatusTestState;
+
+static bool bdrv_status_test_allocated(BDRVStatusTestState *s, int64_t offset)
+{
+    return s->allocated & (1ULL << (offset / STATUS_TEST_CLUSTER_SIZE));
+}
+
+static int bdrv_status_test_open(BlockDriverState *bs, QDict *options,
+                                 int flags, Error **errp)
+{
+    BDRVStatusTestState *s = bs->opaque;
+
+    s->allocated = 1;
+    return 0;
+}
+
+static int coroutine_fn bdrv_status_test_co_block_status(BlockDriverState *bs,
+                                                         bool want_zero,
+                                                         int64_t offset,
+                                                         int64_t bytes,
+                                                         int64_t *pnum,
+                                                         int64_t *map,
+                                                         BlockDriverState **file)
+{
+    BDRVStatusTestState *s = bs->opaque;
+    bool allocated = bdrv_status_test_allocated(s, offset);
+    int64_t end = offset;
+
+    s->nb_block_status++;
+    while (end < offset + bytes &&
+           bdrv_status_test_allocated(s, end) == allocated) {
+        end = QEMU_ALIGN_DOWN(end, STATUS_TEST_CLUSTER_SIZE) +
+              STATUS_TEST_CLUSTER_SIZE;
+    }
+    *pnum = MIN(end, offset + bytes) - offset;
+    return allocated ? BDRV_BLOCK_DATA : 0;
+}
+
+static int coroutine_fn bdrv_status_test_co_pwritev(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    int flags)
+{
+    BDRVStatusTestState *s = bs->opaque;
+    uint64_t i;
+
+    for (i = offset / STATUS_TEST_CLUSTER_SIZE;
+         i < DIV_ROUND_UP(offset + bytes, STATUS_TEST_CLUSTER_SIZE); i++) {
+        s->allocated |= 1ULL << i;
+    }
+    return 0;
+}
+
+static int bdrv_status_test_get_info(BlockDriverState *bs,
+                                     BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = STATUS_TEST_CLUSTER_SIZE;
+    return 0;
+}
+
+/* "Repairs" the image by allocating everything */
+static int coroutine_fn bdrv_status_test_co_check(BlockDriverState *bs,
+                                                  BdrvCheckResult *res,
+                                                  BdrvCheckMode fix)
+{
+    BDRVStatusTestState *s = bs->opaque;
+
+    if (fix) {
+        s->allocated = ~0ULL;
+    }
+    return 0;
+}
+
+static BlockDriver bdrv_status_test = {
+    .format_name            = "status-test",
+    .instance_size          = sizeof(BDRVStatusTestState),
+    .is_format              = true,
+    .bdrv_open              = bdrv_status_test_open,
+    .bdrv_co_block_status   = bdrv_status_test_co_block_status,
+    .bdrv_co_pwritev        = bdrv_status_test_co_pwritev,
+    .bdrv_get_info          = bdrv_status_test_get_info,
+    .bdrv_co_check          = bdrv_status_test_co_check,
+};
+
+static BlockBackend *test_status_blk_new(BlockDriverState **pbs)
+{
+    BlockBackend *blk = blk_new(qemu_get_aio_context(),
+                                BLK_PERM_ALL, BLK_PERM_ALL);
+    BlockDriverState *bs;
+
+    bs = bdrv_new_open_driver(&bdrv_status_test, "base", BDRV_O_RDWR,
+                              &error_abort);
+    bs->total_sectors = 65536 / BDRV_SECTOR_SIZE;
+    blk_insert_bs(blk, bs, &error_abort);
+
+    *pbs = bs;
+    return blk;
+}
+
+static void test_block_status_cache(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = test_status_blk_new(&bs);
+    BDRVStatusTestState *s = bs->opaque;
+    uint8_t buf[512] = { 0 };
+    int64_t pnum;
+    int ret;
+
+    ret = bdrv_block_status(bs, 0, 65536, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(pnum, ==, 4096);
+    g_assert_cmpint(s->nb_block_status, ==, 1);
+
+    /* Repeated queries, also in the middle of an extent, are cached */
+    ret = bdrv_block_status(bs, 0, 65536, &pnum, NULL, NULL);
+    g_assert_cmpint(pnum, ==, 4096);
+    ret = bdrv_block_status(bs, 1024, 65536, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(pnum, ==, 3072);
+    g_assert_cmpint(s->nb_block_status, ==, 1);
+
+    ret = bdrv_block_status(bs, 8192, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, 0);
+    g_assert_cmpint(pnum, ==, 4096);
+    g_assert_cmpint(s->nb_block_status, ==, 2);
+
+    /* A write invalidates the cached status of the range it touches */
+    ret = blk_pwrite(blk, 8192, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+
+    ret = bdrv_block_status(bs, 8192, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(s->nb_block_status, ==, 3);
+
+    /* ...but not elsewhere */
+    ret = bdrv_block_status(bs, 0, 65536, &pnum, NULL, NULL);
+    g_assert_cmpint(pnum, ==, 4096);
+    g_assert_cmpint(s->nb_block_status, ==, 3);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+/*
+ * A write allocates the whole cluster, so the cached status of the rest of
+ * the cluster must be dropped, too
+ */
+static void test_block_status_cache_cluster(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = test_status_blk_new(&bs);
+    BDRVStatusTestState *s = bs->opaque;
+    uint8_t buf[512] = { 0 };
+    int64_t pnum;
+    int ret;
+
+    ret = bdrv_block_status(bs, 13312, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, 0);
+    g_assert_cmpint(s->nb_block_status, ==, 1);
+
+    ret = blk_pwrite(blk, 12288, buf, sizeof(buf), 0);
+    g_assert_cmpint(ret, ==, sizeof(buf));
+
+    ret = bdrv_block_status(bs, 13312, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(pnum, ==, 3072);
+    g_assert_cmpint(s->nb_block_status, ==, 2);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
+/* Repairs change metadata outside of the I/O path and drop everything */
+static void test_block_status_cache_check(void)
+{
+    BlockDriverState *bs;
+    BlockBackend *blk = test_status_blk_new(&bs);
+    BDRVStatusTestState *s = bs->opaque;
+    BdrvCheckResult res;
+    int64_t pnum;
+    int ret;
+
+    ret = bdrv_block_status(bs, 32768, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, 0);
+    g_assert_cmpint(s->nb_block_status, ==, 1);
+
+    /* Without fixing anything, the cache stays valid */
+    ret = bdrv_check(bs, &res, 0);
+    g_assert_cmpint(ret, ==, 0);
+
+    ret = bdrv_block_status(bs, 32768, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, 0);
+    g_assert_cmpint(s->nb_block_status, ==, 1);
+
+    ret = bdrv_check(bs, &res, BDRV_FIX_LEAKS | BDRV_FIX_ERRORS);
+    g_assert_cmpint(ret, ==, 0);
+
+    ret = bdrv_block_status(bs, 32768, 4096, &pnum, NULL, NULL);
+    g_assert_cmpint(ret & BDRV_BLOCK_DATA, ==, BDRV_BLOCK_DATA);
+    g_assert_cmpint(s->nb_block_status, ==, 2);
+
+    blk_unref(blk);
+    bdrv_unref(bs);
+}
+
 int main(int argc, char **argv)
 {
     bdrv_init();
@@ -80,6 +484,15 @@ int main(int argc, char **argv)
     g_test_add_func("/block-backend/drain_aio_error", test_drain_aio_error);
     g_test_add_func("/block-backend/drain_all_aio_error",
                     test_drain_all_aio_error);
+    g_test_add_func("/block-backend/merge_requests", test_merge_requests);
+    g_test_add_func("/block-backend/merge_requests_overlap",
+                    test_merge_requests_overlap);
+    g_test_add_func("/block-backend/block_status_cache",
+                    test_block_status_cache);
+    g_test_add_func("/block-backend/block_status_cache_cluster",
+                    test_block_status_cache_cluster);
+    g_test_add_func("/block-backend/block_status_cache_check",
+                    test_block_status_cache_check);
 
     return g_test_run();
 }
@@ -793,6 +793,36 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void test_hbitmap_serialize_runs(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint8_t buf[64];
+    uint8_t bad[] = { 63, 2 };
+    ssize_t len;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 + 3, 10);
+    hbitmap_test_set(data, L3 - 64, 64);
+
+    len = hbitmap_serialize_runs(data->hb, buf, sizeof(buf), 0, data->size);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <, hbitmap_serialization_size(data->hb, 0,
+                                                       data->size));
+    g_assert_cmpint(hbitmap_serialize_runs(data->hb, buf, 2, 0, data->size),
+                    ==, -1);
+
+    /* The shadow bitmap still has the bits, so this checks the round trip */
+    hbitmap_reset_all(data->hb);
+    g_assert(hbitmap_deserialize_runs(data->hb, buf, len, 0, data->size,
+                                      true));
+    hbitmap_test_check(data, 0);
+
+    /* A run beyond the end of the region is rejected */
+    g_assert_false(hbitmap_deserialize_runs(data->hb, bad, sizeof(bad), 0, 64,
+                                            true));
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -1093,6 +1123,8 @@ int main(int argc, char **argv)
                      test_hbitmap_serialize_part);
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
+    hbitmap_test_add("/hbitmap/serialize/runs",
+                     test_hbitmap_serialize_runs);
 
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
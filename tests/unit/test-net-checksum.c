@@ -0,0 +1,149 @@
+/*
+ * Internet checksum and Toeplitz hash tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+/* Large enough for the SIMD kernels to fold their lanes several times */
+#define BUF_SIZE (1536 * 1024)
+
+/*
+ * The byte-wise implementation that net_checksum_add_cont() used before it
+ * got vectorized, with 64-bit sums so that it cannot overflow.
+ */
+static uint16_t ref_checksum(const uint8_t *buf, int len, int seq)
+{
+    uint64_t sum1 = 0, sum2 = 0, sum;
+    int i;
+
+    for (i = 0; i < len - 1; i += 2) {
+        sum1 += buf[i];
+        sum2 += buf[i + 1];
+    }
+    if (i < len) {
+        sum1 += buf[i];
+    }
+
+    sum = (seq & 1) ? sum1 + (sum2 << 8) : sum2 + (sum1 << 8);
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void check_checksum(uint8_t *buf, int len)
+{
+    int seq;
+
+    for (seq = 0; seq < 2; seq++) {
+        uint32_t sum = net_checksum_add_cont(len, buf, seq);
+
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        ref_checksum(buf, len, seq));
+    }
+}
+
+static void check_all_lengths(uint8_t *buf)
+{
+    static const int big[] = {
+        1023, 1024, 65535, 65536, 65537, 262143, 262144, 262160,
+        524288, 524320, 524321, BUF_SIZE - 64,
+    };
+    int offset, len, i;
+
+    /* Unaligned buffers, odd and even lengths */
+    for (offset = 0; offset < 64; offset++) {
+        for (len = 0; len <= 300; len++) {
+            check_checksum(buf + offset, len);
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(big); i++) {
+        check_checksum(buf, big[i]);
+        check_checksum(buf + 1, big[i]);
+        check_checksum(buf + 31, big[i]);
+    }
+}
+
+static void test_checksum(void)
+{
+    g_autofree uint8_t *random = g_malloc(BUF_SIZE);
+    g_autofree uint8_t *ones = g_malloc(BUF_SIZE);
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        random[i] = g_test_rand_int();
+    }
+    /* All ones maximize the lane sums of the SIMD kernels */
+    memset(ones, 0xff, BUF_SIZE);
+
+    /* Test each kernel, down to the non-SIMD one */
+    do {
+        check_all_lengths(random);
+        check_all_lengths(ones);
+    } while (test_net_checksum_next_accel());
+}
+
+/* The verification key from the Microsoft RSS specification */
+static uint8_t rss_key[NET_TOEPLITZ_MAX_INPUT + 4] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static uint32_t toeplitz_hash(uint8_t *input, uint32_t len)
+{
+    net_toeplitz_key key;
+    uint32_t result = 0;
+
+    net_toeplitz_key_init(&key, rss_key);
+    net_toeplitz_add(&result, input, len, &key);
+    return result;
+}
+
+static void test_toeplitz_table(void)
+{
+    /* 66.9.149.187:2794 -> 161.142.100.80:1766 from the specification */
+    uint8_t tcp4[] = {
+        66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6,
+    };
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    NetToeplitzTable table;
+    uint32_t len;
+    int i, j;
+
+    net_toeplitz_table_init(&table, rss_key);
+
+    g_assert_cmphex(net_toeplitz_table_hash(&table, tcp4, 8), ==, 0x323e8fc2);
+    g_assert_cmphex(net_toeplitz_table_hash(&table, tcp4, 12), ==, 0x51ccc178);
+
+    for (len = 0; len <= NET_TOEPLITZ_MAX_INPUT; len++) {
+        for (i = 0; i < 64; i++) {
+            for (j = 0; j < len; j++) {
+                input[j] = g_test_rand_int();
+            }
+            g_assert_cmphex(net_toeplitz_table_hash(&table, input, len), ==,
+                            toeplitz_hash(input, len));
+        }
+
+        /* Every key bit must end up in the right place */
+        memset(input, 0xff, len);
+        g_assert_cmphex(net_toeplitz_table_hash(&table, input, len), ==,
+                        toeplitz_hash(input, len));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum", test_checksum);
+    g_test_add_func("/net/toeplitz/table", test_toeplitz_table);
+
+    return g_test_run();
+}
@@ -26,6 +26,22 @@
 /* Stop userspace polling on a handler if it isn't active for some time */
 #define POLL_IDLE_INTERVAL_NS (7 * NANOSECONDS_PER_SECOND)
 
+/*
+ * Adaptive polling assumes that a blocking wait followed by a wakeup costs
+ * about this much, in CPU time and latency, compared to finding the event
+ * by polling.
+ */
+#define POLL_ADAPTIVE_WAKEUP_NS 10000
+
+/* Recompute a handler's polling window every so many samples */
+#define POLL_ADAPTIVE_UPDATE_INTERVAL 32
+
+/* Halve the histogram after this many samples to favour recent behaviour */
+#define POLL_ADAPTIVE_DECAY_SAMPLES 1024
+
+/* Accounting period for the polling CPU budget */
+#define POLL_BUDGET_PERIOD_NS (100 * SCALE_MS)
+
 bool aio_poll_disabled(AioContext *ctx)
 {
     return qatomic_read(&ctx->poll_disable_cnt);
@@ -386,18 +402,130 @@ void aio_dispatch(AioContext *ctx)
     timerlistgroup_run_timers(&ctx->tlg);
 }
 
+/*
+ * Pick the polling window for a handler from its histogram.
+ *
+ * For each candidate window W (a bucket boundary not above poll_max_ns),
+ * events that arrive within W save a blocking wait and cost the time polled
+ * until they arrive, while the others cost W of wasted polling.  Choose the
+ * W with the best balance, or 0 if polling does not pay off at all.
+ */
+static int64_t poll_adaptive_window(AioContext *ctx, AioPollHistogram *hist)
+{
+    int64_t best_ns = 0;
+    int64_t best_score = 0;
+    int64_t hit_cost = 0;
+    uint64_t hits = 0;
+    int i;
+
+    for (i = 0; i < AIO_POLL_HIST_BUCKETS - 1; i++) {
+        int64_t window = 2LL << i;
+        uint64_t misses;
+        int64_t score;
+
+        if (window > ctx->poll_max_ns) {
+            break;
+        }
+
+        hits += hist->bucket[i];
+        /* Assume events are in the middle of the bucket */
+        hit_cost += (int64_t)hist->bucket[i] * (3LL << i) / 2;
+        misses = hist->samples - hits;
+
+        score = (int64_t)hits * POLL_ADAPTIVE_WAKEUP_NS - hit_cost -
+                (int64_t)misses * window;
+        if (score > best_score) {
+            best_score = score;
+            best_ns = window;
+        }
+    }
+    return best_ns;
+}
+
+/* Record how long it took @node to become ready */
+static void poll_adaptive_add_sample(AioContext *ctx, AioHandler *node,
+                                     int64_t delay_ns)
+{
+    AioPollHistogram *hist = &node->poll_hist;
+    int i;
+
+    i = delay_ns > 0 ? 63 - clz64(delay_ns) : 0;
+    hist->bucket[MIN(i, AIO_POLL_HIST_BUCKETS - 1)]++;
+    hist->samples++;
+
+    if (hist->samples % POLL_ADAPTIVE_UPDATE_INTERVAL == 0) {
+        int64_t old = node->poll_ns;
+
+        node->poll_ns = poll_adaptive_window(ctx, hist);
+        if (node->poll_ns != old) {
+            trace_poll_adaptive_window(ctx, node, old, node->poll_ns);
+        }
+    }
+
+    if (hist->samples >= POLL_ADAPTIVE_DECAY_SAMPLES) {
+        hist->samples = 0;
+        for (i = 0; i < AIO_POLL_HIST_BUCKETS; i++) {
+            hist->bucket[i] /= 2;
+            hist->samples += hist->bucket[i];
+        }
+    }
+}
+
+/* The context's polling time in adaptive mode: the longest handler window */
+static int64_t poll_adaptive_ns(AioContext *ctx)
+{
+    AioHandler *node;
+    int64_t poll_ns = 0;
+
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        poll_ns = MAX(poll_ns, node->poll_ns);
+    }
+    return MIN(poll_ns, ctx->poll_max_ns);
+}
+
+/* Whether the polling CPU budget for the current period is used up */
+static bool poll_budget_exhausted(AioContext *ctx)
+{
+    int64_t cpu_budget = qatomic_read(&ctx->poll_cpu_budget);
+    int64_t now;
+
+    if (!cpu_budget) {
+        return false;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - ctx->poll_budget_start >= POLL_BUDGET_PERIOD_NS) {
+        ctx->poll_budget_start = now;
+        ctx->poll_budget_used = 0;
+    }
+    return ctx->poll_budget_used >=
+           POLL_BUDGET_PERIOD_NS / 100 * cpu_budget;
+}
+
 static bool run_poll_handlers_once(AioContext *ctx,
                                    int64_t now,
+                                   int64_t elapsed_ns,
                                    int64_t *timeout)
 {
+    bool adaptive = qatomic_read(&ctx->poll_adaptive);
     bool progress = false;
     AioHandler *node;
     AioHandler *tmp;
 
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
+        /*
+         * In adaptive mode each handler is only polled for its own window.
+         * ctx->notifier is always polled so that aio_notify() ends polling.
+         */
+        if (adaptive && elapsed_ns > node->poll_ns &&
+            node->opaque != &ctx->notifier) {
+            continue;
+        }
         if (aio_node_check(ctx, node->is_external) &&
             node->io_poll(node->opaque)) {
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
+            if (adaptive) {
+                poll_adaptive_add_sample(ctx, node, elapsed_ns);
+            }
 
             /*
              * Polling was successful, exit try_poll_mode immediately
@@ -489,13 +617,23 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
     RCU_READ_LOCK_GUARD();
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed_time = 0;
     do {
-        progress = run_poll_handlers_once(ctx, start_time, timeout);
+        progress = run_poll_handlers_once(ctx, start_time, elapsed_time,
+                                          timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
+    ctx->poll_budget_used += elapsed_time;
+    if (progress) {
+        stat64_add(&ctx->poll_hits, 1);
+    } else {
+        stat64_add(&ctx->poll_misses, 1);
+        stat64_add(&ctx->poll_wasted_ns, elapsed_time);
+    }
+
     if (remove_idle_poll_handlers(ctx, start_time + elapsed_time)) {
         *timeout = 0;
         progress = true;
@@ -529,7 +667,14 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
         return false;
     }
 
+    if (qatomic_read(&ctx->poll_adaptive)) {
+        ctx->poll_ns = poll_adaptive_ns(ctx);
+    }
+
     max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    if (max_ns && poll_budget_exhausted(ctx)) {
+        max_ns = 0;
+    }
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
         poll_set_started(ctx, true);
 
@@ -616,7 +761,21 @@ bool aio_poll(AioContext *ctx, bool blocking)
     aio_notify_accept(ctx);
 
     /* Adjust polling time */
-    if (ctx->poll_max_ns) {
+    if (ctx->poll_max_ns && qatomic_read(&ctx->poll_adaptive)) {
+        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        AioHandler *node;
+
+        /*
+         * Handlers that were not found by polling became ready after
+         * block_ns.  The polling windows are recomputed from these samples,
+         * so there is nothing to grow or shrink here.
+         */
+        QLIST_FOREACH(node, &ready_list, node_ready) {
+            if (node->io_poll) {
+                poll_adaptive_add_sample(ctx, node, block_ns);
+            }
+        }
+    } else if (ctx->poll_max_ns) {
         int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 
         if (block_ns <= ctx->poll_ns) {
@@ -716,3 +875,19 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 
     aio_notify(ctx);
 }
+
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   int64_t cpu_budget, Error **errp)
+{
+    if (cpu_budget < 0 || cpu_budget > 100) {
+        error_setg(errp, "poll CPU budget must be in range [0, 100]");
+        return;
+    }
+
+    /* Same as aio_context_set_poll_params(), no synchronization needed */
+    qatomic_set(&ctx->poll_adaptive, adaptive);
+    qatomic_set(&ctx->poll_cpu_budget, cpu_budget);
+    ctx->poll_ns = 0;
+
+    aio_notify(ctx);
+}
@@ -19,6 +19,18 @@
 
 #include "block/aio.h"
 
+/*
+ * Log2 histogram of how long it took a handler to become ready in aio_poll(),
+ * used for adaptive polling.  Bucket i counts delays in [2^i, 2^(i+1)) ns;
+ * the last bucket also holds everything longer.
+ */
+#define AIO_POLL_HIST_BUCKETS 24
+
+typedef struct {
+    uint32_t bucket[AIO_POLL_HIST_BUCKETS];
+    uint32_t samples;
+} AioPollHistogram;
+
 struct AioHandler {
     GPollFD pfd;
     IOHandler *io_read;
@@ -36,6 +48,8 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_ns; /* polling window in adaptive mode */
+    AioPollHistogram poll_hist; /* only used in adaptive mode */
     bool is_external;
 };
 
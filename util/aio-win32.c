@@ -440,3 +440,11 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
         error_setg(errp, "AioContext polling is not implemented on Windows");
     }
 }
+
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   int64_t cpu_budget, Error **errp)
+{
+    if (adaptive) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
@@ -536,6 +536,11 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_max_ns = 0;
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
+    ctx->poll_adaptive = false;
+    ctx->poll_cpu_budget = 0;
+    stat64_init(&ctx->poll_hits, 0);
+    stat64_init(&ctx->poll_misses, 0);
+    stat64_init(&ctx->poll_wasted_ns, 0);
 
     return ctx;
 fail:
@@ -630,6 +635,13 @@ void aio_co_enter(AioContext *ctx, struct Coroutine *co)
     }
 }
 
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats)
+{
+    stats->hits = stat64_get(&ctx->poll_hits);
+    stats->misses = stat64_get(&ctx->poll_misses);
+    stats->wasted_ns = stat64_get(&ctx->poll_wasted_ns);
+}
+
 void aio_context_ref(AioContext *ctx)
 {
     g_source_ref(&ctx->source);
@@ -689,6 +689,107 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     }
 }
 
+/* Append @val to @buf as unsigned LEB128.  Returns false if it doesn't fit. */
+static bool hb_put_uleb128(uint8_t *buf, size_t size, size_t *pos,
+                           uint64_t val)
+{
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        if (*pos >= size) {
+            return false;
+        }
+        buf[(*pos)++] = byte | (val ? 0x80 : 0);
+    } while (val);
+
+    return true;
+}
+
+static bool hb_get_uleb128(const uint8_t *buf, size_t size, size_t *pos,
+                           uint64_t *val)
+{
+    unsigned shift = 0;
+    uint8_t byte;
+
+    *val = 0;
+    do {
+        if (*pos >= size || shift >= 64) {
+            return false;
+        }
+        byte = buf[(*pos)++];
+        *val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return true;
+}
+
+ssize_t hbitmap_serialize_runs(const HBitmap *hb, uint8_t *buf, size_t size,
+                               uint64_t start, uint64_t count)
+{
+    uint64_t end = start + count;
+    uint64_t prev = start >> hb->granularity;
+    int64_t dirty_start, dirty_count;
+    size_t pos = 0;
+
+    if (!count) {
+        return 0;
+    }
+    assert(QEMU_IS_ALIGNED(start, hbitmap_serialization_align(hb)));
+
+    while (hbitmap_next_dirty_area(hb, start, end, INT64_MAX,
+                                   &dirty_start, &dirty_count))
+    {
+        uint64_t first = dirty_start >> hb->granularity;
+        uint64_t last = (dirty_start + dirty_count - 1) >> hb->granularity;
+
+        if (!hb_put_uleb128(buf, size, &pos, first - prev) ||
+            !hb_put_uleb128(buf, size, &pos, last - first + 1))
+        {
+            return -1;
+        }
+        prev = last + 1;
+        start = dirty_start + dirty_count;
+    }
+
+    return pos;
+}
+
+bool hbitmap_deserialize_runs(HBitmap *hb, const uint8_t *buf, size_t size,
+                              uint64_t start, uint64_t count, bool finish)
+{
+    uint64_t cur, end;
+    size_t pos = 0;
+
+    if (!count) {
+        return size == 0;
+    }
+
+    hbitmap_deserialize_zeroes(hb, start, count, false);
+
+    cur = start >> hb->granularity;
+    end = ((start + count - 1) >> hb->granularity) + 1;
+    while (pos < size) {
+        uint64_t gap, len;
+
+        if (!hb_get_uleb128(buf, size, &pos, &gap) ||
+            !hb_get_uleb128(buf, size, &pos, &len) ||
+            !len || gap > end - cur || len > end - cur - gap)
+        {
+            return false;
+        }
+        cur += gap;
+        hb_set_between(hb, HBITMAP_LEVELS - 1, cur, cur + len - 1);
+        cur += len;
+    }
+
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+    return true;
+}
+
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
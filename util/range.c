@@ -20,24 +20,6 @@
 #include "qemu/osdep.h"
 #include "qemu/range.h"
 
-/*
- * Return -1 if @a < @b, 1 @a > @b, and 0 if they touch or overlap.
- * Both @a and @b must not be empty.
- */
-static inline int range_compare(Range *a, Range *b)
-{
-    assert(!range_is_empty(a) && !range_is_empty(b));
-
-    /* Careful, avoid wraparound */
-    if (b->lob && b->lob - 1 > a->upb) {
-        return -1;
-    }
-    if (a->lob && a->lob - 1 > b->upb) {
-        return 1;
-    }
-    return 0;
-}
-
 /* Insert @data into @list of ranges; caller no longer owns @data */
 GList *range_list_insert(GList *list, Range *data)
 {
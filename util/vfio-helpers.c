@@ -22,11 +22,11 @@
 #include "standard-headers/linux/pci_regs.h"
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
+#include "qemu/iova-tree.h"
 #include "qemu/lockable.h"
+#include "qemu/host-utils.h"
 #include "trace.h"
 
-#define QEMU_VFIO_DEBUG 0
-
 #define QEMU_VFIO_IOVA_MIN 0x10000ULL
 /* XXX: Once VFIO exposes the iova bit width in the IOMMU capability interface,
  * we can use a runtime limit; alternatively it's also possible to do platform
@@ -34,12 +34,11 @@
  **/
 #define QEMU_VFIO_IOVA_MAX (1ULL << 39)
 
-typedef struct {
-    /* Page aligned addr. */
-    void *host;
-    size_t size;
-    uint64_t iova;
-} IOVAMapping;
+/*
+ * Largest alignment used when placing fixed mappings, see
+ * qemu_vfio_fixed_iova_align().
+ */
+#define QEMU_VFIO_IOVA_MAX_ALIGN (1ULL << 30)
 
 struct IOVARange {
     uint64_t start;
@@ -93,11 +92,16 @@ struct QEMUVFIOState {
      *   mappings. At each qemu_vfio_dma_reset_temporary() call, the whole area
      *   is recycled. The caller should make sure I/O's depending on these
      *   mappings are completed before calling.
+     *
+     * Fixed mappings are indexed by host virtual address in @mappings, so
+     * that lookups and insertions are O(log n) in the number of mappings.
+     * Each DMAMap in the tree describes the host range
+     * [map->iova, map->iova + map->size] (size is inclusive) and
+     * map->translated_addr is the IOVA the range is mapped at.
      **/
     uint64_t low_water_mark;
     uint64_t high_water_mark;
-    IOVAMapping *mappings;
-    int nr_mappings;
+    IOVATree *mappings;
 };
 
 /**
@@ -500,6 +504,7 @@ static void qemu_vfio_open_common(QEMUVFIOState *s)
     qemu_mutex_init(&s->lock);
     s->ram_notifier.ram_block_added = qemu_vfio_ram_block_added;
     s->ram_notifier.ram_block_removed = qemu_vfio_ram_block_removed;
+    s->mappings = iova_tree_new();
     ram_block_notifier_add(&s->ram_notifier);
     s->low_water_mark = QEMU_VFIO_IOVA_MIN;
     s->high_water_mark = QEMU_VFIO_IOVA_MAX;
@@ -535,88 +540,66 @@ QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
     return s;
 }
 
+static gboolean qemu_vfio_dump_mapping(DMAMap *map)
+{
+    trace_qemu_vfio_dump_mapping((void *)(uintptr_t)map->iova,
+                                 map->translated_addr, map->size + 1);
+    return false;
+}
+
 static void qemu_vfio_dump_mappings(QEMUVFIOState *s)
 {
-    for (int i = 0; i < s->nr_mappings; ++i) {
-        trace_qemu_vfio_dump_mapping(s->mappings[i].host,
-                                     s->mappings[i].iova,
-                                     s->mappings[i].size);
+    if (trace_event_get_state_backends(TRACE_QEMU_VFIO_DUMP_MAPPING)) {
+        iova_tree_foreach(s->mappings, qemu_vfio_dump_mapping);
     }
 }
 
 /**
- * Find the mapping entry that contains [host, host + size) and set @index to
- * the position. If no entry contains it, @index is the position _after_ which
- * to insert the new mapping. IOW, it is the index of the largest element that
- * is smaller than @host, or -1 if no entry is.
+ * Find the fixed mapping that overlaps with [host, host + size), or NULL if
+ * there is none.
  */
-static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
-                                           int *index)
+static DMAMap *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
+                                      size_t size)
 {
-    IOVAMapping *p = s->mappings;
-    IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
-    IOVAMapping *mid;
+    DMAMap needle = {
+        .iova = (uintptr_t)host,
+        .size = size - 1,
+    };
+
     trace_qemu_vfio_find_mapping(s, host);
-    if (!p) {
-        *index = -1;
-        return NULL;
-    }
-    while (true) {
-        mid = p + (q - p) / 2;
-        if (mid == p) {
-            break;
-        }
-        if (mid->host > host) {
-            q = mid;
-        } else if (mid->host < host) {
-            p = mid;
-        } else {
-            break;
-        }
-    }
-    if (mid->host > host) {
-        mid--;
-    } else if (mid < &s->mappings[s->nr_mappings - 1]
-               && (mid + 1)->host <= host) {
-        mid++;
-    }
-    *index = mid - &s->mappings[0];
-    if (mid >= &s->mappings[0] &&
-        mid->host <= host && mid->host + mid->size > host) {
-        assert(mid < &s->mappings[s->nr_mappings]);
-        return mid;
-    }
-    /* At this point *index + 1 is the right position to insert the new
-     * mapping.*/
-    return NULL;
+    return iova_tree_find(s->mappings, &needle);
+}
+
+/* Whether @mapping covers the whole [host, host + size) range. */
+static bool qemu_vfio_mapping_contains(const DMAMap *mapping, void *host,
+                                       size_t size)
+{
+    uintptr_t start = (uintptr_t)host;
+
+    return mapping->iova <= start &&
+           start + size - 1 <= mapping->iova + mapping->size;
 }
 
 /**
- * Allocate IOVA and create a new mapping record and insert it in @s.
+ * Create a new mapping record for [host, host + size) at @iova and insert it
+ * in @s.
  */
-static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
-                                          void *host, size_t size,
-                                          int index, uint64_t iova)
+static int qemu_vfio_add_mapping(QEMUVFIOState *s, void *host, size_t size,
+                                 uint64_t iova)
 {
-    int shift;
-    IOVAMapping m = {.host = host, .size = size, .iova = iova};
-    IOVAMapping *insert;
+    DMAMap m = {
+        .iova = (uintptr_t)host,
+        .translated_addr = iova,
+        .size = size - 1,
+        .perm = IOMMU_RW,
+    };
 
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(s->low_water_mark, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(s->high_water_mark, qemu_real_host_page_size));
-    trace_qemu_vfio_new_mapping(s, host, size, index, iova);
-
-    assert(index >= 0);
-    s->nr_mappings++;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
-    insert = &s->mappings[index];
-    shift = s->nr_mappings - index - 1;
-    if (shift) {
-        memmove(insert + 1, insert, shift * sizeof(s->mappings[0]));
-    }
-    *insert = m;
-    return insert;
+    trace_qemu_vfio_new_mapping(s, host, size, iova);
+
+    return iova_tree_insert(s->mappings, &m) == IOVA_OK ? 0 : -EEXIST;
 }
 
 /* Do the DMA mapping with VFIO. */
@@ -640,70 +623,78 @@ static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
 }
 
 /**
- * Undo the DMA mapping from @s with VFIO, and remove from mapping list.
+ * Undo the DMA mapping from @s with VFIO, and remove from mapping index.
  */
-static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
+static void qemu_vfio_undo_mapping(QEMUVFIOState *s, DMAMap *mapping,
                                    Error **errp)
 {
-    int index;
+    DMAMap range = {
+        .iova = mapping->iova,
+        .size = mapping->size,
+    };
     struct vfio_iommu_type1_dma_unmap unmap = {
         .argsz = sizeof(unmap),
         .flags = 0,
-        .iova = mapping->iova,
-        .size = mapping->size,
+        .iova = mapping->translated_addr,
+        .size = mapping->size + 1,
     };
 
-    index = mapping - s->mappings;
-    assert(mapping->size > 0);
-    assert(QEMU_IS_ALIGNED(mapping->size, qemu_real_host_page_size));
-    assert(index >= 0 && index < s->nr_mappings);
+    assert(QEMU_IS_ALIGNED(unmap.size, qemu_real_host_page_size));
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg_errno(errp, errno, "VFIO_UNMAP_DMA failed");
     }
-    memmove(mapping, &s->mappings[index + 1],
-            sizeof(s->mappings[0]) * (s->nr_mappings - index - 1));
-    s->nr_mappings--;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
+    /* @mapping is freed by the tree, so remove it by its range */
+    iova_tree_remove(s->mappings, &range);
 }
 
-/* Check if the mapping list is (ascending) ordered. */
-static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
+/*
+ * Alignment to use for the IOVA of a fixed mapping of @size bytes.
+ *
+ * The IOMMU can only use large page table entries (2M, 1G) when the IOVA and
+ * the host address have the same offset within the large page. Guest RAM is
+ * usually backed by (transparent) huge pages, so place big mappings at an
+ * IOVA that is congruent to the host address modulo the largest power of two
+ * not exceeding @size. This cuts the number of IOMMU page table entries and
+ * IOTLB misses for guest RAM, at the cost of some IOVA space.
+ */
+static uint64_t qemu_vfio_fixed_iova_align(size_t size)
 {
-    int i;
-    if (QEMU_VFIO_DEBUG) {
-        for (i = 0; i < s->nr_mappings - 1; ++i) {
-            if (!(s->mappings[i].host < s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d not sorted!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-            if (!(s->mappings[i].host + s->mappings[i].size <=
-                  s->mappings[i + 1].host)) {
-                fprintf(stderr, "item %d overlap with next!\n", i);
-                qemu_vfio_dump_mappings(s);
-                return false;
-            }
-        }
-    }
-    return true;
+    return MAX(MIN(pow2floor(size), QEMU_VFIO_IOVA_MAX_ALIGN),
+               qemu_real_host_page_size);
 }
 
 static int
-qemu_vfio_find_fixed_iova(QEMUVFIOState *s, size_t size, uint64_t *iova)
+qemu_vfio_find_fixed_iova(QEMUVFIOState *s, void *host, size_t size,
+                          uint64_t *iova)
 {
+    uint64_t align = qemu_vfio_fixed_iova_align(size);
+    uint64_t host_ofs = (uintptr_t)host & (align - 1);
     int i;
 
     for (i = 0; i < s->nb_iova_ranges; i++) {
+        uint64_t start;
+
         if (s->usable_iova_ranges[i].end < s->low_water_mark) {
             continue;
         }
         s->low_water_mark =
             MAX(s->low_water_mark, s->usable_iova_ranges[i].start);
 
-        if (s->usable_iova_ranges[i].end - s->low_water_mark + 1 >= size ||
-            s->usable_iova_ranges[i].end - s->low_water_mark + 1 == 0) {
-            *iova = s->low_water_mark;
-            s->low_water_mark += size;
+        /* Lowest IOVA >= low_water_mark with the same offset as @host */
+        start = QEMU_ALIGN_DOWN(s->low_water_mark, align) + host_ofs;
+        if (start < s->low_water_mark) {
+            start += align;
+        }
+        if (start > s->usable_iova_ranges[i].end) {
+            continue;
+        }
+        if (s->usable_iova_ranges[i].end - start + 1 >= size ||
+            s->usable_iova_ranges[i].end - start + 1 == 0) {
+            if (start + size > s->high_water_mark) {
+                return -ENOMEM;
+            }
+            *iova = start;
+            s->low_water_mark = start + size;
             return 0;
         }
     }
@@ -734,46 +725,47 @@ qemu_vfio_find_temp_iova(QEMUVFIOState *s, size_t size, uint64_t *iova)
 
 /* Map [host, host + size) area into a contiguous IOVA address space, and store
  * the result in @iova if not NULL. The caller need to make sure the area is
- * aligned to page size, and mustn't overlap with existing mapping areas (split
- * mapping status within this area is not allowed).
+ * aligned to page size. A fixed mapping mustn't partially overlap with
+ * existing fixed mapping areas (split mapping status within this area is not
+ * allowed); a temporary one that does is simply mapped on its own.
  */
 int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                       bool temporary, uint64_t *iova)
 {
     int ret = 0;
-    int index;
-    IOVAMapping *mapping;
+    DMAMap *mapping;
     uint64_t iova0;
 
     assert(QEMU_PTR_IS_ALIGNED(host, qemu_real_host_page_size));
     assert(QEMU_IS_ALIGNED(size, qemu_real_host_page_size));
     trace_qemu_vfio_dma_map(s, host, size, temporary, iova);
     qemu_mutex_lock(&s->lock);
-    mapping = qemu_vfio_find_mapping(s, host, &index);
-    if (mapping) {
-        iova0 = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
+    mapping = qemu_vfio_find_mapping(s, host, size);
+    if (mapping && qemu_vfio_mapping_contains(mapping, host, size)) {
+        iova0 = mapping->translated_addr + ((uintptr_t)host - mapping->iova);
     } else {
         if (s->high_water_mark - s->low_water_mark + 1 < size) {
             ret = -ENOMEM;
             goto out;
         }
         if (!temporary) {
-            if (qemu_vfio_find_fixed_iova(s, size, &iova0)) {
-                ret = -ENOMEM;
+            if (mapping) {
+                error_report("qemu_vfio_dma_map: %p+0x%zx partially overlaps "
+                             "an existing mapping", host, size);
+                ret = -EINVAL;
                 goto out;
             }
-
-            mapping = qemu_vfio_add_mapping(s, host, size, index + 1, iova0);
-            if (!mapping) {
+            if (qemu_vfio_find_fixed_iova(s, host, size, &iova0)) {
                 ret = -ENOMEM;
                 goto out;
             }
-            assert(qemu_vfio_verify_mappings(s));
+
             ret = qemu_vfio_do_mapping(s, host, size, iova0);
             if (ret) {
-                qemu_vfio_undo_mapping(s, mapping, NULL);
                 goto out;
             }
+            ret = qemu_vfio_add_mapping(s, host, size, iova0);
+            assert(!ret);
             qemu_vfio_dump_mappings(s);
         } else {
             if (qemu_vfio_find_temp_iova(s, size, &iova0)) {
@@ -818,8 +810,7 @@ int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
  * qemu_vfio_dma_map(). */
 void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 {
-    int index = 0;
-    IOVAMapping *m;
+    DMAMap *m;
 
     if (!host) {
         return;
@@ -827,7 +818,7 @@ void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host)
 
     trace_qemu_vfio_dma_unmap(s, host);
     qemu_mutex_lock(&s->lock);
-    m = qemu_vfio_find_mapping(s, host, &index);
+    m = qemu_vfio_find_mapping(s, host, 1);
     if (!m) {
         goto out;
     }
@@ -844,15 +835,21 @@ static void qemu_vfio_reset(QEMUVFIOState *s)
 /* Close and free the VFIO resources. */
 void qemu_vfio_close(QEMUVFIOState *s)
 {
-    int i;
+    DMAMap all = {
+        .iova = 0,
+        .size = HWADDR_MAX,
+    };
+    DMAMap *m;
 
     if (!s) {
         return;
     }
-    for (i = 0; i < s->nr_mappings; ++i) {
-        qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
+    while ((m = iova_tree_find(s->mappings, &all))) {
+        qemu_vfio_undo_mapping(s, m, NULL);
     }
     ram_block_notifier_remove(&s->ram_notifier);
+    iova_tree_destroy(s->mappings);
+    s->mappings = NULL;
     g_free(s->usable_iova_ranges);
     s->nb_iova_ranges = 0;
     qemu_vfio_reset(s);